@@ -0,0 +1,79 @@
+// capabilities_benchmark.cpp : Measures capabilities string parsing throughput.
+//
+#include "../capabilities.h"
+#include "capabilities_corpus.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+
+size_t CountBytes(VCPCapabilityElement const& element)
+{
+  auto bytes = sizeof element + element.Children.capacity() * sizeof element;
+  if (element.ValueType == VCPCapabilityValueType::Text)
+  {
+    bytes += std::get<std::string>(element.Value).capacity();
+  }
+  for (const auto& child : element.Children)
+  {
+    bytes += CountBytes(child) - sizeof child;
+  }
+  return bytes;
+}
+
+template<typename Parse>
+void Run(char const* name, int iterations, size_t bytesPerPass, Parse parse)
+{
+  // Keeps the optimizer from discarding the parse results.
+  size_t count = 0;
+  const auto startTime = std::chrono::steady_clock::now();
+  for (auto i = 0; i < iterations; ++i)
+  {
+    for (const auto& capabilities : CapabilitiesCorpus)
+    {
+      count += parse(capabilities);
+    }
+  }
+  const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+  const auto strings = static_cast<double>(iterations) * CapabilitiesCorpus.size();
+  const auto megabytes = static_cast<double>(iterations) * bytesPerPass / (1024.0 * 1024.0);
+  std::cout << name << ": parsed " << strings << " capabilities strings (" << count << ")" << std::endl;
+  std::cout << "  " << (elapsed * 1e9 / strings) << " ns/string" << std::endl;
+  std::cout << "  " << (megabytes / elapsed) << " MiB/s" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  const auto iterations = (argc > 1) ? std::atoi(argv[1]) : 20000;
+
+  size_t bytesPerPass = 0;
+  size_t nestedBytes = 0;
+  size_t flatBytes = 0;
+  for (const auto& capabilities : CapabilitiesCorpus)
+  {
+    bytesPerPass += capabilities.size();
+    for (const auto& element : ParseCapabilitiesString(capabilities))
+    {
+      nestedBytes += CountBytes(element);
+    }
+    const CapabilityTree tree{ std::string{ capabilities } };
+    flatBytes += sizeof tree + tree.String().capacity() + tree.Nodes().capacity() * sizeof(CapabilityTree::Node);
+  }
+
+  Run("Nested", iterations, bytesPerPass, [](std::string_view capabilities)
+    {
+      return ParseCapabilitiesString(capabilities).size();
+    });
+  Run("Flat", iterations, bytesPerPass, [](std::string_view capabilities)
+    {
+      return CapabilityTree{ std::string{ capabilities } }.Nodes().size();
+    });
+
+  std::cout << "Footprint over " << CapabilitiesCorpus.size() << " strings: nested " << nestedBytes
+    << " bytes, flat " << flatBytes << " bytes" << std::endl;
+  return 0;
+}
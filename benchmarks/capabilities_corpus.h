@@ -0,0 +1,42 @@
+// capabilities_corpus.h : Capabilities strings as reported by real monitors.
+//
+#pragma once
+
+#include <array>
+#include <string_view>
+
+
+constexpr std::array<std::string_view, 6> CapabilitiesCorpus
+{
+  // Dell U2415
+  "(prot(monitor)type(LCD)model(U2415)cmds(01 02 03 07 0C E3 F3)vcp(02 04 05 08 10 12 14(01 04 05 06 08 09 0B 0C) "
+  "16 18 1A 52 60(0F 10 11 12) AA(01 02 04) AC AE B2 B6 C6 C8 C9 D6(01 04 05) DC(00 02 03 05) DF E0 E1 "
+  "E2(00 01 02 04 0E 12 14 19 1D) F0(00 08) F1(01 02) F2 FD)mswhql(1)asset_eep(40)mccs_ver(2.1))",
+
+  // LG 27GL850
+  "(prot(monitor)type(LCD)model(LG FULLHD)cmds(01 02 03 0C E3 F3)vcp(02 04 05 08 10 12 14(05 06 08 0B) 16 18 1A 52 "
+  "60(11 12 0F 10) AC AE B2 B6 C0 C6 C8 C9 D6(01 04) DF 62 8D F4 F5(00 01 02) F6(00 01 02) 4D 4E 4F "
+  "15(01 06 09 10 11 13 14 28 29 32 44 48) F7(00 01 02 03) F8(00 01) F9 EF FD(00 01) FE(00 01 02) FF)"
+  "mccs_ver(2.1)mswhql(1))",
+
+  // ASUS PB278
+  "(prot(monitor)type(LCD)model(PB278)cmds(01 02 03 07 0C F3)vcp(02 04 05 08 0B 0C 10 12 14(05 06 08 0B) 16 18 1A "
+  "60(01 03 11 0F) 62 6C 6E 70 8D(01 02) A8 AC AE B6 C6 C8 C9 CC(01 02 03 04 05 06 07 08 09 0A 0C 0D 11 12 14 1A 1E "
+  "1F 20 24) D6(01 04) DF)mswhql(1)asset_eep(32)mpu(01)mccs_ver(2.1)vcpname(14(User)))",
+
+  // HP Z27n
+  "(prot(monitor)type(lcd)model(HP Z27n)cmds(01 02 03 07 0C E3 F3)vcp(02 04 05 08 0B 0C 10 12 14(01 02 04 05 06 08 "
+  "0B) 16 18 1A 52 60(01 03 04 0F 10 11 12) 62 6C 6E 70 86(02 0B) 87 AC AE B6 C0 C6 C8 C9 CA(01 02) CC(01 02 03 04 "
+  "05 06 07 08 09 0A 0D 0E 12 14 16 1E) D6(01 04 05) DC(00 02 03 05 08 0E) DF E9(00 02) FF)mccs_ver(2.2)"
+  "window1(type(PIP) area(25 25 1919 1079) max(640 480) min(10 10) window(10))vcpname(10(Brightness)))",
+
+  // Samsung C27F390
+  "(prot(monitor)type(LCD)model(C27F390)cmds(01 02 03 07 0C E3 F3)vcp(02 04 05 08 10 12 14(05 08 0B) 16 18 1A 52 "
+  "60(01 03 11) AC AE B2 B6 C6 C8 C9 D6(01 04 05) DC(00 02 03 05 08 0E) DF)mccs_ver(2.1)mswhql(1))",
+
+  // BenQ EW3270U
+  "(prot(monitor)type(LCD)model(EW3270U)cmds(01 02 03 07 0C E3 F3)vcp(02 04 05 08 0B 0C 10 12 14(04 05 06 08 0B) "
+  "16 18 1A 52 60(0F 11 12 1B) 62 6C 6E 70 86(01 02 03 05 06 07 08 09 0A 0B 0C) 87 8D(01 02) AC AE B6 C0 C6 C8 "
+  "C9 CA(01 02) CC(01 02 03 04 05 06 07 08 09 0A 0C 0D 0E 11 12 14 16 17 1A 1E 1F 20 23 24) D6(01 04 05) "
+  "DC(00 03 04 05 08 0B 0E 0F 10 11 12 13 14) DF E9(00 01 02 03 04) F4 F5 FF)mswhql(1)asset_eep(40)mccs_ver(2.2))",
+};
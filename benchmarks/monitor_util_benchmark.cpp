@@ -0,0 +1,445 @@
+// monitor_util_benchmark.cpp : Latency and allocation benchmarks for the paths a
+// hotkey goes through: capabilities parsing, monitor enumeration and VCP round
+// trips against simulated monitors, blocking and async.
+//
+// monitor_util_benchmark [--iterations N] [--simulate FILE]
+//
+// Without --simulate the simulated monitors answer instantly, so the numbers
+// are the software overhead alone. With a simulation file they include its
+// transaction latency and command gaps, like a real hotkey press.
+//
+#include "../capabilities.h"
+#include "../ddc_ci.h"
+#include "../monitor_operations.h"
+#include "../monitor_utils.h"
+#include "../simulated_backend.h"
+#include "capabilities_corpus.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+
+// Every allocation in the process, on any thread, goes through here. All the
+// forms of new and delete are replaced together, so memory is always freed by
+// the allocator that gave it out.
+std::atomic<uint64_t> AllocationCount{ 0 };
+
+void* Allocate(size_t size) noexcept
+{
+  ++AllocationCount;
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+void* AllocateAligned(size_t size, std::align_val_t alignment) noexcept
+{
+  ++AllocationCount;
+  const auto bytes = static_cast<size_t>(alignment);
+#ifdef _WIN32
+  return _aligned_malloc(size == 0 ? 1 : size, bytes);
+#else
+  // aligned_alloc() wants a multiple of the alignment.
+  return std::aligned_alloc(bytes, ((std::max)(size, size_t{ 1 }) + bytes - 1) / bytes * bytes);
+#endif
+}
+
+void Free(void* memory) noexcept
+{
+  std::free(memory);
+}
+
+void FreeAligned(void* memory) noexcept
+{
+#ifdef _WIN32
+  _aligned_free(memory);
+#else
+  std::free(memory);
+#endif
+}
+
+void* AllocateOrThrow(void* memory)
+{
+  if (!memory)
+  {
+    throw std::bad_alloc{};
+  }
+  return memory;
+}
+
+void* operator new(size_t size) { return AllocateOrThrow(Allocate(size)); }
+void* operator new[](size_t size) { return AllocateOrThrow(Allocate(size)); }
+void* operator new(size_t size, std::nothrow_t const&) noexcept { return Allocate(size); }
+void* operator new[](size_t size, std::nothrow_t const&) noexcept { return Allocate(size); }
+void* operator new(size_t size, std::align_val_t alignment) { return AllocateOrThrow(AllocateAligned(size, alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment) { return AllocateOrThrow(AllocateAligned(size, alignment)); }
+void* operator new(size_t size, std::align_val_t alignment, std::nothrow_t const&) noexcept { return AllocateAligned(size, alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, std::nothrow_t const&) noexcept { return AllocateAligned(size, alignment); }
+
+void operator delete(void* memory) noexcept { Free(memory); }
+void operator delete[](void* memory) noexcept { Free(memory); }
+void operator delete(void* memory, size_t) noexcept { Free(memory); }
+void operator delete[](void* memory, size_t) noexcept { Free(memory); }
+void operator delete(void* memory, std::nothrow_t const&) noexcept { Free(memory); }
+void operator delete[](void* memory, std::nothrow_t const&) noexcept { Free(memory); }
+void operator delete(void* memory, std::align_val_t) noexcept { FreeAligned(memory); }
+void operator delete[](void* memory, std::align_val_t) noexcept { FreeAligned(memory); }
+void operator delete(void* memory, size_t, std::align_val_t) noexcept { FreeAligned(memory); }
+void operator delete[](void* memory, size_t, std::align_val_t) noexcept { FreeAligned(memory); }
+void operator delete(void* memory, std::align_val_t, std::nothrow_t const&) noexcept { FreeAligned(memory); }
+void operator delete[](void* memory, std::align_val_t, std::nothrow_t const&) noexcept { FreeAligned(memory); }
+
+// Times each call of the operation separately and prints the median and 99th
+// percentile latency together with the allocations per call.
+template<typename Operation>
+void Measure(char const* name, int iterations, Operation operation)
+{
+  std::vector<std::chrono::steady_clock::duration> latencies;
+  latencies.reserve(static_cast<size_t>(iterations));
+  operation(); // Warm up
+
+  const auto allocationsBefore = AllocationCount.load();
+  for (auto i = 0; i < iterations; ++i)
+  {
+    const auto startTime = std::chrono::steady_clock::now();
+    operation();
+    latencies.push_back(std::chrono::steady_clock::now() - startTime);
+  }
+  const auto allocations = AllocationCount.load() - allocationsBefore;
+
+  std::sort(latencies.begin(), latencies.end());
+  const auto percentile = [&](size_t percent)
+  {
+    const auto index = (std::min)(latencies.size() - 1, latencies.size() * percent / 100);
+    return std::chrono::duration<double, std::micro>{ latencies[index] }.count();
+  };
+  std::cout << "  " << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(2) <<
+    "p50 " << std::setw(11) << percentile(50) << " us   " <<
+    "p99 " << std::setw(11) << percentile(99) << " us   " <<
+    "allocations " << std::setw(8) << static_cast<double>(allocations) / iterations << std::endl;
+}
+
+// Counts tokens without building anything, to time the scanner on its own.
+struct TokenCounter
+{
+  size_t Tokens{ 0 };
+
+  void Leaf(std::string_view)
+  {
+    ++Tokens;
+  }
+
+  void Open(std::string_view)
+  {
+    ++Tokens;
+  }
+
+  void Close()
+  {
+  }
+};
+
+void BenchmarkParser(int iterations)
+{
+  std::cout << "Capabilities parsing (" << CapabilitiesCorpus.size() << " strings, one per call)" << std::endl;
+  size_t next = 0;
+  const auto nextString = [&]
+  {
+    const auto capabilities = CapabilitiesCorpus[next];
+    next = (next + 1) % CapabilitiesCorpus.size();
+    return capabilities;
+  };
+  // Keeps the optimizer from discarding the parse results.
+  size_t sink = 0;
+
+  Measure("scan", iterations, [&]
+  {
+    TokenCounter counter{};
+    ScanCapabilitiesString(nextString(), counter);
+    sink += counter.Tokens;
+  });
+  Measure("parse (nested)", iterations, [&]
+  {
+    sink += ParseCapabilitiesString(nextString()).size();
+  });
+  Measure("parse (flat)", iterations, [&]
+  {
+    sink += CapabilityTree{ std::string{ nextString() } }.Nodes().size();
+  });
+  Measure("parse (32 byte fragments)", iterations, [&]
+  {
+    const auto capabilities = nextString();
+    CapabilitiesParser parser{};
+    for (size_t offset = 0; offset < capabilities.size(); offset += 32)
+    {
+      parser.Append(capabilities.substr(offset, 32));
+    }
+    sink += parser.Finish().Nodes().size();
+  });
+
+  std::vector<CapabilityTree> trees;
+  for (const auto capabilities : CapabilitiesCorpus)
+  {
+    trees.emplace_back(std::string{ capabilities });
+  }
+  Measure("index", iterations, [&]
+  {
+    sink += CapabilityIndex{ trees[next] }.Codes().count();
+    next = (next + 1) % trees.size();
+  });
+  if (sink == 0)
+  {
+    std::cout << "  (no tokens)" << std::endl;
+  }
+}
+
+// The DDC/CI framing every transaction goes through, both directions.
+void BenchmarkCodec(int iterations)
+{
+  std::cout << "DDC/CI codec (encode a request, decode its reply)" << std::endl;
+  VCPFeatureResult value{};
+  value.Success = true;
+  value.MaxValue = 100;
+  const auto vcpReply = EncodeGetVCPReply(0x10, value);
+  uint32_t sink = 0;
+  Measure("get VCP", iterations, [&]
+  {
+    const auto request = EncodeGetVCPRequest(0x10);
+    VCPFeatureResult result{};
+    sink += request.Size + (DecodeGetVCPReply(vcpReply.Bytes, vcpReply.Size, 0x10, &result) == DdcCiStatus::Ok ? result.MaxValue : 0);
+  });
+
+  const auto capabilities = CapabilitiesCorpus[0];
+  const auto fragmentReply = EncodeCapabilitiesReply(0, reinterpret_cast<uint8_t const*>(capabilities.data()), capabilities.size());
+  Measure("capabilities fragment", iterations, [&]
+  {
+    const auto request = EncodeCapabilitiesRequest(0);
+    DdcCiBytes fragment{};
+    sink += request.Size + (DecodeCapabilitiesReply(fragmentReply.Bytes, fragmentReply.Size, 0, &fragment) == DdcCiStatus::Ok ? fragment.Data[0] : 0);
+  });
+  if (sink == 0)
+  {
+    std::cout << "  (nothing decoded)" << std::endl;
+  }
+}
+
+std::vector<SimulatedMonitorConfig> DefaultSimulation()
+{
+  SimulatedMonitorConfig config{};
+  config.Capabilities = std::string{ CapabilitiesCorpus[0] };
+  config.Features = {
+    { 0x10, 0x32, 0x64, VCPCodeType::SetParameter },
+    { 0x12, 0x32, 0x64, VCPCodeType::SetParameter },
+    { 0x60, 0x0F, 0x12, VCPCodeType::SetParameter },
+  };
+  std::vector<SimulatedMonitorConfig> configs{ config, config };
+  configs[0].Name = "SIM1";
+  configs[1].Name = "SIM2";
+  configs[1].Identity.Serial = 1;
+  return configs;
+}
+
+void BenchmarkEnumeration(int iterations)
+{
+  std::cout << "Enumeration (open every monitor, then release them)" << std::endl;
+  size_t found = 0;
+  Measure("simulated", iterations, [&]
+  {
+    std::vector<MonitorUtils::Monitor> monitors;
+    for (auto index = 0;; ++index)
+    {
+      auto monitor = MonitorUtils::GetMonitor(index);
+      if (!monitor.IsValid())
+      {
+        break;
+      }
+      monitors.push_back(std::move(monitor));
+    }
+    found = monitors.size();
+  });
+  std::cout << "  (" << found << " monitors)" << std::endl;
+}
+
+void BenchmarkPlatformEnumeration(int iterations)
+{
+  auto backend = CreatePlatformBackend();
+  size_t found = 0;
+  Measure("platform", iterations, [&]
+  {
+    std::vector<std::unique_ptr<MonitorDevice>> devices;
+    for (auto index = 0;; ++index)
+    {
+      auto device = backend->Open(index);
+      if (!device)
+      {
+        break;
+      }
+      devices.push_back(std::move(device));
+    }
+    found = devices.size();
+  });
+  std::cout << "  (" << found << " monitors)" << std::endl;
+}
+
+void BenchmarkRoundTrips(int iterations)
+{
+  std::cout << "VCP round trips (monitor 0)" << std::endl;
+  const auto monitor = MonitorUtils::GetMonitor(0);
+  if (!monitor.IsValid())
+  {
+    std::cerr << "  No simulated monitor" << std::endl;
+    return;
+  }
+
+  auto failures = 0;
+  uint32_t brightness = 0;
+  Measure("get", iterations, [&]
+  {
+    failures += MonitorUtils::GetVCPFeature(monitor, 0x10).Success ? 0 : 1;
+  });
+  Measure("set", iterations, [&]
+  {
+    brightness = (brightness + 1) % 100;
+    failures += MonitorUtils::SetVCPFeature(monitor, 0x10, brightness) ? 0 : 1;
+  });
+  Measure("set + verify", iterations, [&]
+  {
+    brightness = (brightness + 1) % 100;
+    failures += (MonitorUtils::SetVCPFeature(monitor, 0x10, brightness) &&
+      Verify(monitor, 0x10, brightness).Converged) ? 0 : 1;
+  });
+  Measure("toggle", iterations, [&]
+  {
+    failures += Toggle(monitor) ? 0 : 1;
+  });
+  const VerifyPolicy verify{};
+  Measure("toggle + verify", iterations, [&]
+  {
+    failures += Toggle(monitor, &verify) ? 0 : 1;
+  });
+  Measure("capabilities (uncached)", iterations, [&]
+  {
+    failures += MonitorUtils::GetLowLevelCapabilities(monitor).Valid ? 0 : 1;
+  });
+  if (failures > 0)
+  {
+    std::cout << "  (" << failures << " failed calls)" << std::endl;
+  }
+}
+
+// One thread reading every monitor, first one after the other, then with all
+// the reads in flight at once through the async API.
+void BenchmarkAsync(int iterations)
+{
+  std::vector<MonitorUtils::AsyncResult<MonitorUtils::Monitor>> opening;
+  for (auto index = 0; index < 8; ++index)
+  {
+    opening.push_back(MonitorUtils::GetMonitorAsync(index));
+  }
+  std::vector<MonitorUtils::Monitor> monitors;
+  for (const auto& monitor : opening)
+  {
+    if (monitor.get().Value.IsValid())
+    {
+      monitors.push_back(monitor.get().Value);
+    }
+  }
+  std::cout << "VCP reads across monitors (" << monitors.size() << " monitors, one thread)" << std::endl;
+
+  const uint8_t codes[] = { 0x10, 0x12, 0x60 };
+  auto failures = 0;
+  Measure("3 gets each (in turn)", iterations, [&]
+  {
+    for (const auto& monitor : monitors)
+    {
+      for (const auto code : codes)
+      {
+        failures += MonitorUtils::GetVCPFeature(monitor, code).Success ? 0 : 1;
+      }
+    }
+  });
+  std::vector<MonitorUtils::AsyncResult<MonitorUtils::VCPFeatureResult>> reads;
+  reads.reserve(monitors.size() * std::size(codes));
+  Measure("3 gets each (async)", iterations, [&]
+  {
+    reads.clear();
+    for (const auto& monitor : monitors)
+    {
+      for (const auto code : codes)
+      {
+        reads.push_back(MonitorUtils::GetVCPFeatureAsync(monitor, code));
+      }
+    }
+    for (const auto& read : reads)
+    {
+      failures += read.get().Value.Success ? 0 : 1;
+    }
+  });
+  if (failures > 0)
+  {
+    std::cout << "  (" << failures << " failed calls)" << std::endl;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  auto iterations = 1000;
+  std::string simulationFile;
+  for (auto i = 1; i < argc; ++i)
+  {
+    if (std::strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+    {
+      iterations = std::atoi(argv[++i]);
+    }
+    else if (std::strcmp(argv[i], "--simulate") == 0 && i + 1 < argc)
+    {
+      simulationFile = argv[++i];
+    }
+    else
+    {
+      std::cerr << "monitor_util_benchmark [--iterations N] [--simulate FILE]" << std::endl;
+      return 1;
+    }
+  }
+  if (iterations < 1)
+  {
+    std::cerr << "--iterations must be at least 1" << std::endl;
+    return 1;
+  }
+
+  if (simulationFile.empty())
+  {
+    MonitorUtils::SetBackend(std::make_unique<SimulatedBackend>(DefaultSimulation()));
+  }
+  else
+  {
+    std::string error;
+    auto backend = SimulatedBackend::Load(simulationFile, &error);
+    if (!backend)
+    {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+    MonitorUtils::SetBackend(std::move(backend));
+  }
+
+  BenchmarkParser(iterations);
+  BenchmarkCodec(iterations);
+  BenchmarkEnumeration(iterations);
+  // Real monitors take tens of milliseconds each to open.
+  BenchmarkPlatformEnumeration((std::min)(iterations, 20));
+  BenchmarkRoundTrips(iterations);
+  BenchmarkAsync(iterations);
+  return 0;
+}
@@ -0,0 +1,671 @@
+// capabilities.h : Parsing of MCCS capabilities strings.
+//
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+
+enum class VCPCapabilityElementType
+{
+  Tree,
+  Leaf
+};
+
+enum class VCPCapabilityValueType
+{
+  Text,
+  VCPCode
+};
+
+struct VCPCapabilityElement
+{
+  std::variant<std::string, int> Value;
+  std::vector<VCPCapabilityElement> Children;
+  VCPCapabilityElementType ElementType;
+  VCPCapabilityValueType ValueType;
+};
+
+inline int HexDigitValue(char c)
+{
+  if (c >= '0' && c <= '9')
+  {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f')
+  {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F')
+  {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// A token is a VCP code when it is exactly two hex digits, e.g. "60" or "0F".
+inline bool ParseVCPCode(std::string_view token, int* code)
+{
+  if (token.size() != 2)
+  {
+    return false;
+  }
+  const auto high = HexDigitValue(token[0]);
+  const auto low = HexDigitValue(token[1]);
+  if (high < 0 || low < 0)
+  {
+    return false;
+  }
+  *code = (high << 4) | low;
+  return true;
+}
+
+inline bool IsCapabilitiesSeparator(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Walks a capabilities string once, reporting each token to the handler as a
+// view into the input:
+//   handler.Leaf(token)  - a token without children
+//   handler.Open(token)  - a token followed by '(' (children follow)
+//   handler.Close()      - the matching ')'
+// Empty tokens (repeated separators, "14(01) 16") are skipped. An unmatched
+// ')' ends the scan; groups still open at the end of the input are closed.
+//
+// The input may arrive in pieces: Scan() takes everything received so far and
+// picks up where the previous call left off, holding back a token that may
+// continue in the next piece. Finish() reports what is left at the end.
+class CapabilitiesScanner
+{
+public:
+  template<typename Handler>
+  void Scan(std::string_view capabilities, Handler& handler)
+  {
+    for (; m_index < capabilities.size() && !m_stopped; ++m_index)
+    {
+      const auto c = capabilities[m_index];
+      if (c == '(')
+      {
+        handler.Open(capabilities.substr(m_tokenStart, m_index - m_tokenStart));
+        ++m_depth;
+        m_tokenStart = m_index + 1;
+      }
+      else if (c == ')' || IsCapabilitiesSeparator(c))
+      {
+        if (m_index > m_tokenStart)
+        {
+          handler.Leaf(capabilities.substr(m_tokenStart, m_index - m_tokenStart));
+        }
+        m_tokenStart = m_index + 1;
+        if (c == ')')
+        {
+          if (m_depth == 0)
+          {
+            m_stopped = true;
+            return;
+          }
+          handler.Close();
+          --m_depth;
+        }
+      }
+    }
+  }
+
+  template<typename Handler>
+  void Finish(std::string_view capabilities, Handler& handler)
+  {
+    Scan(capabilities, handler);
+    if (m_stopped)
+    {
+      return;
+    }
+    if (capabilities.size() > m_tokenStart)
+    {
+      handler.Leaf(capabilities.substr(m_tokenStart));
+    }
+    for (; m_depth > 0; --m_depth)
+    {
+      handler.Close();
+    }
+    m_stopped = true;
+  }
+
+private:
+  size_t m_index{ 0 };
+  size_t m_tokenStart{ 0 };
+  size_t m_depth{ 0 };
+  bool m_stopped{ false };
+};
+
+template<typename Handler>
+void ScanCapabilitiesString(std::string_view capabilities, Handler& handler)
+{
+  CapabilitiesScanner scanner{};
+  scanner.Finish(capabilities, handler);
+}
+
+// Builds the nested VCPCapabilityElement representation straight from the
+// scanner's token views.
+class VCPCapabilityElementBuilder
+{
+public:
+  explicit VCPCapabilityElementBuilder(std::vector<VCPCapabilityElement>* elements)
+    : m_elements{ elements }
+  {
+  }
+
+  void Leaf(std::string_view token)
+  {
+    Siblings().push_back(MakeElement(token));
+  }
+
+  void Open(std::string_view token)
+  {
+    auto& siblings = Siblings();
+    siblings.push_back(MakeElement(token));
+    m_open.push_back(&siblings.back());
+  }
+
+  void Close()
+  {
+    auto element = m_open.back();
+    m_open.pop_back();
+    element->ElementType = element->Children.empty() ? VCPCapabilityElementType::Leaf : VCPCapabilityElementType::Tree;
+  }
+
+private:
+
+  std::vector<VCPCapabilityElement>& Siblings()
+  {
+    return m_open.empty() ? *m_elements : m_open.back()->Children;
+  }
+
+  static VCPCapabilityElement MakeElement(std::string_view token)
+  {
+    VCPCapabilityElement element{};
+    int code = 0;
+    if (ParseVCPCode(token, &code))
+    {
+      element.Value = code;
+      element.ValueType = VCPCapabilityValueType::VCPCode;
+    }
+    else
+    {
+      element.Value = std::string{ token };
+      element.ValueType = VCPCapabilityValueType::Text;
+    }
+    element.ElementType = VCPCapabilityElementType::Leaf;
+    return element;
+  }
+
+  std::vector<VCPCapabilityElement>* m_elements;
+  std::vector<VCPCapabilityElement*> m_open;
+};
+
+inline std::vector<VCPCapabilityElement> ParseCapabilitiesString(std::string_view capabilities)
+{
+  std::vector<VCPCapabilityElement> elements;
+  VCPCapabilityElementBuilder builder{ &elements };
+  ScanCapabilitiesString(capabilities, builder);
+  return elements;
+}
+
+// Flat representation of a parsed capabilities string. All nodes live in one
+// contiguous array and refer to each other by index, and token text is held as
+// an offset into the capabilities string owned by the tree, so a parsed string
+// costs two allocations regardless of how many codes it lists. A token longer
+// than MaxTokenLength does not fit a node, so a string with one parses to an
+// empty tree.
+class CapabilityTree
+{
+public:
+  static constexpr uint32_t InvalidIndex = 0xFFFFFFFF;
+  static constexpr size_t MaxTokenLength = 0xFFFF;
+
+  struct Node
+  {
+    uint32_t TextOffset;
+    uint16_t TextLength;
+    int16_t Code; // -1 when the token is text
+    uint32_t FirstChild;
+    uint32_t NextSibling;
+  };
+  static_assert(sizeof(Node) == 16, "Unexpected node size");
+
+  CapabilityTree() = default;
+
+  explicit CapabilityTree(std::string capabilities)
+    : m_string{ std::move(capabilities) }
+  {
+    m_nodes.reserve(m_string.size() / 3 + 1);
+    Builder builder{ this };
+    ScanCapabilitiesString(m_string, builder);
+    if (builder.Failed())
+    {
+      m_nodes.clear();
+    }
+  }
+
+  // Rebuilds a tree from previously parsed nodes, e.g. from the capabilities cache.
+  CapabilityTree(std::string capabilities, std::vector<Node> nodes)
+    : m_string{ std::move(capabilities) }
+    , m_nodes{ std::move(nodes) }
+  {
+  }
+
+  // Checks that every node refers to text within bounds, links only forward
+  // and has the code its text parses to, as the parser produces them, so a
+  // corrupted tree cannot loop or carry a code outside 0-255.
+  static bool Validate(std::string_view capabilities, Node const* nodes, size_t count)
+  {
+    for (size_t i = 0; i < count; ++i)
+    {
+      const auto& node = nodes[i];
+      if (static_cast<size_t>(node.TextOffset) + node.TextLength > capabilities.size() ||
+        (node.FirstChild != InvalidIndex && (node.FirstChild <= i || node.FirstChild >= count)) ||
+        (node.NextSibling != InvalidIndex && (node.NextSibling <= i || node.NextSibling >= count)))
+      {
+        return false;
+      }
+      auto code = -1;
+      (void)ParseVCPCode(capabilities.substr(node.TextOffset, node.TextLength), &code);
+      if (node.Code != code)
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Top-level nodes are chained as siblings of Root().
+  uint32_t Root() const
+  {
+    return m_nodes.empty() ? InvalidIndex : 0;
+  }
+
+  bool Empty() const
+  {
+    return m_nodes.empty();
+  }
+
+  Node const& At(uint32_t index) const
+  {
+    return m_nodes[index];
+  }
+
+  std::string_view Text(uint32_t index) const
+  {
+    const auto& node = m_nodes[index];
+    return std::string_view{ m_string }.substr(node.TextOffset, node.TextLength);
+  }
+
+  bool IsCode(uint32_t index) const
+  {
+    return m_nodes[index].Code >= 0;
+  }
+
+  int Code(uint32_t index) const
+  {
+    return m_nodes[index].Code;
+  }
+
+  uint32_t FirstChild(uint32_t index) const
+  {
+    return m_nodes[index].FirstChild;
+  }
+
+  uint32_t NextSibling(uint32_t index) const
+  {
+    return m_nodes[index].NextSibling;
+  }
+
+  // Returns the first child of parent whose text matches, e.g. "vcp".
+  uint32_t FindChild(uint32_t parent, std::string_view text) const
+  {
+    for (auto child = FirstChild(parent); child != InvalidIndex; child = NextSibling(child))
+    {
+      if (Text(child) == text)
+      {
+        return child;
+      }
+    }
+    return InvalidIndex;
+  }
+
+  std::string const& String() const
+  {
+    return m_string;
+  }
+
+  std::vector<Node> const& Nodes() const
+  {
+    return m_nodes;
+  }
+
+  // Adapter to the nested representation.
+  VCPCapabilityElement ToElement(uint32_t index) const
+  {
+    VCPCapabilityElement element{};
+    if (IsCode(index))
+    {
+      element.Value = Code(index);
+      element.ValueType = VCPCapabilityValueType::VCPCode;
+    }
+    else
+    {
+      element.Value = std::string{ Text(index) };
+      element.ValueType = VCPCapabilityValueType::Text;
+    }
+    element.ElementType = VCPCapabilityElementType::Leaf;
+    for (auto child = FirstChild(index); child != InvalidIndex; child = NextSibling(child))
+    {
+      element.ElementType = VCPCapabilityElementType::Tree;
+      element.Children.push_back(ToElement(child));
+    }
+    return element;
+  }
+
+private:
+  friend class CapabilitiesParser;
+
+  class Builder
+  {
+  public:
+    explicit Builder(CapabilityTree* tree)
+      : m_tree{ tree }
+    {
+    }
+
+    void Leaf(std::string_view token)
+    {
+      Append(token);
+    }
+
+    void Open(std::string_view token)
+    {
+      m_open.push_back({ Append(token), InvalidIndex });
+    }
+
+    void Close()
+    {
+      m_open.pop_back();
+    }
+
+    // True once a token too long for a node has been seen.
+    bool Failed() const
+    {
+      return m_failed;
+    }
+
+  private:
+
+    struct OpenNode
+    {
+      uint32_t Index;
+      uint32_t LastChild;
+    };
+
+    uint32_t Append(std::string_view token)
+    {
+      auto& nodes = m_tree->m_nodes;
+      const auto index = static_cast<uint32_t>(nodes.size());
+      Node node{};
+      node.TextOffset = static_cast<uint32_t>(token.data() - m_tree->m_string.data());
+      if (token.size() > MaxTokenLength)
+      {
+        m_failed = true;
+      }
+      node.TextLength = static_cast<uint16_t>(token.size() > MaxTokenLength ? 0 : token.size());
+      int code = 0;
+      node.Code = ParseVCPCode(token, &code) ? static_cast<int16_t>(code) : -1;
+      node.FirstChild = InvalidIndex;
+      node.NextSibling = InvalidIndex;
+      nodes.push_back(node);
+
+      auto& previous = m_open.empty() ? m_lastRoot : m_open.back().LastChild;
+      if (previous != InvalidIndex)
+      {
+        nodes[previous].NextSibling = index;
+      }
+      else if (!m_open.empty())
+      {
+        nodes[m_open.back().Index].FirstChild = index;
+      }
+      previous = index;
+      return index;
+    }
+
+    CapabilityTree* m_tree;
+    std::vector<OpenNode> m_open;
+    uint32_t m_lastRoot{ InvalidIndex };
+    bool m_failed{ false };
+  };
+
+  std::string m_string;
+  std::vector<Node> m_nodes;
+};
+
+// Builds a CapabilityTree from a capabilities string that arrives in pieces,
+// e.g. the fragments of a DDC/CI capabilities reply, parsing each piece as it
+// is appended. A group is known to be complete as soon as its ')' arrives, so
+// a caller that only needs vcp(...) or mccs_ver(...) can stop reading there.
+class CapabilitiesParser
+{
+public:
+  // Few capabilities strings are longer than ExpectedSize, so most are parsed
+  // without growing the buffers.
+  static constexpr size_t ExpectedSize = 1024;
+
+  CapabilitiesParser()
+    : m_builder{ &m_tree }
+  {
+    m_tree.m_string.reserve(ExpectedSize);
+    m_tree.m_nodes.reserve(ExpectedSize / 3);
+  }
+
+  CapabilitiesParser(CapabilitiesParser const&) = delete;
+  CapabilitiesParser& operator=(CapabilitiesParser const&) = delete;
+
+  void Append(std::string_view text)
+  {
+    m_tree.m_string.append(text.data(), text.size());
+    m_scanner.Scan(m_tree.m_string, *this);
+  }
+
+  // True once a group of that name (in any case) has been closed at the top
+  // level, or inside the unnamed group that usually wraps the whole string.
+  bool HasGroup(std::string_view name) const
+  {
+    for (const auto index : m_closedGroups)
+    {
+      if (EqualsIgnoringCase(m_tree.Text(index), name))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The tree of everything appended so far. The parser is spent afterwards.
+  CapabilityTree Finish()
+  {
+    m_scanner.Finish(m_tree.m_string, *this);
+    if (m_builder.Failed())
+    {
+      m_tree.m_nodes.clear();
+    }
+    return std::move(m_tree);
+  }
+
+private:
+  friend class CapabilitiesScanner;
+
+  static bool EqualsIgnoringCase(std::string_view a, std::string_view b)
+  {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y)
+    {
+      return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+    });
+  }
+
+  void Leaf(std::string_view token)
+  {
+    m_builder.Leaf(token);
+  }
+
+  void Open(std::string_view token)
+  {
+    m_open.push_back(static_cast<uint32_t>(m_tree.m_nodes.size()));
+    m_builder.Open(token);
+  }
+
+  void Close()
+  {
+    m_builder.Close();
+    const auto index = m_open.back();
+    m_open.pop_back();
+    if (m_open.empty() || (m_open.size() == 1 && m_tree.Text(m_open.front()).empty()))
+    {
+      m_closedGroups.push_back(index);
+    }
+  }
+
+  CapabilityTree m_tree;
+  CapabilityTree::Builder m_builder;
+  CapabilitiesScanner m_scanner;
+  std::vector<uint32_t> m_open;          // Groups still open, outermost first
+  std::vector<uint32_t> m_closedGroups;  // Top-level groups that are complete
+};
+
+// The codes listed in the vcp(...) group of a capabilities string, and for
+// codes that list them, the values they take. Both questions are answered by
+// a bit test. Codes listed without values take any value.
+class CapabilityIndex
+{
+public:
+  CapabilityIndex()
+  {
+    m_valueSets.fill(NoValueSet);
+  }
+
+  explicit CapabilityIndex(CapabilityTree const& tree)
+    : CapabilityIndex{}
+  {
+    const auto vcp = FindVCPGroup(tree);
+    if (vcp == CapabilityTree::InvalidIndex)
+    {
+      return;
+    }
+    m_valid = true;
+    for (auto node = tree.FirstChild(vcp); node != CapabilityTree::InvalidIndex; node = tree.NextSibling(node))
+    {
+      if (!tree.IsCode(node))
+      {
+        continue;
+      }
+      const auto code = static_cast<uint8_t>(tree.Code(node));
+      m_codes.set(code);
+      for (auto value = tree.FirstChild(node); value != CapabilityTree::InvalidIndex; value = tree.NextSibling(value))
+      {
+        if (!tree.IsCode(value))
+        {
+          continue;
+        }
+        if (m_valueSets[code] == NoValueSet)
+        {
+          m_valueSets[code] = static_cast<uint16_t>(m_values.size());
+          m_values.emplace_back();
+        }
+        m_values[m_valueSets[code]].set(static_cast<size_t>(tree.Code(value)));
+      }
+    }
+  }
+
+  // False when the string has no vcp(...) group, in which case nothing is
+  // known about the codes.
+  bool Valid() const
+  {
+    return m_valid;
+  }
+
+  bool Supports(uint8_t code) const
+  {
+    return m_codes.test(code);
+  }
+
+  bool HasValueList(uint8_t code) const
+  {
+    return m_valueSets[code] != NoValueSet;
+  }
+
+  bool Allows(uint8_t code, uint32_t value) const
+  {
+    if (!Supports(code))
+    {
+      return false;
+    }
+    if (!HasValueList(code))
+    {
+      return true;
+    }
+    return value < 256 && m_values[m_valueSets[code]].test(value);
+  }
+
+  std::bitset<256> const& Codes() const
+  {
+    return m_codes;
+  }
+
+  // Empty for codes without a value list.
+  std::bitset<256> AllowedValues(uint8_t code) const
+  {
+    return HasValueList(code) ? m_values[m_valueSets[code]] : std::bitset<256>{};
+  }
+
+private:
+  static constexpr uint16_t NoValueSet = 0xFFFF;
+
+  // Usually the whole string is wrapped in parentheses, so vcp is a child of
+  // an unnamed top-level group, but some monitors leave them out.
+  static uint32_t FindVCPGroup(CapabilityTree const& tree)
+  {
+    for (auto node = tree.Root(); node != CapabilityTree::InvalidIndex; node = tree.NextSibling(node))
+    {
+      if (IsVCPGroup(tree.Text(node)))
+      {
+        return node;
+      }
+      if (tree.Text(node).empty())
+      {
+        for (auto child = tree.FirstChild(node); child != CapabilityTree::InvalidIndex; child = tree.NextSibling(child))
+        {
+          if (IsVCPGroup(tree.Text(child)))
+          {
+            return child;
+          }
+        }
+      }
+    }
+    return CapabilityTree::InvalidIndex;
+  }
+
+  static bool IsVCPGroup(std::string_view text)
+  {
+    return text.size() == 3 && (text[0] == 'v' || text[0] == 'V') && (text[1] == 'c' || text[1] == 'C') && (text[2] == 'p' || text[2] == 'P');
+  }
+
+  bool m_valid{ false };
+  std::bitset<256> m_codes;
+  std::array<uint16_t, 256> m_valueSets{};  // Index into m_values per code
+  std::vector<std::bitset<256>> m_values;
+};
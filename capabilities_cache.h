@@ -0,0 +1,343 @@
+// capabilities_cache.h : Persistent cache of parsed capabilities strings.
+//
+#pragma once
+
+#include "capabilities.h"
+#include "edid.h"
+#include "lockable_file.h"
+#include "mapped_file.h"
+#include "platform.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// Capabilities strings are keyed by the monitor's EDID identity and stored
+// together with their parsed CapabilityTree nodes in a single file. The file is
+// memory mapped on load and its entries copied out, so a hit costs a lookup
+// and two copies instead of a multi-second DDC/CI capabilities request, and
+// the file is not held open for other processes to trip over. It is loaded
+// again when another process replaces it. Safe to share between threads and
+// processes: changes are made under a lock on "<path>.lock", from the file as
+// it is on disk at that moment.
+//
+// File layout (native byte order):
+//   FileHeader
+//   FileEntry[EntryCount]
+//   per entry: CapabilityTree::Node[NodeCount], then the string, padded to 4 bytes
+class CapabilitiesCache
+{
+public:
+  static std::string DefaultPath()
+  {
+#ifdef _WIN32
+    const std::filesystem::path base{ GetEnvironmentString("LOCALAPPDATA") };
+#else
+    const auto cacheHome = GetEnvironmentString("XDG_CACHE_HOME");
+    const auto base = cacheHome.empty() ? std::filesystem::path{ GetEnvironmentString("HOME") } / ".cache" : std::filesystem::path{ cacheHome };
+#endif
+    return (base / "monitor_util" / "capabilities.cache").string();
+  }
+
+  explicit CapabilitiesCache(std::string path = DefaultPath())
+    : m_path{ std::move(path) }
+  {
+    Load();
+  }
+
+  std::string const& Path() const
+  {
+    return m_path;
+  }
+
+  bool Find(MonitorIdentity const& identity, CapabilityTree* tree) const
+  {
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    Refresh();
+    const auto record = FindRecord(identity);
+    if (!record)
+    {
+      return false;
+    }
+    *tree = CapabilityTree{ record->String, record->Nodes };
+    return true;
+  }
+
+  bool Contains(MonitorIdentity const& identity) const
+  {
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    Refresh();
+    return FindRecord(identity) != nullptr;
+  }
+
+  bool Store(MonitorIdentity const& identity, CapabilityTree const& tree)
+  {
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    FileLock fileLock{ m_path };
+    if (!fileLock.Locked())
+    {
+      return false;
+    }
+    Load();
+    auto records = RecordsExcept(identity);
+    records.push_back({ identity, tree.String(), tree.Nodes() });
+    return Write(records);
+  }
+
+  bool Invalidate(MonitorIdentity const& identity)
+  {
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    FileLock fileLock{ m_path };
+    if (!fileLock.Locked())
+    {
+      return false;
+    }
+    Load();
+    if (!FindRecord(identity))
+    {
+      return true;
+    }
+    return Write(RecordsExcept(identity));
+  }
+
+  bool Clear()
+  {
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    FileLock fileLock{ m_path };
+    if (!fileLock.Locked())
+    {
+      return false;
+    }
+    std::error_code error;
+    std::filesystem::remove(m_path, error);
+    Load();
+    return !error;
+  }
+
+private:
+
+  static constexpr char Magic[4] = { 'M', 'U', 'C', 'C' };
+  static constexpr uint32_t Version = 1;
+
+  struct FileHeader
+  {
+    char Magic[4];
+    uint32_t Version;
+    uint32_t EntryCount;
+    uint32_t Reserved;
+  };
+
+  struct FileEntry
+  {
+    char Manufacturer[4];
+    uint16_t Product;
+    uint16_t Reserved;
+    uint32_t Serial;
+    uint32_t NodeOffset;
+    uint32_t NodeCount;
+    uint32_t StringOffset;
+    uint32_t StringLength;
+  };
+
+  struct Record
+  {
+    MonitorIdentity Identity;
+    std::string String;
+    std::vector<CapabilityTree::Node> Nodes;
+  };
+
+  // Holds the lock on "<path>.lock" for its lifetime, so read-modify-writes
+  // of the cache by different processes do not drop each other's entries.
+  class FileLock
+  {
+  public:
+    explicit FileLock(std::string const& path)
+    {
+      std::error_code error;
+      std::filesystem::create_directories(std::filesystem::path{ path }.parent_path(), error);
+      m_locked = m_file.Open(path + ".lock") && m_file.Lock(0);
+    }
+
+    FileLock(FileLock const&) = delete;
+    FileLock& operator=(FileLock const&) = delete;
+
+    ~FileLock()
+    {
+      if (m_locked)
+      {
+        m_file.Unlock(0);
+      }
+    }
+
+    bool Locked() const
+    {
+      return m_locked;
+    }
+
+  private:
+    LockableFile m_file;
+    bool m_locked{ false };
+  };
+
+  // Copies the entries out of the file, or leaves none if it is missing or
+  // does not pass validation.
+  void Load() const
+  {
+    m_records.clear();
+    std::error_code error;
+    m_loadedWriteTime = std::filesystem::last_write_time(m_path, error);
+    if (error)
+    {
+      m_loadedWriteTime = std::filesystem::file_time_type::min();
+      return;
+    }
+    MappedFile file;
+    if (!file.Open(m_path) || file.Size() < sizeof(FileHeader))
+    {
+      return;
+    }
+    const auto header = reinterpret_cast<FileHeader const*>(file.Data());
+    if (std::memcmp(header->Magic, Magic, sizeof Magic) != 0 || header->Version != Version ||
+      sizeof(FileHeader) + static_cast<uint64_t>(header->EntryCount) * sizeof(FileEntry) > file.Size())
+    {
+      return;
+    }
+    const auto entries = reinterpret_cast<FileEntry const*>(file.Data() + sizeof(FileHeader));
+    std::vector<Record> records;
+    records.reserve(header->EntryCount);
+    for (uint32_t i = 0; i < header->EntryCount; ++i)
+    {
+      const auto& entry = entries[i];
+      const auto nodesEnd = entry.NodeOffset + static_cast<uint64_t>(entry.NodeCount) * sizeof(CapabilityTree::Node);
+      const auto stringEnd = entry.StringOffset + static_cast<uint64_t>(entry.StringLength);
+      if (entry.NodeOffset % alignof(CapabilityTree::Node) != 0 || nodesEnd > file.Size() || stringEnd > file.Size() ||
+        !CapabilityTree::Validate(
+          { reinterpret_cast<char const*>(file.Data()) + entry.StringOffset, entry.StringLength },
+          reinterpret_cast<CapabilityTree::Node const*>(file.Data() + entry.NodeOffset),
+          entry.NodeCount))
+      {
+        return;
+      }
+      Record record{};
+      std::memcpy(record.Identity.Manufacturer, entry.Manufacturer, sizeof entry.Manufacturer);
+      record.Identity.Product = entry.Product;
+      record.Identity.Serial = entry.Serial;
+      record.String.assign(reinterpret_cast<char const*>(file.Data()) + entry.StringOffset, entry.StringLength);
+      record.Nodes.resize(entry.NodeCount);
+      std::memcpy(record.Nodes.data(), file.Data() + entry.NodeOffset, record.Nodes.size() * sizeof(CapabilityTree::Node));
+      records.push_back(std::move(record));
+    }
+    m_records = std::move(records);
+  }
+
+  // Loads the file again if another process has written or removed it since.
+  void Refresh() const
+  {
+    std::error_code error;
+    const auto writeTime = std::filesystem::last_write_time(m_path, error);
+    if (error ? m_loadedWriteTime != std::filesystem::file_time_type::min() : writeTime != m_loadedWriteTime)
+    {
+      Load();
+    }
+  }
+
+  static bool Matches(Record const& record, MonitorIdentity const& identity)
+  {
+    return std::memcmp(record.Identity.Manufacturer, identity.Manufacturer, sizeof identity.Manufacturer) == 0 &&
+      record.Identity.Product == identity.Product && record.Identity.Serial == identity.Serial;
+  }
+
+  Record const* FindRecord(MonitorIdentity const& identity) const
+  {
+    for (const auto& record : m_records)
+    {
+      if (Matches(record, identity))
+      {
+        return &record;
+      }
+    }
+    return nullptr;
+  }
+
+  std::vector<Record> RecordsExcept(MonitorIdentity const& identity) const
+  {
+    std::vector<Record> records;
+    for (const auto& record : m_records)
+    {
+      if (!Matches(record, identity))
+      {
+        records.push_back(record);
+      }
+    }
+    return records;
+  }
+
+  // Writes the records to a temporary file and swaps it in, then loads the
+  // result. Expects the file lock to be held.
+  bool Write(std::vector<Record> const& records)
+  {
+    std::vector<uint8_t> buffer(sizeof(FileHeader) + records.size() * sizeof(FileEntry));
+    FileHeader header{};
+    std::memcpy(header.Magic, Magic, sizeof Magic);
+    header.Version = Version;
+    header.EntryCount = static_cast<uint32_t>(records.size());
+    std::memcpy(buffer.data(), &header, sizeof header);
+
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+      const auto& record = records[i];
+      FileEntry entry{};
+      std::memcpy(entry.Manufacturer, record.Identity.Manufacturer, sizeof entry.Manufacturer);
+      entry.Product = record.Identity.Product;
+      entry.Serial = record.Identity.Serial;
+      entry.NodeOffset = static_cast<uint32_t>(buffer.size());
+      entry.NodeCount = static_cast<uint32_t>(record.Nodes.size());
+      const auto nodeBytes = record.Nodes.size() * sizeof(CapabilityTree::Node);
+      buffer.resize(buffer.size() + nodeBytes);
+      std::memcpy(buffer.data() + entry.NodeOffset, record.Nodes.data(), nodeBytes);
+      entry.StringOffset = static_cast<uint32_t>(buffer.size());
+      entry.StringLength = static_cast<uint32_t>(record.String.size());
+      buffer.insert(buffer.end(), record.String.begin(), record.String.end());
+      buffer.resize((buffer.size() + 3) & ~size_t{ 3 });
+      std::memcpy(buffer.data() + sizeof(FileHeader) + i * sizeof(FileEntry), &entry, sizeof entry);
+    }
+
+    std::error_code error;
+    const std::filesystem::path path{ m_path };
+    // Named after the process and the write, so processes and threads writing
+    // at once never write into the same temporary file.
+    static std::atomic<uint32_t> writeCount{ 0 };
+    auto temporaryPath = path;
+    temporaryPath += "." + std::to_string(GetCurrentProcessNumber()) + "." + std::to_string(++writeCount) + ".tmp";
+    {
+      std::ofstream file{ temporaryPath, std::ios::binary | std::ios::trunc };
+      file.write(reinterpret_cast<char const*>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+      if (!file)
+      {
+        file.close();
+        std::filesystem::remove(temporaryPath, error);
+        Load();
+        return false;
+      }
+    }
+    std::filesystem::rename(temporaryPath, path, error);
+    if (error)
+    {
+      std::error_code ignored;
+      std::filesystem::remove(temporaryPath, ignored);
+    }
+    Load();
+    return !error;
+  }
+
+  std::string m_path;
+  mutable std::vector<Record> m_records;
+  mutable std::filesystem::file_time_type m_loadedWriteTime{ std::filesystem::file_time_type::min() };
+  mutable std::mutex m_mutex;
+};
@@ -0,0 +1,519 @@
+// command_scheduler.h : Per-bus queueing and pacing of DDC/CI commands.
+//
+#pragma once
+
+#include "monitor_backend.h"
+#include "platform.h"
+#include "shared_state.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+
+struct SchedulerStats
+{
+  uint64_t Commands{ 0 };
+  uint64_t MergedReads{ 0 };
+  size_t MaxQueueDepth{ 0 };
+  std::chrono::steady_clock::duration TotalWait{};  // From submission until the command went out
+  std::chrono::steady_clock::duration MaxWait{};
+};
+
+// The outcome of a command carried out on another thread, with the error code
+// that thread saw. Elapsed is the time a read took on the bus, excluding the
+// time it spent queued.
+template<typename T>
+struct CommandResult
+{
+  T Value;
+  uint32_t Error;
+  std::chrono::steady_clock::duration Elapsed{};
+};
+
+// A read from ScheduledMonitorDevice::GetVCPFeatures(). Elapsed is the time
+// the command took on the bus, excluding the time it spent queued.
+struct TimedVCPFeatureResult
+{
+  uint8_t Code;
+  VCPFeatureResult Result;
+  uint32_t Error;
+  std::chrono::steady_clock::duration Elapsed;
+};
+
+// A table fragment write queued with ScheduledMonitorDevice::QueueTableWrite().
+struct TableWriteResult
+{
+  uint16_t Offset;
+  bool Success;
+  uint32_t Error;
+};
+
+// Wraps a device so that every DDC/CI command goes through one worker thread
+// per bus. The worker sends commands in submission order, leaves the gaps the
+// device asks for between them, and answers a read that is already waiting in
+// the queue for the same code with that read's result. Callers on any thread
+// block only until their own command is done, or not at all with the Async
+// variants, which return a future; the gap after a write is spent by the
+// worker, not by the caller. Devices on different buses have separate workers,
+// so their commands overlap. The last value read for each code is
+// remembered until the code is written.
+//
+// With a SharedMonitorState, the worker also holds the bus's cross-process
+// lock from its first queued command until the queue has been empty for the
+// gap after the last one, so other processes take turns on the bus without
+// cutting that gap short, and the values read are remembered for every
+// process instead of this one only.
+class ScheduledMonitorDevice : public MonitorDevice
+{
+public:
+  explicit ScheduledMonitorDevice(std::unique_ptr<MonitorDevice> device, std::unique_ptr<SharedMonitorState> shared = nullptr)
+    : m_device{ std::move(device) }
+    , m_shared{ std::move(shared) }
+    , m_gaps{ m_device->GetCommandGaps() }
+    , m_worker{ [this] { Run(); } }
+  {
+  }
+
+  ScheduledMonitorDevice(ScheduledMonitorDevice const&) = delete;
+  ScheduledMonitorDevice& operator=(ScheduledMonitorDevice const&) = delete;
+
+  ~ScheduledMonitorDevice() override
+  {
+    {
+      std::lock_guard<std::mutex> lock{ m_mutex };
+      m_stopping = true;
+    }
+    m_queued.notify_one();
+    m_worker.join();
+  }
+
+  // Neither of these talks to the monitor over DDC/CI.
+  MonitorInfo GetInfo() override
+  {
+    return m_device->GetInfo();
+  }
+
+  MonitorIdentity GetIdentity() override
+  {
+    return m_device->GetIdentity();
+  }
+
+  VCPFeatureResult GetVCPFeature(uint8_t code) override
+  {
+    return Receive(GetVCPFeatureAsync(code).get());
+  }
+
+  // Queues the read and returns at once. A read of the same code that is
+  // still queued is joined, so its future may be shared with other callers.
+  std::shared_future<CommandResult<VCPFeatureResult>> GetVCPFeatureAsync(uint8_t code)
+  {
+    std::shared_future<CommandResult<VCPFeatureResult>> reply;
+    {
+      std::lock_guard<std::mutex> lock{ m_mutex };
+      reply = EnqueueRead(code);
+    }
+    m_queued.notify_one();
+    return reply;
+  }
+
+  // Queues reads of all the codes at once, so the worker sends them back to
+  // back, paced only by the command gaps, instead of waiting for the caller to
+  // ask for the next one after every reply.
+  std::vector<TimedVCPFeatureResult> GetVCPFeatures(std::vector<uint8_t> const& codes)
+  {
+    std::vector<std::shared_future<CommandResult<VCPFeatureResult>>> replies;
+    replies.reserve(codes.size());
+    {
+      std::lock_guard<std::mutex> lock{ m_mutex };
+      for (const auto code : codes)
+      {
+        replies.push_back(EnqueueRead(code));
+      }
+    }
+    m_queued.notify_one();
+
+    std::vector<TimedVCPFeatureResult> results;
+    results.reserve(codes.size());
+    for (size_t i = 0; i < codes.size(); ++i)
+    {
+      const auto& reply = replies[i].get();
+      results.push_back({ codes[i], reply.Value, reply.Error, reply.Elapsed });
+    }
+    return results;
+  }
+
+  bool SetVCPFeature(uint8_t code, uint32_t value) override
+  {
+    return Receive(SetVCPFeatureAsync(code, value).get());
+  }
+
+  // Queues the write and returns at once.
+  std::future<CommandResult<bool>> SetVCPFeatureAsync(uint8_t code, uint32_t value)
+  {
+    return Post<bool>("SetVCPFeature", m_gaps.AfterSetVCP, code, value, 2, true, [this, code, value]
+    {
+      {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_knownValues.erase(code);
+      }
+      if (m_shared)
+      {
+        m_shared->Forget(code);
+      }
+      return m_device->SetVCPFeature(code, value);
+    });
+  }
+
+  bool GetCapabilitiesString(std::string* capabilities) override
+  {
+    return Submit<bool>("GetCapabilitiesString", m_gaps.AfterCapabilities, 0, 0, 0, [this, capabilities]
+    {
+      return m_device->GetCapabilitiesString(capabilities);
+    });
+  }
+
+  bool ReadTableFragment(uint8_t code, uint16_t offset, TableFragment* fragment) override
+  {
+    return Submit<bool>("ReadTableFragment", m_gaps.AfterCapabilities, code, offset, 2, [this, code, offset, fragment]
+    {
+      return m_device->ReadTableFragment(code, offset, fragment);
+    });
+  }
+
+  bool WriteTableFragment(uint8_t code, TableFragment const& fragment) override
+  {
+    const auto result = QueueTableWrite(code, fragment).get();
+    SetLastErrorCode(result.Error);
+    return result.Success;
+  }
+
+  // Queues a fragment write and returns without waiting for it, so the caller
+  // can prepare the next fragment while the worker sends this one.
+  std::future<TableWriteResult> QueueTableWrite(uint8_t code, TableFragment const& fragment)
+  {
+    auto promise = std::make_shared<std::promise<TableWriteResult>>();
+    auto result = promise->get_future();
+    {
+      std::lock_guard<std::mutex> lock{ m_mutex };
+      m_pendingReads.erase(code);
+      Enqueue(Command{ "WriteTableFragment", m_gaps.AfterSetVCP, code, fragment.Offset, 2, false, [this, code, fragment, promise]
+      {
+        const auto success = m_device->WriteTableFragment(code, fragment);
+        promise->set_value({ fragment.Offset, success, GetLastErrorCode() });
+      }, [fragment, promise](uint32_t error)
+      {
+        promise->set_value({ fragment.Offset, false, error });
+      } });
+    }
+    m_queued.notify_one();
+    return result;
+  }
+
+  bool ReadCapabilitiesFragment(uint16_t offset, CapabilitiesFragment* fragment) override
+  {
+    return Submit<bool>("ReadCapabilitiesFragment", m_gaps.AfterCapabilities, 0, 0, 0, [this, offset, fragment]
+    {
+      return m_device->ReadCapabilitiesFragment(offset, fragment);
+    });
+  }
+
+  // Reads the capabilities string fragment by fragment as one command (see
+  // ReadCapabilitiesFragments()), so no other command gets between two
+  // fragments and each follows the previous one as soon as the monitor allows.
+  // sink is called on the worker thread.
+  bool ReadCapabilities(int retries, std::function<bool(std::string_view)> const& sink)
+  {
+    return Submit<bool>("ReadCapabilities", m_gaps.AfterCapabilities, 0, 0, 0, [this, retries, &sink]
+    {
+      return ReadCapabilitiesFragments(*m_device, retries, sink);
+    });
+  }
+
+  // The high-level API reads the capabilities string under the hood.
+  HighLevelCapabilities GetHighLevelCapabilities() override
+  {
+    return Submit<HighLevelCapabilities>("GetHighLevelCapabilities", m_gaps.AfterCapabilities, 0, 0, 0, [this]
+    {
+      return m_device->GetHighLevelCapabilities();
+    });
+  }
+
+  // Gaps are already enforced here.
+  CommandGaps GetCommandGaps() override
+  {
+    return { std::chrono::milliseconds{ 0 }, std::chrono::milliseconds{ 0 }, std::chrono::milliseconds{ 0 } };
+  }
+
+  // Returns the last value read for the code, unless the code has been written
+  // since or the read is older than maxAge. With a SharedMonitorState, reads
+  // and writes by other processes count too.
+  bool GetKnownValue(uint8_t code, std::chrono::steady_clock::duration maxAge, VCPFeatureResult* value) const
+  {
+    if (m_shared)
+    {
+      return m_shared->Find(code, maxAge, value);
+    }
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    const auto known = m_knownValues.find(code);
+    if (known == m_knownValues.end() || std::chrono::steady_clock::now() - known->second.ReadAt > maxAge)
+    {
+      return false;
+    }
+    *value = known->second.Value;
+    return true;
+  }
+
+  // Ramps of a code supersede each other: the ticket BeginRamp() returns
+  // stops being current once a later ramp of the code has begun, in this
+  // process or, with a SharedMonitorState, in any other.
+  uint32_t BeginRamp(uint8_t code)
+  {
+    if (m_shared)
+    {
+      return m_shared->BeginRamp(code);
+    }
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    return ++m_ramps[code];
+  }
+
+  bool IsCurrentRamp(uint8_t code, uint32_t ticket) const
+  {
+    if (m_shared)
+    {
+      return m_shared->IsCurrentRamp(code, ticket);
+    }
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    const auto ramp = m_ramps.find(code);
+    return ramp != m_ramps.end() && ramp->second == ticket;
+  }
+
+  SchedulerStats GetStats() const
+  {
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    return m_stats;
+  }
+
+private:
+
+  struct KnownValue
+  {
+    VCPFeatureResult Value;
+    std::chrono::steady_clock::time_point ReadAt;
+  };
+
+  struct Command
+  {
+    char const* Name;
+    std::chrono::milliseconds Gap;
+    uint8_t Code;
+    uint32_t Value;
+    int TracedArguments;  // Code, then value
+    bool IsRead;
+    std::function<void()> Execute;
+    std::function<void(uint32_t)> Fail;  // Replies with an error instead of running
+    std::chrono::steady_clock::time_point Submitted{ std::chrono::steady_clock::now() };
+  };
+
+  // Sets the calling thread's error code to the one the worker saw.
+  template<typename T>
+  static T Receive(CommandResult<T> const& reply)
+  {
+    SetLastErrorCode(reply.Error);
+    return reply.Value;
+  }
+
+  template<typename T, typename Operation>
+  T Submit(char const* name, std::chrono::milliseconds gap, uint8_t code, uint32_t value, int tracedArguments, Operation operation)
+  {
+    return Receive(Post<T>(name, gap, code, value, tracedArguments, false, std::move(operation)).get());
+  }
+
+  // A command that writes the code keeps reads queued after it from joining
+  // reads queued before it.
+  template<typename T, typename Operation>
+  std::future<CommandResult<T>> Post(char const* name, std::chrono::milliseconds gap, uint8_t code, uint32_t value, int tracedArguments, bool writesCode, Operation operation)
+  {
+    auto promise = std::make_shared<std::promise<CommandResult<T>>>();
+    auto reply = promise->get_future();
+    {
+      std::lock_guard<std::mutex> lock{ m_mutex };
+      if (writesCode)
+      {
+        m_pendingReads.erase(code);
+      }
+      Enqueue(Command{ name, gap, code, value, tracedArguments, false, [promise, operation]
+      {
+        CommandResult<T> result{};
+        result.Value = operation();
+        result.Error = GetLastErrorCode();
+        promise->set_value(result);
+      }, [promise](uint32_t error)
+      {
+        CommandResult<T> result{};
+        result.Error = error;
+        promise->set_value(result);
+      } });
+    }
+    m_queued.notify_one();
+    return reply;
+  }
+
+  // Expects m_mutex to be held. Joins a read of the same code that is still
+  // queued, unless a write of the code has been queued since.
+  std::shared_future<CommandResult<VCPFeatureResult>> EnqueueRead(uint8_t code)
+  {
+    const auto pending = m_pendingReads.find(code);
+    if (pending != m_pendingReads.end())
+    {
+      ++m_stats.MergedReads;
+      return pending->second;
+    }
+    auto promise = std::make_shared<std::promise<CommandResult<VCPFeatureResult>>>();
+    const auto reply = promise->get_future().share();
+    m_pendingReads.emplace(code, reply);
+    Enqueue(Command{ "GetVCPFeature", m_gaps.AfterGetVCP, code, 0, 1, true, [this, code, promise]
+    {
+      CommandResult<VCPFeatureResult> result{};
+      const auto startTime = std::chrono::steady_clock::now();
+      result.Value = m_device->GetVCPFeature(code);
+      result.Error = GetLastErrorCode();
+      const auto endTime = std::chrono::steady_clock::now();
+      result.Elapsed = endTime - startTime;
+      if (result.Value.Success)
+      {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_knownValues[code] = { result.Value, endTime };
+      }
+      if (result.Value.Success && m_shared)
+      {
+        m_shared->Store(code, result.Value);
+      }
+      promise->set_value(result);
+    }, [promise](uint32_t error)
+    {
+      CommandResult<VCPFeatureResult> result{};
+      result.Error = error;
+      promise->set_value(result);
+    } });
+    return reply;
+  }
+
+  // Expects m_mutex to be held.
+  void Enqueue(Command command)
+  {
+    m_queue.push_back(std::move(command));
+    m_stats.MaxQueueDepth = (std::max)(m_stats.MaxQueueDepth, m_queue.size());
+  }
+
+  void Run()
+  {
+    if (const auto tracer = Tracer::Active())
+    {
+      tracer->NameThread("Bus " + m_device->GetInfo().Name);
+    }
+    auto readyAt = std::chrono::steady_clock::now();
+    auto busLocked = false;
+    for (;;)
+    {
+      Command command;
+      {
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        if (busLocked)
+        {
+          // Commands queued within the gap go out before the bus is let go.
+          m_queued.wait_until(lock, readyAt, [this] { return !m_queue.empty(); });
+          if (m_queue.empty())
+          {
+            m_shared->Unlock();
+            busLocked = false;
+          }
+        }
+        m_queued.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+        if (m_queue.empty())
+        {
+          return;
+        }
+        command = std::move(m_queue.front());
+        m_queue.pop_front();
+      }
+
+      if (m_shared && !busLocked)
+      {
+        TraceSpan span{ "ddc", "Bus lock" };
+        busLocked = m_shared->Lock();
+        if (!busLocked)
+        {
+          // Without the lock another process may be on the bus, and the
+          // shared values may not be touched, so the command fails.
+          const auto error = GetLastErrorCode();
+          {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            if (command.IsRead)
+            {
+              m_pendingReads.erase(command.Code);
+            }
+          }
+          command.Fail(error);
+          continue;
+        }
+      }
+
+      if (std::chrono::steady_clock::now() < readyAt)
+      {
+        TraceSpan span{ "ddc", "Gap" };
+        std::this_thread::sleep_until(readyAt);
+      }
+      {
+        // A read that arrives from here on has to see the bus after this one.
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        if (command.IsRead)
+        {
+          m_pendingReads.erase(command.Code);
+        }
+        const auto wait = std::chrono::steady_clock::now() - command.Submitted;
+        ++m_stats.Commands;
+        m_stats.TotalWait += wait;
+        m_stats.MaxWait = (std::max)(m_stats.MaxWait, wait);
+      }
+      {
+        TraceSpan span{ "ddc", command.Name };
+        if (command.TracedArguments > 0)
+        {
+          span.AddArgument("code", command.Code);
+        }
+        if (command.TracedArguments > 1)
+        {
+          span.AddArgument("value", command.Value);
+        }
+        command.Execute();
+      }
+      readyAt = std::chrono::steady_clock::now() + command.Gap;
+    }
+  }
+
+  std::unique_ptr<MonitorDevice> m_device;
+  std::unique_ptr<SharedMonitorState> m_shared;
+  CommandGaps m_gaps;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_queued;
+  std::deque<Command> m_queue;
+  std::map<uint8_t, std::shared_future<CommandResult<VCPFeatureResult>>> m_pendingReads;
+  std::map<uint8_t, KnownValue> m_knownValues;
+  std::map<uint8_t, uint32_t> m_ramps;
+  SchedulerStats m_stats;
+  bool m_stopping{ false };
+  std::thread m_worker;
+};
@@ -0,0 +1,302 @@
+// ddc_ci.h : DDC/CI message framing and the MCCS VCP and capabilities commands, over fixed buffers.
+//
+#pragma once
+
+#include "monitor_backend.h"
+
+#include <cstddef>
+#include <cstdint>
+
+
+// A message on the wire, from the source address to the checksum:
+//
+//   source, 0x80 | length, payload[length], checksum
+//
+// The destination address goes out as the i2c address and is not part of the
+// buffer, but it is part of the checksum: 0x6E for host requests, and the
+// virtual host address 0x50 for display replies.
+constexpr uint8_t DdcCiAddress = 0x37;            // 7-bit i2c address of the display
+constexpr uint8_t DdcCiDisplayAddress = 0x6E;     // DdcCiAddress shifted for writing; the source of replies
+constexpr uint8_t DdcCiHostAddress = 0x51;        // Source of host requests
+constexpr uint8_t DdcCiHostChecksumAddress = 0x50;
+
+constexpr uint8_t DdcCiGetVCPRequest = 0x01;
+constexpr uint8_t DdcCiGetVCPReply = 0x02;
+constexpr uint8_t DdcCiSetVCPRequest = 0x03;
+constexpr uint8_t DdcCiCapabilitiesRequest = 0xF3;
+constexpr uint8_t DdcCiCapabilitiesReply = 0xE3;
+constexpr uint8_t DdcCiTableReadRequest = 0xE2;
+constexpr uint8_t DdcCiTableReadReply = 0xE4;
+constexpr uint8_t DdcCiTableWriteRequest = 0xE7;
+
+constexpr size_t DdcCiMaxFragmentSize = TableFragmentSize;             // Data bytes per capabilities or table fragment
+constexpr size_t DdcCiMaxPayloadSize = 4 + DdcCiMaxFragmentSize;       // Table write: opcode, code, offset, data
+constexpr size_t DdcCiMaxMessageSize = DdcCiMaxPayloadSize + 3;        // Source, length, checksum
+constexpr size_t DdcCiGetVCPReplySize = 8 + 3;
+
+// An encoded message. Size is 0 if the payload did not fit.
+struct DdcCiMessage
+{
+  uint8_t Bytes[DdcCiMaxMessageSize];
+  size_t Size;
+};
+
+// Bytes inside a decoded message; they point into the caller's buffer.
+struct DdcCiBytes
+{
+  uint8_t const* Data;
+  size_t Size;
+};
+
+enum class DdcCiStatus
+{
+  Ok,
+  Truncated,        // Shorter than its length byte says, or than the command needs
+  BadAddress,       // Not from the expected source
+  BadLength,        // Length byte without the 0x80 flag, or longer than any payload or fragment
+  BadChecksum,
+  NullMessage,      // Empty payload: the display is busy or has nothing to say
+  UnexpectedOpcode,
+  Mismatch,         // A reply for another VCP code or capabilities offset
+  Unsupported,      // The display does not support the VCP code
+};
+
+inline uint8_t DdcCiChecksum(uint8_t seed, uint8_t const* bytes, size_t size)
+{
+  auto checksum = seed;
+  for (size_t i = 0; i < size; ++i)
+  {
+    checksum ^= bytes[i];
+  }
+  return checksum;
+}
+
+inline DdcCiMessage EncodeDdcCiMessage(uint8_t source, uint8_t destination, uint8_t const* payload, size_t size)
+{
+  DdcCiMessage message{};
+  if (size > DdcCiMaxPayloadSize)
+  {
+    return message;
+  }
+  message.Bytes[0] = source;
+  message.Bytes[1] = static_cast<uint8_t>(0x80 | size);
+  for (size_t i = 0; i < size; ++i)
+  {
+    message.Bytes[2 + i] = payload[i];
+  }
+  message.Bytes[size + 2] = DdcCiChecksum(destination, message.Bytes, size + 2);
+  message.Size = size + 3;
+  return message;
+}
+
+// Checks the framing and checksum of a message from source to destination and
+// points payload at its payload. Bytes past the message's end are ignored, so
+// a fixed-size read can be decoded as it is.
+inline DdcCiStatus DecodeDdcCiMessage(uint8_t source, uint8_t destination, uint8_t const* message, size_t size, DdcCiBytes* payload)
+{
+  if (size < 3)
+  {
+    return DdcCiStatus::Truncated;
+  }
+  if (message[0] != source)
+  {
+    return DdcCiStatus::BadAddress;
+  }
+  const size_t length = message[1] & 0x7F;
+  if ((message[1] & 0x80) == 0 || length > DdcCiMaxPayloadSize)
+  {
+    return DdcCiStatus::BadLength;
+  }
+  if (length + 3 > size)
+  {
+    return DdcCiStatus::Truncated;
+  }
+  if (DdcCiChecksum(destination, message, length + 2) != message[length + 2])
+  {
+    return DdcCiStatus::BadChecksum;
+  }
+  *payload = { message + 2, length };
+  return length == 0 ? DdcCiStatus::NullMessage : DdcCiStatus::Ok;
+}
+
+// Host side: requests to send and replies to check.
+
+inline DdcCiMessage EncodeDdcCiRequest(uint8_t const* payload, size_t size)
+{
+  return EncodeDdcCiMessage(DdcCiHostAddress, DdcCiDisplayAddress, payload, size);
+}
+
+inline DdcCiStatus DecodeDdcCiReply(uint8_t const* message, size_t size, DdcCiBytes* payload)
+{
+  return DecodeDdcCiMessage(DdcCiDisplayAddress, DdcCiHostChecksumAddress, message, size, payload);
+}
+
+inline DdcCiMessage EncodeGetVCPRequest(uint8_t code)
+{
+  const uint8_t payload[] = { DdcCiGetVCPRequest, code };
+  return EncodeDdcCiRequest(payload, sizeof payload);
+}
+
+// VCP values are 16 bits on the wire; the upper bits are dropped.
+inline DdcCiMessage EncodeSetVCPRequest(uint8_t code, uint32_t value)
+{
+  const uint8_t payload[] = { DdcCiSetVCPRequest, code, static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value) };
+  return EncodeDdcCiRequest(payload, sizeof payload);
+}
+
+inline DdcCiMessage EncodeCapabilitiesRequest(uint16_t offset)
+{
+  const uint8_t payload[] = { DdcCiCapabilitiesRequest, static_cast<uint8_t>(offset >> 8), static_cast<uint8_t>(offset) };
+  return EncodeDdcCiRequest(payload, sizeof payload);
+}
+
+// Fills result from a reply to a Get VCP Feature request for code. result is
+// left alone unless the reply is Ok.
+inline DdcCiStatus DecodeGetVCPReply(uint8_t const* message, size_t size, uint8_t code, VCPFeatureResult* result)
+{
+  DdcCiBytes payload{};
+  const auto status = DecodeDdcCiReply(message, size, &payload);
+  if (status != DdcCiStatus::Ok)
+  {
+    return status;
+  }
+  const auto reply = payload.Data;
+  if (reply[0] != DdcCiGetVCPReply)
+  {
+    return DdcCiStatus::UnexpectedOpcode;
+  }
+  if (payload.Size < 8)
+  {
+    return DdcCiStatus::Truncated;
+  }
+  if (reply[2] != code)
+  {
+    return DdcCiStatus::Mismatch;
+  }
+  if (reply[1] != 0x00)
+  {
+    return DdcCiStatus::Unsupported;
+  }
+  result->Success = true;
+  result->CodeType = reply[3] == 0x01 ? VCPCodeType::Momentary : VCPCodeType::SetParameter;
+  result->MaxValue = static_cast<uint32_t>((reply[4] << 8) | reply[5]);
+  result->CurrentValue = static_cast<uint32_t>((reply[6] << 8) | reply[7]);
+  return DdcCiStatus::Ok;
+}
+
+inline DdcCiMessage EncodeTableReadRequest(uint8_t code, uint16_t offset)
+{
+  const uint8_t payload[] = { DdcCiTableReadRequest, code, static_cast<uint8_t>(offset >> 8), static_cast<uint8_t>(offset) };
+  return EncodeDdcCiRequest(payload, sizeof payload);
+}
+
+// At most DdcCiMaxFragmentSize bytes of data; the rest is cut off.
+inline DdcCiMessage EncodeTableWriteRequest(uint8_t code, uint16_t offset, uint8_t const* data, size_t size)
+{
+  uint8_t payload[DdcCiMaxPayloadSize];
+  payload[0] = DdcCiTableWriteRequest;
+  payload[1] = code;
+  payload[2] = static_cast<uint8_t>(offset >> 8);
+  payload[3] = static_cast<uint8_t>(offset);
+  size = size < DdcCiMaxFragmentSize ? size : DdcCiMaxFragmentSize;
+  for (size_t i = 0; i < size; ++i)
+  {
+    payload[4 + i] = data[i];
+  }
+  return EncodeDdcCiRequest(payload, size + 4);
+}
+
+// Points fragment at the data of a capabilities or table read reply (opcode)
+// for offset, which is never more than DdcCiMaxFragmentSize bytes. An empty
+// fragment ends the string or table.
+inline DdcCiStatus DecodeFragmentReply(uint8_t opcode, uint8_t const* message, size_t size, uint16_t offset, DdcCiBytes* fragment)
+{
+  DdcCiBytes payload{};
+  const auto status = DecodeDdcCiReply(message, size, &payload);
+  if (status != DdcCiStatus::Ok)
+  {
+    return status;
+  }
+  if (payload.Data[0] != opcode)
+  {
+    return DdcCiStatus::UnexpectedOpcode;
+  }
+  if (payload.Size < 3)
+  {
+    return DdcCiStatus::Truncated;
+  }
+  if (payload.Size - 3 > DdcCiMaxFragmentSize)
+  {
+    return DdcCiStatus::BadLength;
+  }
+  if (((payload.Data[1] << 8) | payload.Data[2]) != offset)
+  {
+    return DdcCiStatus::Mismatch;
+  }
+  *fragment = { payload.Data + 3, payload.Size - 3 };
+  return DdcCiStatus::Ok;
+}
+
+inline DdcCiStatus DecodeCapabilitiesReply(uint8_t const* message, size_t size, uint16_t offset, DdcCiBytes* fragment)
+{
+  return DecodeFragmentReply(DdcCiCapabilitiesReply, message, size, offset, fragment);
+}
+
+inline DdcCiStatus DecodeTableReadReply(uint8_t const* message, size_t size, uint16_t offset, DdcCiBytes* fragment)
+{
+  return DecodeFragmentReply(DdcCiTableReadReply, message, size, offset, fragment);
+}
+
+// Display side: requests to check and replies to send.
+
+inline DdcCiStatus DecodeDdcCiRequest(uint8_t const* message, size_t size, DdcCiBytes* payload)
+{
+  return DecodeDdcCiMessage(DdcCiHostAddress, DdcCiDisplayAddress, message, size, payload);
+}
+
+inline DdcCiMessage EncodeDdcCiReply(uint8_t const* payload, size_t size)
+{
+  return EncodeDdcCiMessage(DdcCiDisplayAddress, DdcCiHostChecksumAddress, payload, size);
+}
+
+// A reply to a Get VCP Feature request; one that says the code is unsupported
+// unless result.Success is set.
+inline DdcCiMessage EncodeGetVCPReply(uint8_t code, VCPFeatureResult const& result)
+{
+  const uint8_t payload[] = {
+    DdcCiGetVCPReply,
+    static_cast<uint8_t>(result.Success ? 0x00 : 0x01),
+    code,
+    static_cast<uint8_t>(result.CodeType == VCPCodeType::Momentary ? 0x01 : 0x00),
+    static_cast<uint8_t>(result.MaxValue >> 8),
+    static_cast<uint8_t>(result.MaxValue),
+    static_cast<uint8_t>(result.CurrentValue >> 8),
+    static_cast<uint8_t>(result.CurrentValue) };
+  return EncodeDdcCiReply(payload, sizeof payload);
+}
+
+// A capabilities or table read reply (opcode). At most DdcCiMaxFragmentSize
+// bytes of data; the rest is cut off.
+inline DdcCiMessage EncodeFragmentReply(uint8_t opcode, uint16_t offset, uint8_t const* data, size_t size)
+{
+  uint8_t payload[DdcCiMaxPayloadSize];
+  payload[0] = opcode;
+  payload[1] = static_cast<uint8_t>(offset >> 8);
+  payload[2] = static_cast<uint8_t>(offset);
+  size = size < DdcCiMaxFragmentSize ? size : DdcCiMaxFragmentSize;
+  for (size_t i = 0; i < size; ++i)
+  {
+    payload[3 + i] = data[i];
+  }
+  return EncodeDdcCiReply(payload, size + 3);
+}
+
+inline DdcCiMessage EncodeCapabilitiesReply(uint16_t offset, uint8_t const* data, size_t size)
+{
+  return EncodeFragmentReply(DdcCiCapabilitiesReply, offset, data, size);
+}
+
+inline DdcCiMessage EncodeTableReadReply(uint16_t offset, uint8_t const* data, size_t size)
+{
+  return EncodeFragmentReply(DdcCiTableReadReply, offset, data, size);
+}
@@ -0,0 +1,57 @@
+// edid.h : Monitor identity as reported by the EDID block.
+//
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+
+struct MonitorIdentity
+{
+  char Manufacturer[4]{}; // Three-letter PNP id, e.g. "DEL"
+  uint16_t Product{ 0 };
+  uint32_t Serial{ 0 };
+
+  bool Valid() const
+  {
+    return Manufacturer[0] != '\0';
+  }
+
+  std::string ToString() const
+  {
+    char buffer[32];
+    snprintf(buffer, sizeof buffer, "%s-%04X-%08X", Manufacturer, Product, Serial);
+    return buffer;
+  }
+};
+
+inline bool operator==(MonitorIdentity const& a, MonitorIdentity const& b)
+{
+  return std::memcmp(a.Manufacturer, b.Manufacturer, sizeof a.Manufacturer) == 0 && a.Product == b.Product && a.Serial == b.Serial;
+}
+
+inline bool operator!=(MonitorIdentity const& a, MonitorIdentity const& b)
+{
+  return !(a == b);
+}
+
+// Extracts the vendor/product/serial fields from the 128-byte EDID base block.
+inline MonitorIdentity ParseEdidIdentity(uint8_t const* edid, size_t size)
+{
+  static const uint8_t header[] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+  MonitorIdentity identity{};
+  if (size < 128 || std::memcmp(edid, header, sizeof header) != 0)
+  {
+    return identity;
+  }
+
+  const auto manufacturer = static_cast<uint16_t>((edid[8] << 8) | edid[9]);
+  identity.Manufacturer[0] = static_cast<char>('@' + ((manufacturer >> 10) & 0x1F));
+  identity.Manufacturer[1] = static_cast<char>('@' + ((manufacturer >> 5) & 0x1F));
+  identity.Manufacturer[2] = static_cast<char>('@' + (manufacturer & 0x1F));
+  identity.Product = static_cast<uint16_t>(edid[10] | (edid[11] << 8));
+  identity.Serial = static_cast<uint32_t>(edid[12] | (edid[13] << 8) | (edid[14] << 16) | (static_cast<uint32_t>(edid[15]) << 24));
+  return identity;
+}
@@ -0,0 +1,108 @@
+// executor.h : A small pool of threads for blocking monitor work that has no bus worker to run on.
+//
+#pragma once
+
+#include "command_scheduler.h"
+#include "platform.h"
+#include "trace.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// Runs tasks on up to maxThreads threads, started as the tasks come in and
+// kept for later ones. Meant for work that waits on the platform rather than
+// the CPU, such as opening a monitor or reading its capabilities: each task
+// holds a thread until it returns, and a task that finds every thread busy
+// waits for one. The destructor runs the tasks still queued and joins.
+class Executor
+{
+public:
+  explicit Executor(size_t maxThreads)
+    : m_maxThreads{ maxThreads }
+  {
+  }
+
+  Executor(Executor const&) = delete;
+  Executor& operator=(Executor const&) = delete;
+
+  ~Executor()
+  {
+    {
+      std::lock_guard<std::mutex> lock{ m_mutex };
+      m_stopping = true;
+    }
+    m_queued.notify_all();
+    for (auto& thread : m_threads)
+    {
+      thread.join();
+    }
+  }
+
+  // work() returns a T; the future also holds the error code it left behind.
+  template<typename T, typename Work>
+  std::future<CommandResult<T>> Run(Work work)
+  {
+    auto promise = std::make_shared<std::promise<CommandResult<T>>>();
+    auto result = promise->get_future();
+    {
+      std::lock_guard<std::mutex> lock{ m_mutex };
+      m_queue.push_back([promise, work]
+      {
+        CommandResult<T> reply{};
+        reply.Value = work();
+        reply.Error = GetLastErrorCode();
+        promise->set_value(std::move(reply));
+      });
+      if (m_queue.size() > m_idle && m_threads.size() < m_maxThreads)
+      {
+        m_threads.emplace_back([this, index = m_threads.size()] { Worker(index); });
+      }
+    }
+    m_queued.notify_one();
+    return result;
+  }
+
+private:
+
+  void Worker(size_t index)
+  {
+    if (const auto tracer = Tracer::Active())
+    {
+      tracer->NameThread("Executor " + std::to_string(index));
+    }
+    for (;;)
+    {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        ++m_idle;
+        m_queued.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+        --m_idle;
+        if (m_queue.empty())
+        {
+          return;
+        }
+        task = std::move(m_queue.front());
+        m_queue.pop_front();
+      }
+      task();
+    }
+  }
+
+  size_t m_maxThreads;
+  std::mutex m_mutex;
+  std::condition_variable m_queued;
+  std::deque<std::function<void()>> m_queue;
+  std::vector<std::thread> m_threads;
+  size_t m_idle{ 0 };
+  bool m_stopping{ false };
+};
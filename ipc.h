@@ -0,0 +1,442 @@
+// ipc.h : Local stream connections between the monitor_util client and daemon.
+//
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "platform.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// Named pipe on Windows, Unix domain socket elsewhere.
+inline std::string DefaultIpcEndpoint()
+{
+#ifdef _WIN32
+  return "\\\\.\\pipe\\monitor_util";
+#else
+  const auto runtimeDirectory = GetEnvironmentString("XDG_RUNTIME_DIR");
+  if (!runtimeDirectory.empty())
+  {
+    return runtimeDirectory + "/monitor_util.sock";
+  }
+  return "/tmp/monitor_util-" + std::to_string(getuid()) + ".sock";
+#endif
+}
+
+class IpcConnection
+{
+public:
+#ifdef _WIN32
+  // Server pipes are overlapped, so that each transfer on them can give up
+  // after timeout milliseconds.
+  explicit IpcConnection(HANDLE handle, bool server, DWORD timeout = INFINITE)
+    : m_handle{ handle }
+    , m_server{ server }
+    , m_timeout{ timeout }
+    , m_event{ server ? CreateEvent(nullptr, TRUE, FALSE, nullptr) : nullptr }
+  {
+  }
+#else
+  explicit IpcConnection(int fd)
+    : m_fd{ fd }
+  {
+  }
+#endif
+
+  IpcConnection(IpcConnection const&) = delete;
+  IpcConnection& operator=(IpcConnection const&) = delete;
+
+  ~IpcConnection()
+  {
+#ifdef _WIN32
+    // Each server instance serves a single client, so the handle is closed
+    // rather than disconnected: the client can still read what is buffered,
+    // and a client that does not read cannot block the server here.
+    if (m_event)
+    {
+      CloseHandle(m_event);
+    }
+    CloseHandle(m_handle);
+#else
+    close(m_fd);
+#endif
+  }
+
+  bool Write(std::string const& data)
+  {
+    size_t written = 0;
+    while (written < data.size())
+    {
+#ifdef _WIN32
+      DWORD count = 0;
+      OVERLAPPED overlapped{};
+      overlapped.hEvent = m_event;
+      if (!Finish(WriteFile(m_handle, data.data() + written, static_cast<DWORD>(data.size() - written), m_server ? nullptr : &count, m_server ? &overlapped : nullptr), &overlapped, &count))
+      {
+        return false;
+      }
+#else
+      const auto count = send(m_fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+      if (count <= 0)
+      {
+        return false;
+      }
+#endif
+      written += static_cast<size_t>(count);
+    }
+    return true;
+  }
+
+  // Reads up to size bytes. Returns 0 at end of stream or on error.
+  size_t Read(char* buffer, size_t size)
+  {
+#ifdef _WIN32
+    DWORD count = 0;
+    OVERLAPPED overlapped{};
+    overlapped.hEvent = m_event;
+    if (!Finish(ReadFile(m_handle, buffer, static_cast<DWORD>(size), m_server ? nullptr : &count, m_server ? &overlapped : nullptr), &overlapped, &count))
+    {
+      return 0;
+    }
+    return count;
+#else
+    const auto count = recv(m_fd, buffer, size, 0);
+    return count > 0 ? static_cast<size_t>(count) : 0;
+#endif
+  }
+
+  // Reads until the delimiter, which is consumed but not returned.
+  bool ReadUntil(std::string const& delimiter, std::string* data)
+  {
+    for (;;)
+    {
+      const auto end = m_buffer.find(delimiter);
+      if (end != std::string::npos)
+      {
+        *data = m_buffer.substr(0, end);
+        m_buffer.erase(0, end + delimiter.size());
+        return true;
+      }
+      char chunk[4096];
+      const auto count = Read(chunk, sizeof chunk);
+      if (count == 0)
+      {
+        return false;
+      }
+      m_buffer.append(chunk, count);
+    }
+  }
+
+  // Reads exactly size bytes, continuing from anything ReadUntil buffered.
+  bool ReadExactly(size_t size, std::string* data)
+  {
+    while (m_buffer.size() < size)
+    {
+      char chunk[4096];
+      const auto count = Read(chunk, sizeof chunk);
+      if (count == 0)
+      {
+        return false;
+      }
+      m_buffer.append(chunk, count);
+    }
+    *data = m_buffer.substr(0, size);
+    m_buffer.erase(0, size);
+    return true;
+  }
+
+  static std::unique_ptr<IpcConnection> Connect(std::string const& endpoint)
+  {
+#ifdef _WIN32
+    // Every pipe instance may be busy with another client, or the daemon may
+    // be between instances for a moment, so keep trying for a while.
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds{ 2000 };
+    for (;;)
+    {
+      const auto handle = CreateFile(endpoint.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+      if (handle != INVALID_HANDLE_VALUE)
+      {
+        return std::make_unique<IpcConnection>(handle, false);
+      }
+      const auto error = GetLastError();
+      const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+      if ((error != ERROR_PIPE_BUSY && error != ERROR_FILE_NOT_FOUND) || remaining.count() <= 0)
+      {
+        return nullptr;
+      }
+      if (error == ERROR_PIPE_BUSY)
+      {
+        (void)WaitNamedPipe(endpoint.c_str(), static_cast<DWORD>(remaining.count()));
+      }
+      else
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds{ 10 });
+      }
+    }
+#else
+    sockaddr_un address{};
+    if (!MakeAddress(endpoint, &address))
+    {
+      return nullptr;
+    }
+    const auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+      return nullptr;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof address) != 0)
+    {
+      close(fd);
+      return nullptr;
+    }
+    return std::make_unique<IpcConnection>(fd);
+#endif
+  }
+
+#ifndef _WIN32
+  static bool MakeAddress(std::string const& endpoint, sockaddr_un* address)
+  {
+    if (endpoint.size() >= sizeof address->sun_path)
+    {
+      return false;
+    }
+    address->sun_family = AF_UNIX;
+    std::memcpy(address->sun_path, endpoint.c_str(), endpoint.size() + 1);
+    return true;
+  }
+#endif
+
+private:
+#ifdef _WIN32
+  // Waits for an overlapped transfer on a server pipe, cancelling it after the
+  // timeout.
+  bool Finish(BOOL started, OVERLAPPED* overlapped, DWORD* count)
+  {
+    if (!m_server || started)
+    {
+      return started != FALSE;
+    }
+    if (GetLastError() != ERROR_IO_PENDING)
+    {
+      return false;
+    }
+    if (WaitForSingleObject(m_event, m_timeout) != WAIT_OBJECT_0)
+    {
+      (void)CancelIo(m_handle);
+    }
+    return GetOverlappedResult(m_handle, overlapped, count, TRUE) != FALSE;
+  }
+
+  HANDLE m_handle;
+  bool m_server;
+  DWORD m_timeout;
+  HANDLE m_event;
+#else
+  int m_fd;
+#endif
+  std::string m_buffer;
+};
+
+// Accepts one client at a time. On Windows the next pipe instance is created
+// as soon as a client connects, so clients that come while one is served wait
+// for it instead of finding no pipe at all. A client that stops sending its
+// request or reading the response is dropped after ClientTimeout, so it cannot
+// hold up the others.
+//
+// Listen() fails while another daemon is listening on the endpoint: on Linux a
+// socket that still answers is left alone and only a stale one is replaced,
+// and on Windows the first pipe instance must be this process's own. The pipe
+// is open to the current user and local clients only.
+class IpcServer
+{
+public:
+  static constexpr std::chrono::milliseconds ClientTimeout{ 2000 };
+
+  explicit IpcServer(std::string endpoint)
+    : m_endpoint{ std::move(endpoint) }
+  {
+  }
+
+  IpcServer(IpcServer const&) = delete;
+  IpcServer& operator=(IpcServer const&) = delete;
+
+  ~IpcServer()
+  {
+#ifdef _WIN32
+    if (m_pipe != INVALID_HANDLE_VALUE)
+    {
+      CloseHandle(m_pipe);
+    }
+#else
+    if (m_fd >= 0)
+    {
+      close(m_fd);
+    }
+    if (m_bound)
+    {
+      unlink(m_endpoint.c_str());
+    }
+#endif
+  }
+
+  bool Listen()
+  {
+#ifdef _WIN32
+    if (!InitializeSecurity())
+    {
+      return false;
+    }
+    m_pipe = CreateInstance(true);
+    return m_pipe != INVALID_HANDLE_VALUE;
+#else
+    sockaddr_un address{};
+    if (!IpcConnection::MakeAddress(m_endpoint, &address))
+    {
+      return false;
+    }
+    // Remove a socket left behind by a daemon that did not shut down cleanly,
+    // but not one that a running daemon still answers on.
+    struct stat status{};
+    if (lstat(m_endpoint.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+    {
+      if (IpcConnection::Connect(m_endpoint))
+      {
+        errno = EADDRINUSE;
+        return false;
+      }
+      unlink(m_endpoint.c_str());
+    }
+    m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_fd < 0)
+    {
+      return false;
+    }
+    const auto mask = umask(0077);
+    m_bound = bind(m_fd, reinterpret_cast<sockaddr*>(&address), sizeof address) == 0;
+    umask(mask);
+    return m_bound && listen(m_fd, 8) == 0;
+#endif
+  }
+
+  std::unique_ptr<IpcConnection> Accept()
+  {
+#ifdef _WIN32
+    if (m_pipe == INVALID_HANDLE_VALUE && (m_pipe = CreateInstance(false)) == INVALID_HANDLE_VALUE)
+    {
+      return nullptr;
+    }
+    OVERLAPPED overlapped{};
+    overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    auto connected = ConnectNamedPipe(m_pipe, &overlapped) != FALSE;
+    const auto error = GetLastError();
+    if (!connected && error == ERROR_IO_PENDING)
+    {
+      DWORD count = 0;
+      connected = GetOverlappedResult(m_pipe, &overlapped, &count, TRUE) != FALSE;
+    }
+    if (overlapped.hEvent)
+    {
+      CloseHandle(overlapped.hEvent);
+    }
+    if (!connected && error != ERROR_PIPE_CONNECTED)
+    {
+      CloseHandle(m_pipe);
+      m_pipe = INVALID_HANDLE_VALUE;
+      return nullptr;
+    }
+    auto connection = std::make_unique<IpcConnection>(m_pipe, true, static_cast<DWORD>(ClientTimeout.count()));
+    m_pipe = CreateInstance(false);
+    return connection;
+#else
+    const auto fd = accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      return nullptr;
+    }
+    timeval timeout{};
+    timeout.tv_sec = static_cast<time_t>(ClientTimeout.count() / 1000);
+    timeout.tv_usec = static_cast<suseconds_t>(ClientTimeout.count() % 1000 * 1000);
+    (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    (void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+    return std::make_unique<IpcConnection>(fd);
+#endif
+  }
+
+private:
+#ifdef _WIN32
+  // Builds a security descriptor whose DACL allows the current user only.
+  bool InitializeSecurity()
+  {
+    HANDLE token = nullptr;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token))
+    {
+      return false;
+    }
+    DWORD size = 0;
+    (void)GetTokenInformation(token, TokenUser, nullptr, 0, &size);
+    m_user.resize(size);
+    const auto gotUser = size > 0 && GetTokenInformation(token, TokenUser, m_user.data(), size, &size);
+    CloseHandle(token);
+    if (!gotUser)
+    {
+      return false;
+    }
+    const auto sid = reinterpret_cast<TOKEN_USER const*>(m_user.data())->User.Sid;
+    m_acl.resize(sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) + GetLengthSid(sid));
+    const auto acl = reinterpret_cast<ACL*>(m_acl.data());
+    if (!InitializeAcl(acl, static_cast<DWORD>(m_acl.size()), ACL_REVISION) ||
+      !AddAccessAllowedAce(acl, ACL_REVISION, GENERIC_ALL, sid) ||
+      !InitializeSecurityDescriptor(&m_descriptor, SECURITY_DESCRIPTOR_REVISION) ||
+      !SetSecurityDescriptorDacl(&m_descriptor, TRUE, acl, FALSE))
+    {
+      return false;
+    }
+    m_attributes.nLength = sizeof m_attributes;
+    m_attributes.lpSecurityDescriptor = &m_descriptor;
+    m_attributes.bInheritHandle = FALSE;
+    return true;
+  }
+
+  // The first instance fails if any process already has the pipe name.
+  HANDLE CreateInstance(bool first)
+  {
+    return CreateNamedPipe(
+      m_endpoint.c_str(),
+      PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+      PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+      PIPE_UNLIMITED_INSTANCES,
+      4096,
+      4096,
+      0,
+      &m_attributes);
+  }
+#endif
+
+  std::string m_endpoint;
+#ifdef _WIN32
+  HANDLE m_pipe{ INVALID_HANDLE_VALUE };
+  std::vector<uint8_t> m_user;
+  std::vector<uint8_t> m_acl;
+  SECURITY_DESCRIPTOR m_descriptor{};
+  SECURITY_ATTRIBUTES m_attributes{};
+#else
+  int m_fd{ -1 };
+  bool m_bound{ false };
+#endif
+};
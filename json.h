@@ -0,0 +1,32 @@
+// json.h : Helpers for writing JSON by hand.
+//
+#pragma once
+
+#include <cstdio>
+#include <ostream>
+#include <string_view>
+
+
+// Writes the text as a quoted JSON string.
+inline void WriteJsonString(std::ostream& out, std::string_view text)
+{
+  out << '"';
+  for (const auto c : text)
+  {
+    if (c == '"' || c == '\\')
+    {
+      out << '\\' << c;
+    }
+    else if (static_cast<unsigned char>(c) < 0x20)
+    {
+      char code[8];
+      std::snprintf(code, sizeof code, "\\u%04x", static_cast<unsigned>(c));
+      out << code;
+    }
+    else
+    {
+      out << c;
+    }
+  }
+  out << '"';
+}
@@ -0,0 +1,241 @@
+// linux_i2c_backend.h : DDC/CI over the Linux i2c-dev interface (/dev/i2c-*).
+//
+#pragma once
+
+#include "ddc_ci.h"
+#include "edid.h"
+#include "monitor_backend.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+
+class LinuxI2cMonitorDevice : public MonitorDevice
+{
+public:
+  static constexpr uint8_t EdidAddress = 0x50;
+
+  // Delays the host must leave between writing a request and reading its
+  // reply (DDC/CI 1.1). The gaps before the next request are left to the
+  // caller; see GetCommandGaps().
+  static constexpr std::chrono::milliseconds GetVCPReplyDelay{ 40 };
+  static constexpr std::chrono::milliseconds CapabilitiesReplyDelay{ 50 };
+  static constexpr std::chrono::milliseconds TableReadReplyDelay{ 50 };
+
+  LinuxI2cMonitorDevice(int bus, int fd, MonitorIdentity identity)
+    : m_bus{ bus }
+    , m_fd{ fd }
+    , m_identity{ identity }
+  {
+  }
+
+  LinuxI2cMonitorDevice(LinuxI2cMonitorDevice const&) = delete;
+  LinuxI2cMonitorDevice& operator=(LinuxI2cMonitorDevice const&) = delete;
+
+  ~LinuxI2cMonitorDevice() override
+  {
+    close(m_fd);
+  }
+
+  MonitorInfo GetInfo() override
+  {
+    MonitorInfo monitorInfo{};
+    monitorInfo.Name = "/dev/i2c-" + std::to_string(m_bus);
+    monitorInfo.Primary = false;
+    return monitorInfo;
+  }
+
+  MonitorIdentity GetIdentity() override
+  {
+    return m_identity;
+  }
+
+  VCPFeatureResult GetVCPFeature(uint8_t code) override
+  {
+    VCPFeatureResult value{};
+    uint8_t reply[DdcCiGetVCPReplySize];
+    if (Request(EncodeGetVCPRequest(code), GetVCPReplyDelay) && ReadReply(reply, sizeof reply) &&
+      DecodeGetVCPReply(reply, sizeof reply, code, &value) != DdcCiStatus::Ok)
+    {
+      errno = EIO;
+    }
+    return value;
+  }
+
+  bool SetVCPFeature(uint8_t code, uint32_t value) override
+  {
+    return Request(EncodeSetVCPRequest(code, value), std::chrono::milliseconds{ 0 });
+  }
+
+  bool GetCapabilitiesString(std::string* capabilities) override
+  {
+    capabilities->clear();
+    return ReadCapabilitiesFragments(*this, 0, [capabilities](std::string_view text)
+    {
+      capabilities->append(text.data(), text.size());
+      return true;
+    }) && !capabilities->empty();
+  }
+
+  bool ReadCapabilitiesFragment(uint16_t offset, CapabilitiesFragment* fragment) override
+  {
+    TraceSpan span{ "ddc", "Capabilities fragment", "offset", offset };
+    uint8_t reply[DdcCiMaxMessageSize];
+    DdcCiBytes data{};
+    if (!Request(EncodeCapabilitiesRequest(offset), CapabilitiesReplyDelay) || !ReadReply(reply, sizeof reply))
+    {
+      return false;
+    }
+    if (DecodeCapabilitiesReply(reply, sizeof reply, offset, &data) != DdcCiStatus::Ok)
+    {
+      errno = EIO;
+      return false;
+    }
+    const auto size = (std::min)(data.Size, sizeof fragment->Data);
+    fragment->Offset = offset;
+    fragment->Size = static_cast<uint8_t>(size);
+    std::copy(data.Data, data.Data + size, fragment->Data);
+    return true;
+  }
+
+  bool ReadTableFragment(uint8_t code, uint16_t offset, TableFragment* fragment) override
+  {
+    uint8_t reply[DdcCiMaxMessageSize];
+    DdcCiBytes data{};
+    if (!Request(EncodeTableReadRequest(code, offset), TableReadReplyDelay) || !ReadReply(reply, sizeof reply))
+    {
+      return false;
+    }
+    if (DecodeTableReadReply(reply, sizeof reply, offset, &data) != DdcCiStatus::Ok)
+    {
+      errno = EIO;
+      return false;
+    }
+    const auto size = (std::min)(data.Size, sizeof fragment->Data);
+    fragment->Offset = offset;
+    fragment->Size = static_cast<uint8_t>(size);
+    std::copy(data.Data, data.Data + size, fragment->Data);
+    return true;
+  }
+
+  bool WriteTableFragment(uint8_t code, TableFragment const& fragment) override
+  {
+    return Request(EncodeTableWriteRequest(code, fragment.Offset, fragment.Data, fragment.Size), std::chrono::milliseconds{ 0 });
+  }
+
+private:
+
+  bool Request(DdcCiMessage const& message, std::chrono::milliseconds delay)
+  {
+    const auto written = write(m_fd, message.Bytes, message.Size);
+    if (delay.count() > 0)
+    {
+      std::this_thread::sleep_for(delay);
+    }
+    return message.Size > 0 && written == static_cast<ssize_t>(message.Size);
+  }
+
+  // Reads as many bytes as the longest expected reply; a shorter reply leaves
+  // padding behind it, which the decoder ignores.
+  bool ReadReply(uint8_t* reply, size_t size)
+  {
+    return read(m_fd, reply, size) == static_cast<ssize_t>(size);
+  }
+
+  int m_bus;
+  int m_fd;
+  MonitorIdentity m_identity;
+};
+
+// Treats every i2c-dev bus that answers with an EDID at 0x50 as a monitor, in
+// bus number order.
+class LinuxI2cBackend : public MonitorBackend
+{
+public:
+  std::unique_ptr<MonitorDevice> Open(int index) override
+  {
+    for (const auto bus : GetBuses())
+    {
+      TraceSpan span{ "open", "Probe i2c bus", "bus", static_cast<uint32_t>(bus) };
+      const auto fd = open(("/dev/i2c-" + std::to_string(bus)).c_str(), O_RDWR | O_CLOEXEC);
+      if (fd < 0)
+      {
+        continue;
+      }
+      const auto identity = ReadIdentity(fd);
+      if (identity.Valid() && index-- == 0 && ioctl(fd, I2C_SLAVE, DdcCiAddress) == 0)
+      {
+        return std::make_unique<LinuxI2cMonitorDevice>(bus, fd, identity);
+      }
+      close(fd);
+      if (index < 0)
+      {
+        break;
+      }
+    }
+    return nullptr;
+  }
+
+private:
+
+  static std::vector<int> GetBuses()
+  {
+    std::vector<int> buses;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator{ "/dev", error })
+    {
+      const auto name = entry.path().filename().string();
+      if (name.compare(0, 4, "i2c-") != 0)
+      {
+        continue;
+      }
+      // The whole rest of the name must be a bus number that fits an int.
+      auto bus = 0;
+      const auto end = name.data() + name.size();
+      const auto parsed = std::from_chars(name.data() + 4, end, bus);
+      if (parsed.ec != std::errc{} || parsed.ptr != end || bus < 0)
+      {
+        continue;
+      }
+      // Skip the chipset's SMBus controllers; displays hang off the GPU's buses.
+      std::ifstream adapterName{ "/sys/bus/i2c/devices/i2c-" + std::to_string(bus) + "/name" };
+      std::string adapter;
+      if (std::getline(adapterName, adapter) && adapter.compare(0, 5, "SMBus") == 0)
+      {
+        continue;
+      }
+      buses.push_back(bus);
+    }
+    std::sort(buses.begin(), buses.end());
+    return buses;
+  }
+
+  static MonitorIdentity ReadIdentity(int fd)
+  {
+    uint8_t edid[128];
+    const uint8_t offset = 0;
+    if (ioctl(fd, I2C_SLAVE, LinuxI2cMonitorDevice::EdidAddress) != 0 ||
+      write(fd, &offset, 1) != 1 ||
+      read(fd, edid, sizeof edid) != static_cast<ssize_t>(sizeof edid))
+    {
+      return {};
+    }
+    return ParseEdidIdentity(edid, sizeof edid);
+  }
+};
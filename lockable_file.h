@@ -0,0 +1,172 @@
+// lockable_file.h : Byte-range locks on a file that other processes see too.
+//
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstdint>
+#include <string>
+
+
+// A file opened for reading and writing, with exclusive or shared locks on
+// single bytes that other processes see too. A byte may lie past the end of
+// the file. The system drops a holder's locks when it exits, however it exits.
+// Each handle holds its own locks, so one opened per lock holder also keeps
+// threads of the same process apart.
+class LockableFile
+{
+public:
+  LockableFile() = default;
+  LockableFile(LockableFile const&) = delete;
+  LockableFile& operator=(LockableFile const&) = delete;
+
+  ~LockableFile()
+  {
+#ifdef _WIN32
+    if (m_file != INVALID_HANDLE_VALUE)
+    {
+      CloseHandle(m_file);
+    }
+#else
+    if (m_fd >= 0)
+    {
+      close(m_fd);
+    }
+#endif
+  }
+
+  bool Open(std::string const& path)
+  {
+#ifdef _WIN32
+    m_file = CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    return m_file != INVALID_HANDLE_VALUE;
+#else
+    m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    return m_fd >= 0;
+#endif
+  }
+
+  // Blocks until no other handle holds the byte.
+  bool Lock(uint64_t offset)
+  {
+#ifdef _WIN32
+    auto overlapped = Overlapped(offset);
+    return LockFileEx(m_file, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped) != FALSE;
+#else
+    auto lock = Range(F_WRLCK, offset);
+    auto result = 0;
+    while ((result = fcntl(m_fd, F_OFD_SETLKW, &lock)) != 0 && errno == EINTR)
+    {
+    }
+    return result == 0;
+#endif
+  }
+
+  // Returns false at once if another handle holds the byte.
+  bool TryLock(uint64_t offset)
+  {
+#ifdef _WIN32
+    auto overlapped = Overlapped(offset);
+    return LockFileEx(m_file, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped) != FALSE;
+#else
+    auto lock = Range(F_WRLCK, offset);
+    return fcntl(m_fd, F_OFD_SETLK, &lock) == 0;
+#endif
+  }
+
+  // A lock that other handles may share, but that keeps Lock() and TryLock()
+  // out. Blocks while another handle holds the byte exclusively.
+  bool LockShared(uint64_t offset)
+  {
+#ifdef _WIN32
+    auto overlapped = Overlapped(offset);
+    return LockFileEx(m_file, 0, 0, 1, 0, &overlapped) != FALSE;
+#else
+    auto lock = Range(F_RDLCK, offset);
+    auto result = 0;
+    while ((result = fcntl(m_fd, F_OFD_SETLKW, &lock)) != 0 && errno == EINTR)
+    {
+    }
+    return result == 0;
+#endif
+  }
+
+  void Unlock(uint64_t offset)
+  {
+#ifdef _WIN32
+    auto overlapped = Overlapped(offset);
+    (void)UnlockFileEx(m_file, 0, 1, 0, &overlapped);
+#else
+    auto lock = Range(F_UNLCK, offset);
+    (void)fcntl(m_fd, F_OFD_SETLK, &lock);
+#endif
+  }
+
+  uint64_t Size() const
+  {
+#ifdef _WIN32
+    LARGE_INTEGER size{};
+    return GetFileSizeEx(m_file, &size) ? static_cast<uint64_t>(size.QuadPart) : 0;
+#else
+    struct stat status{};
+    return fstat(m_fd, &status) == 0 ? static_cast<uint64_t>(status.st_size) : 0;
+#endif
+  }
+
+  // Grows or shrinks the file; new bytes are zero.
+  bool Resize(uint64_t size)
+  {
+#ifdef _WIN32
+    LARGE_INTEGER position{};
+    position.QuadPart = static_cast<LONGLONG>(size);
+    return SetFilePointerEx(m_file, position, nullptr, FILE_BEGIN) && SetEndOfFile(m_file);
+#else
+    return ftruncate(m_fd, static_cast<off_t>(size)) == 0;
+#endif
+  }
+
+#ifdef _WIN32
+  HANDLE Handle() const
+  {
+    return m_file;
+  }
+#else
+  int Handle() const
+  {
+    return m_fd;
+  }
+#endif
+
+private:
+#ifdef _WIN32
+  static OVERLAPPED Overlapped(uint64_t offset)
+  {
+    OVERLAPPED overlapped{};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    return overlapped;
+  }
+
+  HANDLE m_file{ INVALID_HANDLE_VALUE };
+#else
+  // Open file description locks belong to the handle rather than the process.
+  static struct flock Range(short type, uint64_t offset)
+  {
+    struct flock lock{};
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = static_cast<off_t>(offset);
+    lock.l_len = 1;
+    return lock;
+  }
+
+  int m_fd{ -1 };
+#endif
+};
@@ -0,0 +1,132 @@
+// mapped_file.h : Read-only memory mapping of a file.
+//
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+class MappedFile
+{
+public:
+  MappedFile() = default;
+  MappedFile(MappedFile const&) = delete;
+  MappedFile& operator=(MappedFile const&) = delete;
+
+  ~MappedFile()
+  {
+    Close();
+  }
+
+  bool Open(std::string const& path)
+  {
+    Close();
+#ifdef _WIN32
+    m_file = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+      return false;
+    }
+    LARGE_INTEGER size{};
+    if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+    {
+      Close();
+      return false;
+    }
+    m_mapping = CreateFileMapping(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_mapping)
+    {
+      Close();
+      return false;
+    }
+    m_data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    m_size = static_cast<size_t>(size.QuadPart);
+#else
+    m_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0)
+    {
+      return false;
+    }
+    struct stat status{};
+    if (fstat(m_fd, &status) != 0 || status.st_size == 0)
+    {
+      Close();
+      return false;
+    }
+    m_data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, m_fd, 0);
+    if (m_data == MAP_FAILED)
+    {
+      m_data = nullptr;
+    }
+    m_size = static_cast<size_t>(status.st_size);
+#endif
+    if (!m_data)
+    {
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  void Close()
+  {
+#ifdef _WIN32
+    if (m_data)
+    {
+      UnmapViewOfFile(m_data);
+    }
+    if (m_mapping)
+    {
+      CloseHandle(m_mapping);
+      m_mapping = nullptr;
+    }
+    if (m_file != INVALID_HANDLE_VALUE)
+    {
+      CloseHandle(m_file);
+      m_file = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (m_data)
+    {
+      munmap(m_data, m_size);
+    }
+    if (m_fd >= 0)
+    {
+      close(m_fd);
+      m_fd = -1;
+    }
+#endif
+    m_data = nullptr;
+    m_size = 0;
+  }
+
+  uint8_t const* Data() const
+  {
+    return static_cast<uint8_t const*>(m_data);
+  }
+
+  size_t Size() const
+  {
+    return m_size;
+  }
+
+private:
+#ifdef _WIN32
+  HANDLE m_file{ INVALID_HANDLE_VALUE };
+  HANDLE m_mapping{ nullptr };
+#else
+  int m_fd{ -1 };
+#endif
+  void* m_data{ nullptr };
+  size_t m_size{ 0 };
+};
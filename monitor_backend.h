@@ -0,0 +1,190 @@
+// monitor_backend.h : Interface between MonitorUtils and the platform's DDC/CI transport.
+//
+#pragma once
+
+#include "edid.h"
+#include "platform.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+
+
+struct HighLevelCapabilities
+{
+  bool Valid{ false };
+  bool None{ false };
+  bool Brightness{ false };
+  bool ColorTemperature{ false };
+  bool Contrast{ false };
+  bool Degauss{ false };
+  bool DisplayAreaPosition{ false };
+  bool DisplayAreaSize{ false };
+  bool MonitorTechnologyType{ false };
+  bool RedGreenBlueDrive{ false };
+  bool RedGreenBlueGain{ false };
+  bool RestoreFactoryColorDefaults{ false };
+  bool RestoreFactoryDefaults{ false };
+  bool RestoreFactoryDefaultsEnablesMonitorSettings{ false };
+};
+
+enum class VCPCodeType
+{
+  Momentary,
+  SetParameter
+};
+
+struct VCPFeatureResult
+{
+  bool Success;
+  VCPCodeType CodeType;
+  uint32_t CurrentValue;
+  uint32_t MaxValue;
+};
+
+struct MonitorInfo
+{
+  std::string Name{ "Invalid" };
+  bool Primary{ false };
+};
+
+// Table features (MCCS Table Read and Table Write, e.g. a LUT) move in
+// fragments of up to TableFragmentSize bytes at a byte offset into the table.
+constexpr size_t TableFragmentSize = 32;
+
+struct TableFragment
+{
+  uint16_t Offset;
+  uint8_t Size;
+  uint8_t Data[TableFragmentSize];
+};
+
+// The capabilities string moves in fragments of the same size, at a byte
+// offset into the string.
+struct CapabilitiesFragment
+{
+  uint16_t Offset;
+  uint8_t Size;
+  char Data[TableFragmentSize];
+};
+
+// How long the monitor needs after each kind of command before it accepts the
+// next one. The defaults are the DDC/CI 1.1 host delays; monitors that get
+// commands sooner NAK them or reply with stale data.
+struct CommandGaps
+{
+  std::chrono::milliseconds AfterGetVCP{ 40 };
+  std::chrono::milliseconds AfterSetVCP{ 50 };
+  std::chrono::milliseconds AfterCapabilities{ 50 };
+};
+
+// A single physical monitor. Implementations own whatever handle the platform
+// needs and release it on destruction.
+class MonitorDevice
+{
+public:
+  virtual ~MonitorDevice() = default;
+
+  virtual MonitorInfo GetInfo() = 0;
+  virtual MonitorIdentity GetIdentity() = 0;
+  virtual VCPFeatureResult GetVCPFeature(uint8_t code) = 0;
+  virtual bool SetVCPFeature(uint8_t code, uint32_t value) = 0;
+  virtual bool GetCapabilitiesString(std::string* capabilities) = 0;
+
+  // Only available where the platform implements the high-level monitor API.
+  virtual HighLevelCapabilities GetHighLevelCapabilities()
+  {
+    return {};
+  }
+
+  // Reads the fragment of the capabilities string at offset; past the end of
+  // the string the fragment is empty. Platforms that only hand out the whole
+  // string leave this unsupported.
+  virtual bool ReadCapabilitiesFragment(uint16_t offset, CapabilitiesFragment* fragment)
+  {
+    (void)offset;
+    (void)fragment;
+    SetLastErrorCode(NotSupportedErrorCode);
+    return false;
+  }
+
+  // Reads the fragment of a table feature at offset; past the end of the
+  // table the fragment is empty. Not every platform can send table commands.
+  virtual bool ReadTableFragment(uint8_t code, uint16_t offset, TableFragment* fragment)
+  {
+    (void)code;
+    (void)offset;
+    (void)fragment;
+    SetLastErrorCode(NotSupportedErrorCode);
+    return false;
+  }
+
+  virtual bool WriteTableFragment(uint8_t code, TableFragment const& fragment)
+  {
+    (void)code;
+    (void)fragment;
+    SetLastErrorCode(NotSupportedErrorCode);
+    return false;
+  }
+
+  // Gaps the caller has to leave between commands. Backends whose platform API
+  // already waits them out return zero gaps.
+  virtual CommandGaps GetCommandGaps()
+  {
+    return {};
+  }
+};
+
+class MonitorBackend
+{
+public:
+  virtual ~MonitorBackend() = default;
+
+  // Returns nullptr if there is no monitor at the index.
+  virtual std::unique_ptr<MonitorDevice> Open(int index) = 0;
+};
+
+// Reads the capabilities string fragment by fragment, handing each fragment's
+// text to sink(std::string_view) as it arrives, until the string ends or sink
+// returns false. A fragment that fails is asked for again, up to retries more
+// times, after the capabilities gap in case the monitor took the request that
+// failed; the fragments before it are kept. Unsupported devices fail at once.
+template<typename Sink>
+bool ReadCapabilitiesFragments(MonitorDevice& device, int retries, Sink&& sink)
+{
+  size_t offset = 0;
+  while (offset <= 0xFFFF)
+  {
+    CapabilitiesFragment fragment{};
+    auto success = false;
+    for (auto attempt = 0; !success && attempt <= retries; ++attempt)
+    {
+      if (attempt > 0)
+      {
+        std::this_thread::sleep_for(device.GetCommandGaps().AfterCapabilities);
+      }
+      success = device.ReadCapabilitiesFragment(static_cast<uint16_t>(offset), &fragment);
+      if (!success && GetLastErrorCode() == NotSupportedErrorCode)
+      {
+        return false;
+      }
+    }
+    if (!success)
+    {
+      return false;
+    }
+    // An empty fragment or a terminating NUL ends the string.
+    const std::string_view data{ fragment.Data, fragment.Size };
+    const auto text = data.substr(0, data.find('\0'));
+    if (text.empty() || !sink(text) || text.size() < data.size())
+    {
+      break;
+    }
+    offset += fragment.Size;
+  }
+  return true;
+}
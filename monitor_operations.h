@@ -0,0 +1,335 @@
+// monitor_operations.h : Operations built from several VCP commands: verified
+// writes, input toggling and writes lined up across monitors.
+//
+#pragma once
+
+#include "monitor_utils.h"
+#include "trace.h"
+#include "vcp_features.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+
+constexpr uint8_t InputSourceCode = VCPCode("input-source");
+constexpr uint32_t InputSourceDisplayPort = VCPValue("input-source", "displayport1");
+constexpr uint32_t InputSourceHdmi = VCPValue("input-source", "hdmi1");
+
+// How Verify() polls for a written value to read back. The first read goes
+// out right after the write, once the bus scheduler has left the post-write
+// gap. Later reads back off from the 50 ms minimum command
+// gap, and back off faster after failed reads: a monitor that is busy
+// switching inputs often NAKs, and more reads only slow it down further.
+struct VerifyPolicy
+{
+  std::chrono::milliseconds Timeout{ 3000 };
+  std::chrono::milliseconds FirstInterval{ 50 };
+  std::chrono::milliseconds MaxInterval{ 400 };
+};
+
+struct Verification
+{
+  MonitorUtils::VCPFeatureResult Result{};
+  bool Converged{ false };
+  int Reads{ 0 };
+  std::chrono::steady_clock::duration Elapsed{};
+};
+
+inline Verification Verify(MonitorUtils::Monitor const& monitor, uint32_t vcpCode, uint32_t vcpValue, VerifyPolicy const& policy = {})
+{
+  TraceSpan span{ "operation", "Verify", "code", vcpCode, "value", vcpValue };
+  const auto startTime = std::chrono::steady_clock::now();
+  const auto deadline = startTime + policy.Timeout;
+  Verification verification{};
+  std::chrono::duration<double, std::milli> interval{ policy.FirstInterval };
+  for (;;)
+  {
+    verification.Result = MonitorUtils::GetVCPFeature(monitor, static_cast<uint8_t>(vcpCode));
+    ++verification.Reads;
+    const auto now = std::chrono::steady_clock::now();
+    verification.Elapsed = now - startTime;
+    verification.Converged = verification.Result.Success && verification.Result.CurrentValue == vcpValue;
+    if (verification.Converged || now >= deadline)
+    {
+      break;
+    }
+
+    const auto wait = std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+    std::this_thread::sleep_for((std::min)(wait, deadline - now));
+    interval *= verification.Result.Success ? 1.5 : 2.0;
+    interval = (std::min)(interval, std::chrono::duration<double, std::milli>{ policy.MaxInterval });
+  }
+  return verification;
+}
+
+// Blocks each thread in ArriveAndWait() until the expected number of threads
+// has arrived. Threads that give up before arriving must ArriveAndDrop() so the
+// others are not left waiting for them.
+class Barrier
+{
+public:
+  explicit Barrier(size_t count)
+    : m_count{ count }
+  {
+  }
+
+  void ArriveAndWait()
+  {
+    std::unique_lock<std::mutex> lock{ m_mutex };
+    const auto generation = m_generation;
+    if (Arrive())
+    {
+      return;
+    }
+    m_released.wait(lock, [&] { return m_generation != generation; });
+  }
+
+  void ArriveAndDrop()
+  {
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    --m_count;
+    if (m_count > 0 && m_arrived == m_count)
+    {
+      Release();
+    }
+  }
+
+private:
+
+  // Returns true if this thread was the last to arrive and released the others.
+  bool Arrive()
+  {
+    if (++m_arrived < m_count)
+    {
+      return false;
+    }
+    Release();
+    return true;
+  }
+
+  void Release()
+  {
+    m_arrived = 0;
+    ++m_generation;
+    m_released.notify_all();
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_released;
+  size_t m_count;
+  size_t m_arrived{ 0 };
+  uint64_t m_generation{ 0 };
+};
+
+// Where one monitor's write happens within a multi-monitor operation. The write
+// waits at the barrier, if any, so all monitors send it together, and the time
+// it was sent and acknowledged is kept for the skew report.
+class CommitPoint
+{
+public:
+  explicit CommitPoint(Barrier* barrier = nullptr)
+    : m_barrier{ barrier }
+  {
+  }
+
+  void BeforeWrite()
+  {
+    if (m_barrier && !m_arrived)
+    {
+      TraceSpan span{ "operation", "Barrier" };
+      m_arrived = true;
+      m_barrier->ArriveAndWait();
+    }
+    m_sent = std::chrono::steady_clock::now();
+  }
+
+  void AfterWrite()
+  {
+    m_acknowledged = std::chrono::steady_clock::now();
+    m_committed = true;
+  }
+
+  // Releases the other monitors if this one never got as far as its write.
+  void Leave()
+  {
+    if (m_barrier && !m_arrived)
+    {
+      m_arrived = true;
+      m_barrier->ArriveAndDrop();
+    }
+  }
+
+  bool Committed() const
+  {
+    return m_committed;
+  }
+
+  std::chrono::steady_clock::time_point Sent() const
+  {
+    return m_sent;
+  }
+
+  std::chrono::steady_clock::time_point Acknowledged() const
+  {
+    return m_acknowledged;
+  }
+
+private:
+  Barrier* m_barrier;
+  bool m_arrived{ false };
+  bool m_committed{ false };
+  std::chrono::steady_clock::time_point m_sent{};
+  std::chrono::steady_clock::time_point m_acknowledged{};
+};
+
+inline bool WriteVCPFeature(MonitorUtils::Monitor const& monitor, uint8_t code, uint32_t value, CommitPoint* commit)
+{
+  if (commit)
+  {
+    commit->BeforeWrite();
+  }
+  TraceSpan span{ "operation", "Write", "code", code, "value", value };
+  const auto success = MonitorUtils::SetVCPFeature(monitor, code, value);
+  if (commit && success)
+  {
+    commit->AfterWrite();
+  }
+  return success;
+}
+
+// Switches between the HDMI and DisplayPort inputs. The current input is read
+// first unless the caller already knows it. Verifies the switch if a policy is
+// given, and reports how it went through verification.
+inline bool Toggle(
+  MonitorUtils::Monitor const& monitor,
+  VerifyPolicy const* verify = nullptr,
+  CommitPoint* commit = nullptr,
+  Verification* verification = nullptr,
+  std::optional<uint32_t> currentInputSource = std::nullopt)
+{
+  TraceSpan span{ "operation", "Toggle" };
+  if (!currentInputSource)
+  {
+    TraceSpan readSpan{ "operation", "Read input source" };
+    const auto result = MonitorUtils::GetVCPFeature(monitor, InputSourceCode);
+    if (result.Success)
+    {
+      currentInputSource = result.CurrentValue;
+    }
+  }
+  if (currentInputSource)
+  {
+    const auto toggledInputSource = (*currentInputSource == InputSourceHdmi) ? InputSourceDisplayPort : InputSourceHdmi;
+    if (WriteVCPFeature(monitor, InputSourceCode, toggledInputSource, commit))
+    {
+      if (verify)
+      {
+        const auto result = Verify(monitor, InputSourceCode, toggledInputSource, *verify);
+        if (verification)
+        {
+          *verification = result;
+        }
+        return result.Converged;
+      }
+      else
+      {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+struct RampResult
+{
+  bool Success{ false };
+  bool Superseded{ false };  // A later ramp of the code took over; still a success
+  uint32_t From{ 0 };
+  uint32_t To{ 0 };
+  uint32_t MaxValue{ 0 };
+  int Steps{ 0 };            // Writes sent
+  std::chrono::steady_clock::duration Elapsed{};
+};
+
+// Moves a continuous control from its current value to target over duration.
+// Each step writes the value the elapsed time calls for, as soon as the write
+// before it is through, so the ramp takes as many steps as the bus allows and
+// a slower bus gets fewer, larger ones. A percentage target is scaled by the
+// control's MaxValue, and a raw one is capped at it. The current value is read
+// first unless the caller already knows it.
+//
+// A ramp of the same code begun later, by this process or another sharing its
+// state, supersedes this one, which stops where it is: rapid requests take
+// over from each other instead of queuing up.
+inline RampResult Ramp(
+  MonitorUtils::Monitor const& monitor,
+  uint8_t code,
+  uint32_t target,
+  bool percent,
+  std::chrono::milliseconds duration,
+  std::optional<MonitorUtils::VCPFeatureResult> current = std::nullopt)
+{
+  TraceSpan span{ "operation", "Ramp", "code", code, "value", target };
+  const auto startTime = std::chrono::steady_clock::now();
+  RampResult ramp{};
+  const auto ticket = MonitorUtils::BeginRamp(monitor, code);
+  if (!current)
+  {
+    current = MonitorUtils::GetVCPFeature(monitor, code);
+  }
+  if (!current->Success || current->CodeType != VCPCodeType::SetParameter || current->MaxValue == 0)
+  {
+    if (current->Success)
+    {
+      SetLastErrorCode(NotSupportedErrorCode);
+    }
+    ramp.Elapsed = std::chrono::steady_clock::now() - startTime;
+    return ramp;
+  }
+  ramp.From = current->CurrentValue;
+  ramp.MaxValue = current->MaxValue;
+  ramp.To = percent ? ((std::min)(target, 100u) * ramp.MaxValue + 50) / 100 : (std::min)(target, ramp.MaxValue);
+
+  const auto distance = std::abs(static_cast<double>(ramp.To) - ramp.From);
+  const auto rampStart = std::chrono::steady_clock::now();
+  auto value = ramp.From;
+  for (;;)
+  {
+    if (!MonitorUtils::IsCurrentRamp(monitor, code, ticket))
+    {
+      ramp.Superseded = true;
+      ramp.Success = true;
+      break;
+    }
+    if (value == ramp.To)
+    {
+      ramp.Success = true;
+      break;
+    }
+    const std::chrono::duration<double, std::milli> elapsed{ std::chrono::steady_clock::now() - rampStart };
+    const auto fraction = duration.count() > 0 ? (std::min)(elapsed / duration, 1.0) : 1.0;
+    const auto next = static_cast<uint32_t>(std::lround(ramp.From + (static_cast<double>(ramp.To) - ramp.From) * fraction));
+    if (next == value)
+    {
+      // Too early for the next value; sleep until it is due.
+      const auto done = std::abs(static_cast<double>(value) - ramp.From);
+      const auto due = std::chrono::duration<double, std::milli>{ duration } * ((done + 0.5) / distance);
+      std::this_thread::sleep_until(rampStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(due));
+      continue;
+    }
+    if (!MonitorUtils::SetVCPFeature(monitor, code, next))
+    {
+      break;
+    }
+    ++ramp.Steps;
+    value = next;
+  }
+  ramp.Elapsed = std::chrono::steady_clock::now() - startTime;
+  return ramp;
+}
@@ -1,722 +1,1779 @@
 // monitor_util.cpp : This file contains the 'main' function. Program execution begins and ends there.
 //
-#include <highlevelmonitorconfigurationapi.h>
-#include <lowlevelmonitorconfigurationapi.h>
-#include <physicalmonitorenumerationapi.h>
-#include <WinUser.h>
-
-#include <cctype>
+#ifndef _WIN32
+#include <strings.h>
+#endif
+
+#include "capabilities_cache.h"
+#include "ipc.h"
+#include "monitor_operations.h"
+#include "monitor_utils.h"
+#include "output.h"
+#include "profile.h"
+#include "shared_state.h"
+#include "simulated_backend.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "vcp_features.h"
+#include "vcp_table.h"
+#include "watch.h"
+
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
 #include <sstream>
 #include <thread>
-#include <variant>
 #include <vector>
 
 
-void PrintLastError()
-{
-  const auto errorCode = GetLastError();
-  if (errorCode != 0)
+void PrintLastError(std::ostream& out = std::cout)
+{
+  const auto errorCode = GetLastErrorCode();
+  if (errorCode != 0)
+  {
+    out << "Error [" << errorCode << "] " << GetErrorMessage(errorCode) << '\n';
+  }
+  else
+  {
+    out << "No error\n";
+  }
+}
+
+// A value read earlier, in this process or another sharing its state, is used
+// instead of reading it again for this long. The user can change the setting
+// from the monitor's own menu, so it is kept short.
+constexpr std::chrono::seconds KnownValueLifetime{ 5 };
+
+struct Arguments
+{
+  bool Valid = { false };
+  int MonitorIndex = 0;
+  std::vector<int> MonitorIndices;  // Set when several monitors are given
+  bool AllMonitors{ false };
+  bool Barrier{ false };
+  bool Stats{ false };
+  bool Plan{ false };
+  bool PrintInfo{ false };
+  bool PrintCapabilities{ false };
+  bool SetVCPFeature{ false };
+  uint32_t SetVCPFeatureAddress{ 0x0 };
+  uint32_t SetVCPFeatureValue{ 0x0 };
+  bool GetVCPFeature{ false };
+  uint32_t GetVCPFeatureAddress{ 0x0 };
+  bool Force{ false };
+  bool Verify{ false };
+  std::chrono::milliseconds VerifyTimeout{ VerifyPolicy{}.Timeout };
+  std::chrono::milliseconds MaxAge{ KnownValueLifetime };
+  bool Toggle{ false };
+  bool Ramp{ false };
+  uint32_t RampCode{ 0x0 };
+  uint32_t RampValue{ 0x0 };
+  bool RampPercent{ false };              // RampValue is a percentage of the maximum
+  std::chrono::milliseconds RampTime{ 500 };
+  bool Dump{ false };
+  std::string SnapshotFile;
+  std::string SaveFile;
+  std::string RestoreFile;
+  std::vector<uint8_t> WatchCodes;
+  uint32_t TableCode{ 0x0 };
+  std::string ReadTableFile;
+  std::string WriteTableFile;
+  bool UseCache{ true };
+  bool InvalidateCache{ false };
+  bool ClearCache{ false };
+  std::string SimulationFile;
+  std::string StateFile;
+  std::string BatchFile;
+  bool Serve{ false };
+  bool Client{ false };
+  std::string Endpoint{ DefaultIpcEndpoint() };
+  std::string TraceFile;
+  OutputFormat Format{ OutputFormat::Text };
+};
+
+std::vector<std::string> TokenizeArguments(int argc, char** argv)
+{
+  std::vector<std::string> args;
+  for (auto i = 1; i < argc; ++i)
+  {
+    args.emplace_back(argv[i]);
+  }
+  return args;
+}
+
+bool ICompare(std::string const& a, std::string const& b)
+{
+#ifdef _WIN32
+  return _stricmp(a.c_str(), b.c_str()) == 0;
+#else
+  return strcasecmp(a.c_str(), b.c_str()) == 0;
+#endif
+}
+
+template<typename T>
+bool GetHex(std::string const& s, T* out)
+{
+  std::stringstream ss{ s };
+  ss >> std::hex >> *out;
+  return !ss.fail() && ss.eof();
+}
+
+template<typename T>
+bool Get(std::string const& s, T* out)
+{
+
+  if (s.size() > 2 && s.at(0) == '0' && (s.at(1) == 'x' || s.at(1) == 'X'))
+  {
+    return GetHex(s.substr(2), out);
+  }
+  else
+  {
+    std::stringstream ss{ s };
+    ss >> *out;
+    return !ss.fail() && ss.eof();
+  }
+}
+
+// Accepts a number or an MCCS feature name such as input-source.
+bool GetVCPCode(std::string const& s, uint32_t* code)
+{
+  if (Get(s, code))
+  {
+    return true;
+  }
+  if (const auto feature = FindVCPFeature(s))
+  {
+    *code = feature->Code;
+    return true;
+  }
+  return false;
+}
+
+// Accepts a number or, for features with named values, a name such as hdmi1.
+bool GetVCPValue(std::string const& s, uint32_t code, uint32_t* value)
+{
+  if (Get(s, value))
+  {
+    return true;
+  }
+  const auto feature = FindVCPFeature(static_cast<uint8_t>(code));
+  if (const auto named = feature ? FindVCPValue(*feature, s) : nullptr)
+  {
+    *value = named->Value;
+    return true;
+  }
+  return false;
+}
+
+// Parses a comma separated list of monitor indices, dropping repeats.
+bool GetMonitorIndices(std::string const& s, std::vector<int>* indices)
+{
+  std::istringstream list{ s };
+  for (std::string item; std::getline(list, item, ',');)
+  {
+    int index = 0;
+    if (!Get(item, &index))
+    {
+      return false;
+    }
+    if (std::find(indices->begin(), indices->end(), index) == indices->end())
+    {
+      indices->push_back(index);
+    }
+  }
+  return !indices->empty() && s.back() != ',';
+}
+
+// Parses a comma separated list of VCP codes or feature names, dropping repeats.
+bool GetVCPCodes(std::string const& s, std::vector<uint8_t>* codes)
+{
+  std::istringstream list{ s };
+  for (std::string item; std::getline(list, item, ',');)
+  {
+    uint32_t code = 0;
+    if (!GetVCPCode(item, &code) || code > 0xFF)
+    {
+      return false;
+    }
+    if (std::find(codes->begin(), codes->end(), static_cast<uint8_t>(code)) == codes->end())
+    {
+      codes->push_back(static_cast<uint8_t>(code));
+    }
+  }
+  return !codes->empty() && s.back() != ',';
+}
+
+// Checks a write with CheckVCPWrite(), and says why it is refused.
+bool CheckWrite(uint32_t code, uint32_t value)
+{
+  switch (CheckVCPWrite(static_cast<uint8_t>(code), value))
+  {
+  case VCPWriteCheck::Allowed:
+    return true;
+  case VCPWriteCheck::ReadOnly:
+    std::cerr << "VCP feature " << DescribeVCPCode(code) << " is read-only (use --force to write it anyway)" << std::endl;
+    return false;
+  case VCPWriteCheck::ValueTooLarge:
+    std::cerr << "VCP values are 16 bits, but got 0x" << std::hex << value << std::endl;
+    return false;
+  case VCPWriteCheck::UnknownValue:
+  {
+    const auto feature = FindVCPFeature(static_cast<uint8_t>(code));
+    std::cerr << "0x" << std::hex << value << " is not a value of VCP feature " << DescribeVCPCode(code) << ", expected one of:";
+    for (size_t i = 0; i < feature->ValueCount; ++i)
+    {
+      std::cerr << " " << feature->Values[i].Name;
+    }
+    std::cerr << " (use --force to write it anyway)" << std::endl;
+    return false;
+  }
+  }
+  return false;
+}
+
+Arguments ParseArguments(std::vector<std::string> const& args, Arguments arguments = {})
+{
+  arguments.Valid = true;
+
+  for (auto i = 0u; i < args.size(); ++i)
+  {
+    auto arg = args.at(i);
+    
+    if (ICompare("--monitor", arg) || ICompare("-m", arg))
+    {
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--monitor/-m requires a monitor index" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arg = args.at(i);
+      arguments.MonitorIndices.clear();
+      arguments.AllMonitors = ICompare("all", arg);
+      if (arguments.AllMonitors)
+      {
+        continue;
+      }
+      if (!GetMonitorIndices(arg, &arguments.MonitorIndices))
+      {
+        std::cerr << "Expected a monitor index, a comma separated list of indices or all, but got: " << arg << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arguments.MonitorIndex = arguments.MonitorIndices.front();
+      if (arguments.MonitorIndices.size() == 1)
+      {
+        arguments.MonitorIndices.clear();
+      }
+    }
+    else if (ICompare("--info", arg) || ICompare("-i", arg))
+    {
+      arguments.PrintInfo = true;
+    }
+    else if (ICompare("--capabilities", arg) || ICompare("-c", arg))
+    {
+      arguments.PrintCapabilities = true;
+    }
+    else if (ICompare("--get", arg) || ICompare("-g", arg))
+    {
+      arguments.GetVCPFeature = true;
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--get/-g requires an address" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arg = args.at(i);
+      if (!GetVCPCode(arg, &arguments.GetVCPFeatureAddress))
+      {
+        std::cerr << "Expected an address or a feature name, but got: " << arg << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arguments.GetVCPFeatureAddress &= 0xFF;
+    }
+    else if (ICompare("--set", arg) || ICompare("-s", arg))
+    {
+      arguments.SetVCPFeature = true;
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--set/-s requires an address and value" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arg = args.at(i);
+      if (!GetVCPCode(arg, &arguments.SetVCPFeatureAddress))
+      {
+        std::cerr << "Expected an address or a feature name, but got: " << arg << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arguments.SetVCPFeatureAddress &= 0xFF;
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--set/-s requires an address and value" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arg = args.at(i);
+      if (!GetVCPValue(arg, arguments.SetVCPFeatureAddress, &arguments.SetVCPFeatureValue))
+      {
+        std::cerr << "Expected a value or a value name, but got: " << arg << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+    }
+    else if (ICompare("--force", arg))
+    {
+      arguments.Force = true;
+    }
+    else if (ICompare("--verify", arg) || ICompare("-v", arg))
+    {
+      arguments.Verify = true;
+    }
+    else if (ICompare("--verify-timeout", arg))
+    {
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--verify-timeout requires a time in milliseconds" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arg = args.at(i);
+      uint32_t milliseconds = 0;
+      if (!Get(arg, &milliseconds))
+      {
+        std::cerr << "Expected a time in milliseconds, but got: " << arg << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arguments.VerifyTimeout = std::chrono::milliseconds{ milliseconds };
+    }
+    else if (ICompare("--max-age", arg))
+    {
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--max-age requires a time in milliseconds" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arg = args.at(i);
+      uint32_t milliseconds = 0;
+      if (!Get(arg, &milliseconds))
+      {
+        std::cerr << "Expected a time in milliseconds, but got: " << arg << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arguments.MaxAge = std::chrono::milliseconds{ milliseconds };
+    }
+    else if (ICompare("--toggle", arg))
+    {
+      arguments.Toggle = true;
+    }
+    else if (ICompare("--ramp", arg))
+    {
+      arguments.Ramp = true;
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--ramp requires an address and value" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arg = args.at(i);
+      if (!GetVCPCode(arg, &arguments.RampCode) || arguments.RampCode > 0xFF)
+      {
+        std::cerr << "Expected an address or a feature name, but got: " << arg << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--ramp requires an address and value" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arg = args.at(i);
+      arguments.RampPercent = !arg.empty() && arg.back() == '%';
+      if (arguments.RampPercent)
+      {
+        arg.pop_back();
+      }
+      if (!Get(arg, &arguments.RampValue) || arguments.RampValue > (arguments.RampPercent ? 100u : 0xFFFFu))
+      {
+        std::cerr << "Expected a value up to 0xffff or a percentage, but got: " << args.at(i) << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+    }
+    else if (ICompare("--ramp-time", arg))
+    {
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--ramp-time requires a time in milliseconds" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arg = args.at(i);
+      uint32_t milliseconds = 0;
+      if (!Get(arg, &milliseconds))
+      {
+        std::cerr << "Expected a time in milliseconds, but got: " << arg << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arguments.RampTime = std::chrono::milliseconds{ milliseconds };
+    }
+    else if (ICompare("--dump", arg))
+    {
+      arguments.Dump = true;
+    }
+    else if (ICompare("--snapshot", arg))
+    {
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--snapshot requires an output file" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arguments.SnapshotFile = args.at(i);
+    }
+    else if (ICompare("--save", arg) || ICompare("--restore", arg))
+    {
+      const auto save = ICompare("--save", arg);
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << (save ? "--save" : "--restore") << " requires a profile file" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      (save ? arguments.SaveFile : arguments.RestoreFile) = args.at(i);
+    }
+    else if (ICompare("--format", arg))
+    {
+      ++i;
+      if (i == args.size() || !ParseOutputFormat(args.at(i), &arguments.Format))
+      {
+        std::cerr << "--format requires json, ndjson or text" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+    }
+    else if (ICompare("--watch", arg))
+    {
+      ++i;
+      arguments.WatchCodes.clear();
+      if (i == args.size() || !GetVCPCodes(args.at(i), &arguments.WatchCodes))
+      {
+        std::cerr << "--watch requires a comma separated list of VCP codes or feature names" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+    }
+    else if (ICompare("--read-table", arg) || ICompare("--write-table", arg))
+    {
+      const auto read = ICompare("--read-table", arg);
+      i += 2;
+      if (i >= args.size())
+      {
+        std::cerr << (read ? "--read-table" : "--write-table") << " requires a VCP code and a table file" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      if (!GetVCPCode(args.at(i - 1), &arguments.TableCode) || arguments.TableCode > 0xFF)
+      {
+        std::cerr << "Expected an address or a feature name, but got: " << args.at(i - 1) << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      (read ? arguments.ReadTableFile : arguments.WriteTableFile) = args.at(i);
+    }
+    else if (ICompare("--barrier", arg))
+    {
+      arguments.Barrier = true;
+    }
+    else if (ICompare("--stats", arg))
+    {
+      arguments.Stats = true;
+    }
+    else if (ICompare("--plan", arg))
+    {
+      arguments.Plan = true;
+    }
+    else if (ICompare("--no-cache", arg))
+    {
+      arguments.UseCache = false;
+    }
+    else if (ICompare("--invalidate-cache", arg))
+    {
+      arguments.InvalidateCache = true;
+    }
+    else if (ICompare("--clear-cache", arg))
+    {
+      arguments.ClearCache = true;
+    }
+    else if (ICompare("--simulate", arg))
+    {
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--simulate requires a simulation file" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arguments.SimulationFile = args.at(i);
+    }
+    else if (ICompare("--state", arg))
+    {
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--state requires a state file" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arguments.StateFile = args.at(i);
+    }
+    else if (ICompare("--batch", arg) || ICompare("-b", arg))
+    {
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--batch/-b requires a file, or - for standard input" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arguments.BatchFile = args.at(i);
+    }
+    else if (ICompare("--serve", arg))
+    {
+      arguments.Serve = true;
+    }
+    else if (ICompare("--trace", arg))
+    {
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--trace requires an output file" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arguments.TraceFile = args.at(i);
+    }
+    else if (ICompare("--client", arg))
+    {
+      arguments.Client = true;
+    }
+    else if (ICompare("--endpoint", arg))
+    {
+      ++i;
+      if (i == args.size())
+      {
+        std::cerr << "--endpoint requires a socket path or pipe name" << std::endl;
+        arguments.Valid = false;
+        break;
+      }
+      arguments.Endpoint = args.at(i);
+    }
+    else
+    {
+      std::cerr << "Unsupported argument: " << arg << std::endl;
+      arguments.Valid = false;
+      break;
+    }
+  }
+
+  // Post validation
+  if (arguments.Serve && arguments.Client)
   {
-    LPSTR messageBuffer = nullptr;
-    size_t size = FormatMessage(
-      FORMAT_MESSAGE_ALLOCATE_BUFFER |
-      FORMAT_MESSAGE_FROM_SYSTEM |
-      FORMAT_MESSAGE_IGNORE_INSERTS,
-      NULL,
-      errorCode,
-      MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-      (LPSTR)&messageBuffer,
-      0,
-      NULL);
-
-    std::cout << "Error [" << errorCode << "] " << messageBuffer << std::endl;
+    std::cerr << "You cannot specify both --serve and --client" << std::endl;
+    arguments.Valid = false;
   }
-  else
+  if (arguments.GetVCPFeature && arguments.SetVCPFeature)
+  {
+    std::cerr << "You cannot specify both get and set operations in a single command" << std::endl;
+    arguments.Valid = false;
+  }
+  if ((arguments.Dump || !arguments.SnapshotFile.empty()) &&
+    (arguments.GetVCPFeature || arguments.SetVCPFeature || arguments.Toggle || arguments.Plan))
+  {
+    std::cerr << "--dump and --snapshot cannot be combined with --get, --set, --toggle or --plan" << std::endl;
+    arguments.Valid = false;
+  }
+  if ((!arguments.SaveFile.empty() || !arguments.RestoreFile.empty()) &&
+    (arguments.GetVCPFeature || arguments.SetVCPFeature || arguments.Toggle || arguments.Plan || arguments.Dump || !arguments.SnapshotFile.empty() ||
+      (!arguments.SaveFile.empty() && !arguments.RestoreFile.empty())))
+  {
+    std::cerr << "--save and --restore cannot be combined with each other or with --get, --set, --toggle, --dump, --snapshot or --plan" << std::endl;
+    arguments.Valid = false;
+  }
+  if (!arguments.WatchCodes.empty() &&
+    (arguments.GetVCPFeature || arguments.SetVCPFeature || arguments.Toggle || arguments.Plan || arguments.Dump || !arguments.SnapshotFile.empty() ||
+      !arguments.SaveFile.empty() || !arguments.RestoreFile.empty()))
+  {
+    std::cerr << "--watch cannot be combined with --get, --set, --toggle, --dump, --snapshot, --save, --restore or --plan" << std::endl;
+    arguments.Valid = false;
+  }
+  if ((!arguments.ReadTableFile.empty() || !arguments.WriteTableFile.empty()) &&
+    (arguments.GetVCPFeature || arguments.SetVCPFeature || arguments.Toggle || arguments.Plan || arguments.Dump || !arguments.SnapshotFile.empty() ||
+      !arguments.SaveFile.empty() || !arguments.RestoreFile.empty() || !arguments.WatchCodes.empty() ||
+      (!arguments.ReadTableFile.empty() && !arguments.WriteTableFile.empty())))
+  {
+    std::cerr << "--read-table and --write-table cannot be combined with each other or with --get, --set, --toggle, --dump, --snapshot, --save, --restore, --watch or --plan" << std::endl;
+    arguments.Valid = false;
+  }
+  if (arguments.Ramp &&
+    (arguments.GetVCPFeature || arguments.SetVCPFeature || arguments.Toggle || arguments.Dump || !arguments.SnapshotFile.empty() ||
+      !arguments.SaveFile.empty() || !arguments.RestoreFile.empty() || !arguments.WatchCodes.empty() ||
+      !arguments.ReadTableFile.empty() || !arguments.WriteTableFile.empty()))
+  {
+    std::cerr << "--ramp cannot be combined with --get, --set, --toggle, --dump, --snapshot, --save, --restore, --watch, --read-table or --write-table" << std::endl;
+    arguments.Valid = false;
+  }
+  if (arguments.Valid && arguments.Ramp && !arguments.Force)
+  {
+    const auto feature = FindVCPFeature(static_cast<uint8_t>(arguments.RampCode));
+    if (feature && !feature->Continuous)
+    {
+      std::cerr << "VCP feature " << DescribeVCPCode(arguments.RampCode) << " is not a continuous control (use --force to ramp it anyway)" << std::endl;
+      arguments.Valid = false;
+    }
+  }
+  if (!arguments.ReadTableFile.empty() && (arguments.AllMonitors || arguments.MonitorIndices.size() > 1))
+  {
+    std::cerr << "--read-table reads the table of a single monitor" << std::endl;
+    arguments.Valid = false;
+  }
+  if (arguments.Valid && arguments.SetVCPFeature && !arguments.Force &&
+    !CheckWrite(arguments.SetVCPFeatureAddress, arguments.SetVCPFeatureValue))
   {
-    std::cout << "No error" << std::endl;
+    arguments.Valid = false;
   }
+
+  return arguments;
 }
 
-class MonitorUtils
+void PrintUsage()
 {
-public:
+  std::cout << "monitor_util [--monitor/-m (INDEX[,INDEX...] | all)] [--info/-i] [--capabilities/-c] [(--get/-g ADDRESS) | (--set/-s ADDRESS VALUE ) | (--toggle) | (--ramp ADDRESS VALUE[%]) | (--dump) | (--snapshot FILE) | (--save FILE) | (--restore FILE) | (--watch CODE[,CODE...]) | (--read-table CODE FILE) | (--write-table CODE FILE)] [--force] [--ramp-time MS] [--max-age MS] [--verify/-v] [--verify-timeout MS] [--barrier] [--stats] [--plan] [--no-cache] [--invalidate-cache] [--clear-cache] [--simulate FILE] [--state FILE] [--batch/-b FILE] [--serve | --client] [--endpoint PATH] [--trace FILE] [--format json|ndjson|text]" << '\n';
+}
 
-  struct HighLevelCapabilities
-  {
-    HighLevelCapabilities() = default;
-    HighLevelCapabilities(DWORD cap)
-    {
-      Set(cap);
-    }
-
-    void Set(DWORD cap)
-    {
-      Valid = true;
-      None = cap & MC_CAPS_NONE;
-      Brightness = cap & MC_CAPS_BRIGHTNESS;
-      ColorTemperature = cap & MC_CAPS_COLOR_TEMPERATURE;
-      Contrast = cap & MC_CAPS_CONTRAST;
-      Degauss = cap & MC_CAPS_DEGAUSS;
-      DisplayAreaPosition = cap & MC_CAPS_DISPLAY_AREA_POSITION;
-      DisplayAreaSize = cap & MC_CAPS_DISPLAY_AREA_SIZE;
-      MonitorTechnologyType = cap & MC_CAPS_MONITOR_TECHNOLOGY_TYPE;
-      RedGreenBlueDrive = cap & MC_CAPS_RED_GREEN_BLUE_DRIVE;
-      RedGreenBlueGain = cap & MC_CAPS_RED_GREEN_BLUE_GAIN;
-      RestoreFactoryColorDefaults = cap & MC_CAPS_RESTORE_FACTORY_COLOR_DEFAULTS;
-      RestoreFactoryDefaults = cap & MC_CAPS_RESTORE_FACTORY_DEFAULTS;
-      RestoreFactoryDefaultsEnablesMonitorSettings = cap & MC_RESTORE_FACTORY_DEFAULTS_ENABLES_MONITOR_SETTINGS;
-    }
-
-    bool Valid{ false };
-    bool None{ false };
-    bool Brightness{ false };
-    bool ColorTemperature{ false };
-    bool Contrast{ false };
-    bool Degauss{ false };
-    bool DisplayAreaPosition{ false };
-    bool DisplayAreaSize{ false };
-    bool MonitorTechnologyType{ false };
-    bool RedGreenBlueDrive{ false };
-    bool RedGreenBlueGain{ false };
-    bool RestoreFactoryColorDefaults{ false };
-    bool RestoreFactoryDefaults{ false };
-    bool RestoreFactoryDefaultsEnablesMonitorSettings{ false };
-  };
+// Rough bus time of one DDC/CI transaction including the gap the monitor needs
+// after it. Only used to show what a plan is going to cost.
+constexpr std::chrono::milliseconds EstimatedReadCost{ 80 };
+constexpr std::chrono::milliseconds EstimatedWriteCost{ 50 };
+// The capabilities string comes in 32 byte fragments, typically about 16.
+constexpr std::chrono::milliseconds EstimatedCapabilitiesCost{ 16 * 100 };
 
-  enum class VCPCapabilityElementType
-  {
-    Tree,
-    Leaf
-  };
+enum class PlanStepType
+{
+  PrintInfo,
+  ClearCache,
+  InvalidateCache,
+  PrintHighLevelCapabilities,
+  PrintLowLevelCapabilities,
+  GetVCPFeature,
+  SetVCPFeature,
+  Toggle,
+  Ramp,
+  PrintStats,
+};
 
-  enum class VCPCapabilityValueType
-  {
-    Text,
-    VCPCode
-  };
+// One step of an operation together with the bus transactions it is expected
+// to take.
+struct PlanStep
+{
+  PlanStepType Type;
+  uint32_t Code{ 0 };
+  uint32_t Value{ 0 };
+  std::optional<MonitorUtils::VCPFeatureResult> Known{};  // Get, toggle and ramp: the current value, which is then not read
+  bool Percent{ false };                 // Ramp: Value is a percentage of the maximum
+  std::chrono::milliseconds Duration{};  // Ramp
+  bool Verify{ false };                  // Takes at least one more read
+  std::string Rejected{};                // Why the step fails without being sent
+  int Reads{ 0 };
+  int Writes{ 0 };
+  int CapabilitiesRequests{ 0 };
+};
 
-  struct VCPCapabilityElement
+std::chrono::milliseconds EstimatedCost(PlanStep const& step)
+{
+  return step.Reads * EstimatedReadCost + step.Writes * EstimatedWriteCost +
+    step.CapabilitiesRequests * EstimatedCapabilitiesCost + (step.Verify ? EstimatedReadCost : std::chrono::milliseconds{ 0 });
+}
+
+// Turns the arguments into the steps to run against one monitor, leaving out
+// transactions whose answer is already known. Nothing is sent to the monitor.
+std::vector<PlanStep> PlanOperation(Arguments const& args, MonitorUtils::Monitor const& monitor, CapabilitiesCache const& cache)
+{
+  std::vector<PlanStep> plan;
+  if (args.PrintInfo)
   {
-    std::variant<std::string, int> Value;
-    std::vector<VCPCapabilityElement> Children;
-    VCPCapabilityElementType ElementType;
-    VCPCapabilityValueType ValueType;
-  };
+    plan.push_back({ PlanStepType::PrintInfo });
+  }
+  if (args.ClearCache)
+  {
+    plan.push_back({ PlanStepType::ClearCache });
+  }
+  if (args.InvalidateCache)
+  {
+    plan.push_back({ PlanStepType::InvalidateCache });
+  }
+  if (args.PrintCapabilities)
+  {
+    PlanStep highLevel{ PlanStepType::PrintHighLevelCapabilities };
+#ifdef _WIN32
+    // Only the Windows API has high-level capabilities, and it reads the
+    // capabilities string again every time.
+    highLevel.CapabilitiesRequests = 1;
+#endif
+    plan.push_back(highLevel);
+
+    PlanStep lowLevel{ PlanStepType::PrintLowLevelCapabilities };
+    const auto cached = args.UseCache && !args.ClearCache && !args.InvalidateCache &&
+      cache.Contains(MonitorUtils::GetMonitorIdentity(monitor));
+    lowLevel.CapabilitiesRequests = cached ? 0 : 1;
+    plan.push_back(lowLevel);
+  }
 
-  struct Token
+  // A monitor that does not implement a code takes hundreds of milliseconds to
+  // fail a request for it, so codes and values that its cached capabilities
+  // do not list are refused up front.
+  CapabilityIndex capabilities{};
+  if ((args.GetVCPFeature || args.SetVCPFeature || args.Toggle || args.Ramp) &&
+    args.UseCache && !args.Force && !args.ClearCache && !args.InvalidateCache)
   {
-    std::string Value;
-    std::vector<Token> Children;
-  };
+    (void)MonitorUtils::GetCachedCapabilityIndex(monitor, cache, &capabilities);
+  }
 
-  class Monitor
+  if (args.GetVCPFeature)
   {
-  public:
-    ~Monitor()
+    PlanStep get{ PlanStepType::GetVCPFeature, args.GetVCPFeatureAddress };
+    MonitorUtils::VCPFeatureResult known{};
+    if (capabilities.Valid() && !capabilities.Supports(static_cast<uint8_t>(get.Code)))
     {
-      FreePhysicalHandle();
+      get.Rejected = "the monitor does not advertise VCP feature " + DescribeVCPCode(get.Code);
     }
-
-    void SetHandle(HMONITOR handle)
+    else if (MonitorUtils::GetKnownVCPFeature(monitor, static_cast<uint8_t>(get.Code), args.MaxAge, &known))
     {
-      FreePhysicalHandle();
-      m_handle = handle;
-      if (m_handle)
-      {
-        DWORD numPhysicalMonitors = 0;
-        if (GetNumberOfPhysicalMonitorsFromHMONITOR(m_handle, &numPhysicalMonitors) && numPhysicalMonitors == 1)
-        {
-          PHYSICAL_MONITOR physicalMonitor;
-          if (GetPhysicalMonitorsFromHMONITOR(m_handle, 1, &physicalMonitor))
-          {
-            m_physicalHandle = physicalMonitor;
-          }
-        }
-      }
+      get.Known = known;
     }
-
-    HMONITOR GetHandle() const
+    else
     {
-      return m_handle;
+      get.Reads = 1;
     }
-
-    PHYSICAL_MONITOR GetPhysicalHandle() const
+    plan.push_back(get);
+  }
+  else if (args.SetVCPFeature)
+  {
+    PlanStep set{ PlanStepType::SetVCPFeature, args.SetVCPFeatureAddress, args.SetVCPFeatureValue };
+    const auto code = static_cast<uint8_t>(set.Code);
+    if (capabilities.Valid() && !capabilities.Supports(code))
     {
-      return m_physicalHandle;
+      set.Rejected = "the monitor does not advertise VCP feature " + DescribeVCPCode(set.Code);
     }
-
-  private:
-
-    void FreePhysicalHandle()
+    else if (capabilities.Valid() && !capabilities.Allows(code, set.Value))
+    {
+      set.Rejected = "the monitor does not advertise value " + DescribeVCPValue(set.Code, set.Value) +
+        " for VCP feature " + DescribeVCPCode(set.Code) + ", it takes " + DescribeVCPValues(set.Code, capabilities.AllowedValues(code));
+    }
+    else
+    {
+      set.Verify = args.Verify;
+      set.Writes = 1;
+    }
+    plan.push_back(set);
+  }
+  else if (args.Toggle)
+  {
+    PlanStep toggle{ PlanStepType::Toggle, InputSourceCode };
+    if (capabilities.Valid() && (!capabilities.Allows(InputSourceCode, InputSourceHdmi) || !capabilities.Allows(InputSourceCode, InputSourceDisplayPort)))
+    {
+      toggle.Rejected = "the monitor does not advertise both inputs to toggle between, " +
+        DescribeVCPValue(InputSourceCode, InputSourceHdmi) + " and " + DescribeVCPValue(InputSourceCode, InputSourceDisplayPort);
+    }
+    else
+    {
+      MonitorUtils::VCPFeatureResult known{};
+      if (MonitorUtils::GetKnownVCPFeature(monitor, InputSourceCode, args.MaxAge, &known))
+      {
+        toggle.Known = known;
+      }
+      else
+      {
+        toggle.Reads = 1;
+      }
+      toggle.Verify = args.Verify;
+      toggle.Writes = 1;
+    }
+    plan.push_back(toggle);
+  }
+  else if (args.Ramp)
+  {
+    PlanStep ramp{ PlanStepType::Ramp, args.RampCode, args.RampValue };
+    ramp.Percent = args.RampPercent;
+    ramp.Duration = args.RampTime;
+    MonitorUtils::VCPFeatureResult known{};
+    if (capabilities.Valid() && !capabilities.Supports(static_cast<uint8_t>(ramp.Code)))
+    {
+      ramp.Rejected = "the monitor does not advertise VCP feature " + DescribeVCPCode(ramp.Code);
+    }
+    else
     {
-      if (m_physicalHandle.hPhysicalMonitor)
+      if (MonitorUtils::GetKnownVCPFeature(monitor, static_cast<uint8_t>(ramp.Code), args.MaxAge, &known))
+      {
+        ramp.Known = known;
+      }
+      else
       {
-        DestroyPhysicalMonitors(1, &m_physicalHandle);
-        m_physicalHandle.hPhysicalMonitor = {};
+        ramp.Reads = 1;
       }
+      ramp.Verify = args.Verify;
+      // At most one write per write gap, for as long as the ramp takes.
+      ramp.Writes = (std::max)(1, static_cast<int>(args.RampTime / EstimatedWriteCost));
     }
+    plan.push_back(ramp);
+  }
 
-    HMONITOR m_handle{ nullptr };
-    PHYSICAL_MONITOR m_physicalHandle{ nullptr };
-  };
-
-  union MonitorParam
+  if (args.Stats)
   {
-    HMONITOR Monitor;
-    int Index;
-  };
-  static_assert(sizeof MonitorParam == sizeof DWORD, "Invalid size");
-
+    plan.push_back({ PlanStepType::PrintStats });
+  }
+  return plan;
+}
 
-  static BOOL CALLBACK GetMonitorByIndex(
-    HMONITOR monitor,
-    HDC deviceContext,
-    LPRECT rect,
-    LPARAM applicationDefinedData
-  )
+void PrintPlan(std::vector<PlanStep> const& plan, ResultWriter& results)
+{
+  results.BeginPlan();
+  std::chrono::milliseconds total{ 0 };
+  auto open = false;
+  for (const auto& step : plan)
   {
-    auto monitorParam = reinterpret_cast<MonitorParam*>(applicationDefinedData);
-    if (--monitorParam->Index < 0)
+    std::ostringstream description;
+    description << std::hex;
+    switch (step.Type)
+    {
+    case PlanStepType::PrintInfo:
+      description << "Print monitor info";
+      break;
+    case PlanStepType::ClearCache:
+      description << "Clear capabilities cache";
+      break;
+    case PlanStepType::InvalidateCache:
+      description << "Invalidate cached capabilities";
+      break;
+    case PlanStepType::PrintHighLevelCapabilities:
+      description << "Print high-level capabilities";
+      break;
+    case PlanStepType::PrintLowLevelCapabilities:
+      description << "Print low-level capabilities" << (step.CapabilitiesRequests == 0 ? " (cached)" : "");
+      break;
+    case PlanStepType::GetVCPFeature:
+      description << "Read VCP feature " << DescribeVCPCode(step.Code);
+      if (step.Known)
+      {
+        description << ", known to be " << DescribeVCPValue(step.Code, step.Known->CurrentValue);
+      }
+      break;
+    case PlanStepType::SetVCPFeature:
+      description << "Write VCP feature " << DescribeVCPCode(step.Code) << " = " << DescribeVCPValue(step.Code, step.Value);
+      break;
+    case PlanStepType::Toggle:
+      description << "Toggle input source";
+      if (step.Known)
+      {
+        description << ", currently " << DescribeVCPValue(step.Code, step.Known->CurrentValue);
+      }
+      break;
+    case PlanStepType::Ramp:
+      description << "Ramp VCP feature " << DescribeVCPCode(step.Code) << " to ";
+      if (step.Percent)
+      {
+        description << std::dec << step.Value << "%" << std::hex;
+      }
+      else
+      {
+        description << DescribeVCPValue(step.Code, step.Value);
+      }
+      description << std::dec << " over " << step.Duration.count() << " ms" << std::hex;
+      if (step.Known)
+      {
+        description << ", currently " << DescribeVCPValue(step.Code, step.Known->CurrentValue);
+      }
+      break;
+    case PlanStepType::PrintStats:
+      description << "Print bus statistics";
+      break;
+    }
+    if (step.Verify)
     {
-      monitorParam->Monitor = monitor;
-      return FALSE; // Stop enumeration
+      description << ", verify";
     }
-    return TRUE; // Continue enumeration
+    if (!step.Rejected.empty())
+    {
+      description << ": refused, " << step.Rejected;
+    }
+
+    // Verification keeps reading until the value shows up.
+    std::ostringstream transactions;
+    const auto count = [&](int number, bool more, char const* singular, char const* plural)
+    {
+      if (number > 0)
+      {
+        transactions << (transactions.tellp() > 0 ? ", " : "") << number << (more ? "+ " : " ") << (number == 1 && !more ? singular : plural);
+      }
+    };
+    count(step.Reads + (step.Verify ? 1 : 0), step.Verify, "read", "reads");
+    count(step.Writes, false, "write", "writes");
+    count(step.CapabilitiesRequests, false, "capabilities request", "capabilities requests");
+    open = open || step.Verify;
+
+    const auto cost = EstimatedCost(step);
+    total += cost;
+    results.PlanStep(description.str(), transactions.str(), step.Reads + (step.Verify ? 1 : 0), step.Verify, step.Writes, step.CapabilitiesRequests, cost);
   }
+  results.EndPlan(total, open);
+}
 
-  static Monitor GetMonitor(int index)
+bool ExecuteStep(
+  PlanStep const& step,
+  Arguments const& args,
+  MonitorUtils::Monitor const& monitor,
+  CapabilitiesCache& cache,
+  ResultWriter& results,
+  CommitPoint* commit)
+{
+  if (!step.Rejected.empty())
   {
-    Monitor monitor{};
+    results.Error("Refused: " + step.Rejected + " (use --force to send it anyway)");
+    return false;
+  }
+  VerifyPolicy verifyPolicy{};
+  verifyPolicy.Timeout = args.VerifyTimeout;
+  switch (step.Type)
+  {
+  case PlanStepType::PrintInfo:
+    results.Info(MonitorUtils::GetMonitorInfo(monitor), MonitorUtils::GetMonitorIdentity(monitor));
+    return true;
 
-    auto hdc = GetDC(NULL);
-    MonitorParam monitorParam{};
-    monitorParam.Index = index;
-    (void)EnumDisplayMonitors(hdc, NULL, MonitorUtils::GetMonitorByIndex, reinterpret_cast<LPARAM>(&monitorParam));
-    if (monitorParam.Index != -1)
+  case PlanStepType::ClearCache:
+    if (!cache.Clear())
     {
-      monitor.SetHandle(monitorParam.Monitor);
+      results.Error("Failed to clear capabilities cache " + cache.Path());
+      return false;
     }
-    return monitor;
-  }
+    return true;
 
-  static bool SetVCPFeature(Monitor monitor, uint8_t code, uint32_t value)
+  case PlanStepType::InvalidateCache:
   {
-    return ::SetVCPFeature(
-      monitor.GetPhysicalHandle().hPhysicalMonitor,
-      code,
-      value);
+    const auto identity = MonitorUtils::GetMonitorIdentity(monitor);
+    if (!identity.Valid() || !cache.Invalidate(identity))
+    {
+      results.Error("Failed to invalidate cached capabilities");
+      return false;
+    }
+    return true;
   }
 
-  struct VCPFeatureResult
-  {
-    bool Success;
-    MC_VCP_CODE_TYPE CodeType;
-    DWORD CurrentValue;
-    DWORD MaxValue;
-  };
+  case PlanStepType::PrintHighLevelCapabilities:
+    results.Capabilities(MonitorUtils::GetHighLevelCapabilities(monitor));
+    return true;
 
-  static VCPFeatureResult GetVCPFeature(Monitor monitor, uint8_t code)
+  case PlanStepType::PrintLowLevelCapabilities:
   {
-    VCPFeatureResult value{};
-    value.Success = false;
-    value.Success = ::GetVCPFeatureAndVCPFeatureReply(
-      monitor.GetPhysicalHandle().hPhysicalMonitor,
-      code,
-      &value.CodeType,
-      &value.CurrentValue,
-      &value.MaxValue);
-    return value;
+    const auto capabilities = MonitorUtils::GetLowLevelCapabilities(monitor, args.UseCache ? &cache : nullptr);
+    results.Capabilities(capabilities, capabilities.Valid ? 0 : GetLastErrorCode());
+    return true;
   }
 
-  struct MonitorInfo
+  case PlanStepType::GetVCPFeature:
   {
-    std::string Name{ "Invalid" };
-    bool Primary{ false };
-  };
+    if (step.Known)
+    {
+      results.VCPFeature(static_cast<uint8_t>(step.Code), *step.Known, 0);
+      return true;
+    }
+    const auto result = MonitorUtils::GetVCPFeature(monitor, static_cast<uint8_t>(step.Code));
+    results.VCPFeature(static_cast<uint8_t>(step.Code), result, result.Success ? 0 : GetLastErrorCode());
+    return result.Success;
+  }
 
-  static MonitorInfo GetMonitorInfo(Monitor monitor)
+  case PlanStepType::SetVCPFeature:
   {
-    MonitorInfo monitorInfo{};
-    MONITORINFOEX winMonitorInfo{};
-    winMonitorInfo.cbSize = sizeof winMonitorInfo;
-    if (::GetMonitorInfo(monitor.GetHandle(), &winMonitorInfo) != 0)
+    if (!WriteVCPFeature(monitor, static_cast<uint8_t>(step.Code), step.Value, commit))
+    {
+      results.SetVCPFeature(static_cast<uint8_t>(step.Code), step.Value, false, nullptr);
+      return false;
+    }
+    if (!step.Verify)
     {
-      monitorInfo.Primary = winMonitorInfo.dwFlags & MONITORINFOF_PRIMARY;
-      monitorInfo.Name = winMonitorInfo.szDevice;
+      results.SetVCPFeature(static_cast<uint8_t>(step.Code), step.Value, true, nullptr);
+      return true;
     }
-    return monitorInfo;
+    const auto verification = Verify(monitor, static_cast<uint8_t>(step.Code), step.Value, verifyPolicy);
+    results.SetVCPFeature(static_cast<uint8_t>(step.Code), step.Value, true, &verification);
+    return verification.Result.Success && verification.Result.CurrentValue == step.Value;
   }
 
-  struct LowLevelCapabilities
+  case PlanStepType::Toggle:
   {
-    bool Valid{ false };
-    VCPCapabilityElement Capabilities; // Root capabilities element
-  };
+    Verification verification{};
+    const auto known = step.Known ? std::optional<uint32_t>{ step.Known->CurrentValue } : std::nullopt;
+    const auto success = Toggle(monitor, step.Verify ? &verifyPolicy : nullptr, commit, &verification, known);
+    results.Toggle(success, step.Verify ? &verification : nullptr);
+    return success;
+  }
 
-  static HighLevelCapabilities GetHighLevelCapabilities(Monitor monitor)
+  case PlanStepType::Ramp:
   {
-    DWORD highLevelCapabilitiesRaw = 0;
-    DWORD supportedColorTemperatures = 0;
-    HighLevelCapabilities highLevelCapabilities{};
-    if (GetMonitorCapabilities(monitor.GetPhysicalHandle().hPhysicalMonitor, &highLevelCapabilitiesRaw, &supportedColorTemperatures))
+    const auto code = static_cast<uint8_t>(step.Code);
+    const auto ramp = Ramp(monitor, code, step.Value, step.Percent, step.Duration, step.Known);
+    if (!ramp.Success || ramp.Superseded || !step.Verify)
     {
-      highLevelCapabilities.Set(highLevelCapabilitiesRaw);
+      results.Ramp(code, ramp, nullptr, ramp.Success ? 0 : GetLastErrorCode());
+      return ramp.Success;
     }
+    const auto verification = Verify(monitor, code, ramp.To, verifyPolicy);
+    results.Ramp(code, ramp, &verification, 0);
+    return verification.Converged;
+  }
+
+  case PlanStepType::PrintStats:
+    results.Stats(MonitorUtils::GetSchedulerStats(monitor));
+    return true;
+  }
+  return false;
+}
 
-    return highLevelCapabilities;
+// Runs every operation requested by the arguments against one monitor, or with
+// --plan only shows what that would take.
+bool ExecuteOperation(
+  Arguments const& args,
+  MonitorUtils::Monitor const& monitor,
+  CapabilitiesCache& cache,
+  ResultWriter& results,
+  CommitPoint* commit = nullptr)
+{
+  TraceSpan span{ "operation", "Operation" };
+  const auto plan = PlanOperation(args, monitor, cache);
+  if (args.Plan)
+  {
+    PrintPlan(plan, results);
+    return true;
+  }
+  auto success = true;
+  for (const auto& step : plan)
+  {
+    success = ExecuteStep(step, args, monitor, cache, results, commit) && success;
   }
+  return success;
+}
 
-  static LowLevelCapabilities GetLowLevelCapabilities(Monitor monitor)
+// Opens each monitor once and hands out the same handle to later operations.
+class MonitorSession
+{
+public:
+  // Monitors that fail to open are not kept, so a later request retries them.
+  MonitorUtils::Monitor GetMonitor(int index)
   {
-    LowLevelCapabilities capabilities{};
-    if (true/*(monitor.GetPhysicalHandle().hPhysicalMonitor*/)
+    auto monitor = m_monitors.find(index);
+    if (monitor == m_monitors.end())
     {
-      DWORD lowLevelCapabilitiesStringLength = 0;
-      if (GetCapabilitiesStringLength(
-        monitor.GetPhysicalHandle().hPhysicalMonitor,
-        &lowLevelCapabilitiesStringLength))
+      const auto opened = MonitorUtils::GetMonitor(index);
+      if (!opened.IsValid())
       {
-        std::vector<char> buffer;
-        buffer.resize(lowLevelCapabilitiesStringLength);
-        if (CapabilitiesRequestAndCapabilitiesReply(
-          monitor.GetPhysicalHandle().hPhysicalMonitor,
-          buffer.data(),
-          lowLevelCapabilitiesStringLength))
-        {
-          std::string lowLevelCapabilitiesString{ buffer.data() };
-
-          std::string indent = "";
-          const auto tokens = TokenizeLowLevelCapabilitiesString(lowLevelCapabilitiesString);
-          const auto elements = ParseLowLevelCapabilitiesString(lowLevelCapabilitiesString);
-          if (!elements.empty())
-          {
-            capabilities.Capabilities = elements.at(0);
-            capabilities.Valid = true;
-          }
-        }
+        return opened;
       }
+      monitor = m_monitors.emplace(index, opened).first;
     }
-
-    return capabilities;
+    return monitor->second;
   }
 
+private:
+  std::map<int, MonitorUtils::Monitor> m_monitors;
+};
 
+using MonitorList = std::vector<std::pair<int, MonitorUtils::Monitor>>;
 
-
-
-
-
-
-
-
-
-  static int TokenizeLowLevelCapabilitiesString(const std::string& capabilities, std::vector<Token>* tokens)
+// Opens the monitors selected by --monitor: one index, a list of indices, or
+// every monitor the backend can open.
+bool GetMonitors(Arguments const& args, MonitorSession& session, MonitorList* monitors)
+{
+  if (args.AllMonitors)
   {
-    Token token;
-    int index = 0;
-    std::vector<char> characters{ capabilities.begin(), capabilities.end() };
-    for (index = 0; index < static_cast<int>(characters.size()); ++index)
+    for (auto index = 0;; ++index)
     {
-      const auto c = characters.at(index);
-      if (c == '(')
+      const auto monitor = session.GetMonitor(index);
+      if (!monitor.IsValid())
       {
-        const auto substring = capabilities.substr(index + 1);
-        index += TokenizeLowLevelCapabilitiesString(substring, &token.Children) + 1;
-        tokens->push_back(token);
-        token.Value.clear();
-        token.Children.clear();
-      }
-      else if (c == ')')
-      {
-        tokens->push_back(token);
         break;
       }
-      else if (c == ' ')
-      {
-        tokens->push_back(token);
-        token.Value.clear();
-        token.Children.clear();
-      }
-      else
-      {
-        token.Value += c;
-      }
+      monitors->emplace_back(index, monitor);
+    }
+    if (monitors->empty())
+    {
+      std::cerr << "Failed to find any monitors" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  const auto indices = args.MonitorIndices.empty() ? std::vector<int>{ args.MonitorIndex } : args.MonitorIndices;
+  for (const auto index : indices)
+  {
+    const auto monitor = session.GetMonitor(index);
+    if (!monitor.IsValid())
+    {
+      std::cerr << "Failed to get monitor handle for monitor " << std::dec << index << std::endl;
+      return false;
     }
-    return index;
+    monitors->emplace_back(index, monitor);
   }
+  return true;
+}
 
-  static std::vector<Token> TokenizeLowLevelCapabilitiesString(const std::string& capabilities)
+// Prints how far apart the monitors' writes were sent and acknowledged.
+void PrintWriteSkew(std::vector<CommitPoint const*> const& commits)
+{
+  if (commits.size() < 2)
   {
-    std::vector<Token> tokens;
-    TokenizeLowLevelCapabilitiesString(capabilities, &tokens);
-    return tokens;
+    return;
   }
+  const auto bySent = [](CommitPoint const* a, CommitPoint const* b) { return a->Sent() < b->Sent(); };
+  const auto byAcknowledged = [](CommitPoint const* a, CommitPoint const* b) { return a->Acknowledged() < b->Acknowledged(); };
+  const auto sent = std::minmax_element(commits.begin(), commits.end(), bySent);
+  const auto acknowledged = std::minmax_element(commits.begin(), commits.end(), byAcknowledged);
+  const std::chrono::duration<double, std::milli> sentSkew{ (*sent.second)->Sent() - (*sent.first)->Sent() };
+  const std::chrono::duration<double, std::milli> acknowledgedSkew{
+    (*acknowledged.second)->Acknowledged() - (*acknowledged.first)->Acknowledged() };
+  std::cout << std::dec << "Write skew across " << commits.size() << " monitors: " <<
+    sentSkew.count() << " ms sent, " << acknowledgedSkew.count() << " ms acknowledged" << '\n';
+}
 
-  static void Print(Token const& token, std::string const& indent = "")
+// Calls work(i) for every monitor, each on a thread of its own, and waits for
+// all of them. A single monitor is handled on the calling thread.
+template<typename Work>
+void RunOnEachMonitor(MonitorList const& monitors, Work work)
+{
+  if (monitors.size() == 1)
+  {
+    work(size_t{ 0 });
+    return;
+  }
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < monitors.size(); ++i)
   {
-    std::cout << indent << token.Value;
-    if (!token.Children.empty())
+    threads.emplace_back([&, i]
     {
-      std::cout << "(" << std::endl;
-      for (const auto& child : token.Children)
+      if (const auto tracer = Tracer::Active())
       {
-        Print(child, indent + "  ");
+        tracer->NameThread("Monitor " + std::to_string(monitors[i].first));
       }
-      std::cout << indent << ")" << std::endl;
-    }
-    std::cout << std::endl;
+      work(i);
+    });
+  }
+  for (auto& thread : threads)
+  {
+    thread.join();
   }
+}
 
-  static void Print(HighLevelCapabilities const& capabilities, std::string const& indent = "")
+// Reads every advertised code of every monitor, all monitors at once, and
+// prints the result as JSON and/or writes it to a binary snapshot file.
+bool DumpMonitors(Arguments const& args, MonitorList const& monitors, CapabilitiesCache& cache)
+{
+  std::vector<MonitorSnapshot> snapshots(monitors.size());
+  RunOnEachMonitor(monitors, [&](size_t i)
   {
-    if (capabilities.None)
-    {
-      std::cout << indent << "None" << std::endl;
-    }
-    else
+    snapshots[i] = TakeSnapshot(monitors[i].first, monitors[i].second, args.UseCache ? &cache : nullptr);
+  });
+
+  auto success = true;
+  for (const auto& snapshot : snapshots)
+  {
+    if (!snapshot.CapabilitiesValid)
     {
-      std::cout << indent << "Brightness: " << capabilities.Brightness << std::endl;
-      std::cout << indent << "Color temperature: " << capabilities.ColorTemperature << std::endl;
-      std::cout << indent << "Contrast: " << capabilities.Contrast << std::endl;
-      std::cout << indent << "Degauss: " << capabilities.Degauss << std::endl;
-      std::cout << indent << "Display area position: " << capabilities.DisplayAreaPosition << std::endl;
-      std::cout << indent << "Display area size: " << capabilities.DisplayAreaSize << std::endl;
-      std::cout << indent << "Monitor technology type: " << capabilities.MonitorTechnologyType << std::endl;
-      std::cout << indent << "RGB drive: " << capabilities.RedGreenBlueDrive << std::endl;
-      std::cout << indent << "RGB gain: " << capabilities.RedGreenBlueGain << std::endl;
-      std::cout << indent << "Restore factory color defaults: " << capabilities.RestoreFactoryColorDefaults << std::endl;
-      std::cout << indent << "Restore factory defaults: " << capabilities.RestoreFactoryDefaults << std::endl;
-      std::cout << indent << "Restore factory defaults enables monitor settings: " << capabilities.RestoreFactoryDefaultsEnablesMonitorSettings << std::endl;
+      std::cerr << "Could not obtain the capabilities of monitor " << std::dec << snapshot.Index << ", so there is nothing to read" << std::endl;
+      success = false;
     }
   }
+  if (args.Dump)
+  {
+    WriteSnapshotJson(std::cout, snapshots);
+  }
+  if (!args.SnapshotFile.empty() && !SnapshotFile::Write(args.SnapshotFile, snapshots))
+  {
+    std::cerr << "Failed to write snapshot " << args.SnapshotFile << std::endl;
+    success = false;
+  }
+  return success;
+}
+
+// Saves the settings of every selected monitor to one profile file.
+bool SaveProfiles(Arguments const& args, MonitorList const& monitors, CapabilitiesCache& cache)
+{
+  std::vector<MonitorProfile> profiles(monitors.size());
+  RunOnEachMonitor(monitors, [&](size_t i)
+  {
+    profiles[i] = CaptureProfile(monitors[i].first, monitors[i].second, args.UseCache ? &cache : nullptr);
+  });
+  if (!ProfileFile::Write(args.SaveFile, profiles))
+  {
+    std::cerr << "Failed to write profile " << args.SaveFile << std::endl;
+    return false;
+  }
+  for (const auto& profile : profiles)
+  {
+    std::cout << std::dec << "Saved " << profile.Settings.size() << " settings of monitor " << profile.Index << '\n';
+  }
+  return true;
+}
 
-  static void Print(VCPCapabilityElement const& element, std::string const& indent = "")
+// Restores every monitor in the profile file, all at once. A monitor whose
+// identity does not match the one the profile was saved from is left alone
+// unless --force is given.
+bool RestoreProfiles(Arguments const& args, MonitorSession& session)
+{
+  std::vector<MonitorProfile> profiles;
+  std::string error;
+  if (!ProfileFile::Read(args.RestoreFile, &profiles, &error))
   {
-    if (element.ValueType == VCPCapabilityValueType::VCPCode)
-    {
-      std::cout << indent << std::hex << "0x" << std::get<int>(element.Value);
-    }
-    else
-    {
-      std::cout << indent << std::get<std::string>(element.Value);
-    }
-    if (!element.Children.empty())
+    std::cerr << error << std::endl;
+    return false;
+  }
+  // Same checks as --set, before anything is written.
+  for (const auto& profile : profiles)
+  {
+    for (const auto& setting : profile.Settings)
     {
-      std::cout << "(" << std::endl;
-      for (const auto& child : element.Children)
+      if (!args.Force && !CheckWrite(setting.Code, setting.Value))
       {
-        Print(child, indent + "  ");
+        std::cerr << "Not restoring " << args.RestoreFile << std::endl;
+        return false;
       }
-      std::cout << indent << ")";
     }
-    std::cout << std::endl;
   }
 
-  static VCPCapabilityElement ParseToken(Token const& token)
+  MonitorList monitors;
+  for (const auto& profile : profiles)
   {
-    VCPCapabilityElement element{};
-    element.Value = token.Value;
-    if (token.Value.size() == 2 && std::isxdigit(token.Value.at(0)) && std::isxdigit(token.Value.at(1)))
-    {
-      std::stringstream ss;
-      int byte;
-      ss << std::hex << token.Value;
-      ss >> byte;
-      element.Value = byte;
-      element.ValueType = VCPCapabilityValueType::VCPCode;
-    }
-    else
+    const auto monitor = session.GetMonitor(profile.Index);
+    if (!monitor.IsValid())
     {
-      element.Value = token.Value;
-      element.ValueType = VCPCapabilityValueType::Text;
+      std::cerr << "Failed to get monitor handle for monitor " << std::dec << profile.Index << std::endl;
+      return false;
     }
-    if (token.Children.empty())
+    const auto identity = MonitorUtils::GetMonitorIdentity(monitor);
+    if (!args.Force && profile.Identity.Valid() && identity.Valid() && identity != profile.Identity)
     {
-      element.ElementType = VCPCapabilityElementType::Leaf;
+      std::cerr << "Monitor " << std::dec << profile.Index << " is " << identity.ToString() << ", but the profile is for " <<
+        profile.Identity.ToString() << " (use --force to restore it anyway)" << std::endl;
+      return false;
     }
-    else
+    monitors.emplace_back(profile.Index, monitor);
+  }
+  if (monitors.empty())
+  {
+    std::cerr << "No monitors in profile " << args.RestoreFile << std::endl;
+    return false;
+  }
+
+  struct Worker
+  {
+    std::ostringstream Out;
+    std::ostringstream Err;
+    bool Success{ false };
+  };
+  VerifyPolicy verifyPolicy{};
+  verifyPolicy.Timeout = args.VerifyTimeout;
+  std::vector<Worker> workers(monitors.size());
+  RunOnEachMonitor(monitors, [&](size_t i)
+  {
+    auto& worker = workers[i];
+    worker.Success = RestoreProfile(monitors[i].second, profiles[i], args.Verify ? &verifyPolicy : nullptr, worker.Out, worker.Err);
+  });
+
+  auto success = true;
+  for (size_t i = 0; i < monitors.size(); ++i)
+  {
+    std::cout << std::dec << "Monitor " << monitors[i].first << ":\n" << workers[i].Out.str();
+    std::cerr << workers[i].Err.str();
+    success = success && workers[i].Success;
+  }
+  return success;
+}
+
+// Refuses a code that a monitor's cached capabilities leave out, like writes,
+// unless --force is given. Nothing is checked without cached capabilities.
+bool CheckAdvertised(Arguments const& args, MonitorList const& monitors, CapabilitiesCache& cache, uint8_t code, char const* what)
+{
+  for (const auto& monitor : monitors)
+  {
+    CapabilityIndex advertised{};
+    if (!args.Force && args.UseCache && MonitorUtils::GetCachedCapabilityIndex(monitor.second, cache, &advertised) && !advertised.Supports(code))
     {
-      element.ElementType = VCPCapabilityElementType::Tree;
-      for (const auto& child : token.Children)
-      {
-        element.Children.push_back(ParseToken(child));
-      }
+      std::cerr << "Monitor " << std::dec << monitor.first << " does not advertise VCP feature " << DescribeVCPCode(code) <<
+        " (use --force to " << what << " it anyway)" << std::endl;
+      return false;
     }
-    return element;
   }
+  return true;
+}
 
-  static std::vector<VCPCapabilityElement> ParseLowLevelCapabilitiesString(const std::string& capabilities)
+// Streams changes to the watched codes of every monitor as NDJSON until the
+// process is stopped. Codes a monitor's cached capabilities leave out are
+// refused unless --force is given, like writes.
+bool WatchMonitors(Arguments const& args, MonitorList const& monitors, CapabilitiesCache& cache)
+{
+  for (const auto code : args.WatchCodes)
   {
-    std::vector<VCPCapabilityElement> elements;
-    const auto tokens = TokenizeLowLevelCapabilitiesString(capabilities);
-    for (const auto& token : tokens)
+    if (!CheckAdvertised(args, monitors, cache, code, "watch"))
     {
-      elements.push_back(ParseToken(token));
+      return false;
     }
-    return elements;
   }
-};
-
-
 
+  WatchEventWriter events{ std::cout };
+  RunOnEachMonitor(monitors, [&](size_t i)
+  {
+    WatchMonitor(monitors[i].first, monitors[i].second, args.WatchCodes, WatchPolicy{}, events);
+  });
+  return true;
+}
 
-void PrintInfo(MonitorUtils::Monitor const& monitor)
+void PrintTableTransfer(std::ostream& out, char const* verb, uint32_t code, TableTransfer const& transfer)
 {
-  const auto info = MonitorUtils::GetMonitorInfoA(monitor);
-  std::cout << "Monitor Info" << std::endl;
-  std::cout << "------------" << std::endl;
-  std::cout << "Name: " << info.Name << std::endl;
-  std::cout << "Primary: " << ((info.Primary) ? "true" : "false") << std::endl;
+  out << std::dec << verb << " " << transfer.Bytes << " bytes of VCP table " << DescribeVCPCode(code) << " in " << transfer.Fragments <<
+    " fragments (" << transfer.Retries << " retried) in " <<
+    std::chrono::duration_cast<std::chrono::milliseconds>(transfer.Elapsed).count() << " ms\n";
 }
 
-void PrintHighLevelCapabilities(MonitorUtils::Monitor const& monitor)
+// Reads a table feature of one monitor into a file.
+bool ReadTables(Arguments const& args, MonitorList const& monitors, CapabilitiesCache& cache)
 {
-  const auto highLevelCapabilities = MonitorUtils::GetHighLevelCapabilities(monitor);
-  std::cout << "High-level capabilities:" << std::endl;
-  if (highLevelCapabilities.Valid)
+  const auto code = static_cast<uint8_t>(args.TableCode);
+  if (!CheckAdvertised(args, monitors, cache, code, "read"))
   {
-    MonitorUtils::Print(highLevelCapabilities, "  ");
+    return false;
   }
-  else
+  std::ofstream file{ args.ReadTableFile, std::ios::binary | std::ios::trunc };
+  if (!file)
   {
-    std::cerr<< "Could not obtain high-level capabililties." << std::endl;
+    std::cerr << "Cannot open " << args.ReadTableFile << std::endl;
+    return false;
   }
-}
-
-void PrintLowLevelCapabilities(MonitorUtils::Monitor const& monitor)
-{
-  const auto lowLevelCapabilties = MonitorUtils::GetLowLevelCapabilities(monitor);
-  std::cout << "Low-level capabilities:" << std::endl;
-  if (lowLevelCapabilties.Valid)
+  const auto transfer = ReadTable(monitors.front().second, code, file);
+  file.close();
+  if (!transfer.Success)
   {
-    MonitorUtils::Print(lowLevelCapabilties.Capabilities, "  ");
+    std::cerr << "Failed to read VCP table " << DescribeVCPCode(code) << " after " << std::dec << transfer.Bytes << " bytes" << std::endl;
+    SetLastErrorCode(transfer.Error);
+    PrintLastError(std::cerr);
+    return false;
   }
-  else
+  if (!file)
   {
-    std::cerr << "Could not obtain low-level capabilities." << std::endl;
-    PrintLastError();
+    std::cerr << "Failed to write " << args.ReadTableFile << std::endl;
+    return false;
   }
+  PrintTableTransfer(std::cout, "Read", code, transfer);
+  return true;
 }
 
-MonitorUtils::VCPFeatureResult Verify(MonitorUtils::Monitor const& monitor, uint32_t vcpCode, uint32_t vcpValue)
+// Writes a file to a table feature of every selected monitor, all at once.
+// With --verify each table is read back and compared with the file.
+bool WriteTables(Arguments const& args, MonitorList const& monitors, CapabilitiesCache& cache)
 {
-  const auto startTime = std::chrono::steady_clock::now();
-  MonitorUtils::VCPFeatureResult result;
-  result.Success = false;
-  while (std::chrono::steady_clock::now() - startTime < std::chrono::milliseconds{ 3000 })
+  const auto code = static_cast<uint8_t>(args.TableCode);
+  if (!CheckAdvertised(args, monitors, cache, code, "write"))
   {
-    result = MonitorUtils::GetVCPFeature(monitor, vcpCode);
-    if (result.Success && result.CurrentValue == vcpValue)
-    {
-      break;
-    }
+    return false;
+  }
+  std::ifstream file{ args.WriteTableFile, std::ios::binary };
+  if (!file)
+  {
+    std::cerr << "Cannot open " << args.WriteTableFile << std::endl;
+    return false;
+  }
+  const std::string data{ std::istreambuf_iterator<char>{ file }, std::istreambuf_iterator<char>{} };
+  if (data.empty() || data.size() > MaxTableSize)
+  {
+    std::cerr << args.WriteTableFile << " holds " << std::dec << data.size() << " bytes, but a table holds 1 to " << MaxTableSize << std::endl;
+    return false;
   }
-  return result;
-}
-
-void PrintCapabilities(MonitorUtils::Monitor const& monitor)
-{
-  PrintHighLevelCapabilities(monitor);
-  PrintLowLevelCapabilities(monitor);
-}
 
-bool Toggle(MonitorUtils::Monitor const& monitor, bool verify = false)
-{
-  const auto inputSourceCode = 0x60;
-  const auto result = MonitorUtils::GetVCPFeature(monitor, inputSourceCode);
-  if (result.Success)
+  struct Worker
+  {
+    std::ostringstream Out;
+    std::ostringstream Err;
+    bool Success{ false };
+  };
+  std::vector<Worker> workers(monitors.size());
+  RunOnEachMonitor(monitors, [&](size_t i)
   {
-    const auto inputSourceHdmi = 0x11;
-    const auto inputSourceDisplayPort = 0xF;
-    const auto toggledInputSource = (result.CurrentValue == inputSourceHdmi) ? inputSourceDisplayPort : inputSourceHdmi;
-    if (MonitorUtils::SetVCPFeature(monitor, inputSourceCode, toggledInputSource))
+    auto& worker = workers[i];
+    std::istringstream in{ data };
+    const auto transfer = WriteTable(monitors[i].second, code, in);
+    if (!transfer.Success)
+    {
+      worker.Err << "Failed to write VCP table " << DescribeVCPCode(code) << " of monitor " << std::dec << monitors[i].first << '\n';
+      SetLastErrorCode(transfer.Error);
+      PrintLastError(worker.Err);
+      return;
+    }
+    PrintTableTransfer(worker.Out, "Wrote", code, transfer);
+    worker.Success = true;
+    if (args.Verify)
     {
-      if (verify)
+      std::ostringstream readBack;
+      const auto verification = ReadTable(monitors[i].second, code, readBack);
+      worker.Success = verification.Success && readBack.str().compare(0, data.size(), data) == 0;
+      if (!worker.Success)
       {
-        const auto result = Verify(monitor, inputSourceCode, toggledInputSource);
-        return result.Success;
+        worker.Err << "Failed to verify VCP table " << DescribeVCPCode(code) << " of monitor " << std::dec << monitors[i].first << '\n';
       }
       else
       {
-        return true;
+        PrintTableTransfer(worker.Out, "Read back", code, verification);
       }
     }
+  });
+
+  auto success = true;
+  for (size_t i = 0; i < monitors.size(); ++i)
+  {
+    if (monitors.size() > 1)
+    {
+      std::cout << std::dec << "Monitor " << monitors[i].first << ":\n";
+    }
+    std::cout << workers[i].Out.str();
+    std::cerr << workers[i].Err.str();
+    success = success && workers[i].Success;
   }
-  return false;
+  return success;
 }
 
-struct Arguments
-{
-  bool Valid = { false };
-  bool MonitorIndex = 0;
-  bool PrintInfo{ false };
-  bool PrintCapabilities{ false };
-  bool SetVCPFeature{ false };
-  uint32_t SetVCPFeatureAddress{ 0x0 };
-  uint32_t SetVCPFeatureValue{ 0x0 };
-  bool GetVCPFeature{ false };
-  uint32_t GetVCPFeatureAddress{ 0x0 };
-  bool Verify{ false };
-  bool Toggle{ false };
-};
-
-std::vector<std::string> TokenizeArguments(int argc, char** argv)
+// Runs the operation on all monitors at once. Every backend gives each monitor
+// its own DDC/CI channel (a GPU output on Windows, an i2c bus on Linux), so one
+// worker per monitor keeps every bus busy and the operation takes as long as
+// the slowest monitor instead of the sum of all of them. Each worker's output is
+// collected and printed in monitor order once all of them have finished.
+bool ExecuteOnMonitors(Arguments const& args, MonitorList const& monitors, CapabilitiesCache& cache)
 {
-  std::vector<std::string> args;
-  for (auto i = 1; i < argc; ++i)
+  if (args.Dump || !args.SnapshotFile.empty())
   {
-    args.emplace_back(argv[i]);
+    return DumpMonitors(args, monitors, cache);
+  }
+  if (!args.SaveFile.empty())
+  {
+    return SaveProfiles(args, monitors, cache);
+  }
+  if (!args.WatchCodes.empty())
+  {
+    return WatchMonitors(args, monitors, cache);
+  }
+  if (!args.ReadTableFile.empty())
+  {
+    return ReadTables(args, monitors, cache);
+  }
+  if (!args.WriteTableFile.empty())
+  {
+    return WriteTables(args, monitors, cache);
+  }
+  if (monitors.size() == 1)
+  {
+    ResultWriter results{ args.Format, monitors.front().first };
+    const auto success = ExecuteOperation(args, monitors.front().second, cache, results);
+    WriteResults(std::cout, std::cerr, { &results });
+    return success;
   }
-  return args;
-}
 
-bool ICompare(std::string const& a, std::string const& b)
-{
-  return _stricmp(a.c_str(), b.c_str()) == 0;
-}
+  struct Worker
+  {
+    ResultWriter Results;
+    CommitPoint Commit;
+    bool Success{ false };
+  };
 
-template<typename T>
-bool GetHex(std::string const& s, T* out)
-{
-  std::stringstream ss{ s };
-  ss >> std::hex >> *out;
-  return ss.failbit;
+  Barrier barrier{ monitors.size() };
+  std::vector<Worker> workers(monitors.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < monitors.size(); ++i)
+  {
+    workers[i].Results = ResultWriter{ args.Format, monitors[i].first };
+    workers[i].Commit = CommitPoint{ args.Barrier ? &barrier : nullptr };
+    threads.emplace_back([&, i]
+    {
+      if (const auto tracer = Tracer::Active())
+      {
+        tracer->NameThread("Monitor " + std::to_string(monitors[i].first));
+      }
+      auto& worker = workers[i];
+      worker.Success = ExecuteOperation(args, monitors[i].second, cache, worker.Results, &worker.Commit);
+      worker.Commit.Leave();
+    });
+  }
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  auto success = true;
+  std::vector<ResultWriter const*> results;
+  std::vector<CommitPoint const*> commits;
+  for (auto& worker : workers)
+  {
+    results.push_back(&worker.Results);
+    success = success && worker.Success;
+    if (worker.Commit.Committed())
+    {
+      commits.push_back(&worker.Commit);
+    }
+  }
+  WriteResults(std::cout, std::cerr, results);
+  if (args.Format == OutputFormat::Text)
+  {
+    PrintWriteSkew(commits);
+  }
+  return success;
 }
 
-template<typename T>
-bool Get(std::string const& s, T* out)
+// Runs one operation given as command line tokens, for batch lines and daemon
+// requests. Options that only make sense for the whole process are rejected,
+// and so is --watch, which never finishes.
+bool RunOperation(std::vector<std::string> const& tokens, Arguments const& defaults, MonitorSession& session, CapabilitiesCache& cache)
 {
+  const auto args = ParseArguments(tokens, defaults);
+  if (!args.Valid || !args.BatchFile.empty() || !args.SimulationFile.empty() || !args.StateFile.empty() || !args.TraceFile.empty() ||
+    args.Serve || args.Client || !args.WatchCodes.empty())
+  {
+    std::cerr << "Invalid operation:";
+    for (const auto& token : tokens)
+    {
+      std::cerr << " " << token;
+    }
+    std::cerr << std::endl;
+    return false;
+  }
 
-  if (s.size() > 2 && s.at(0) == '0' && (s.at(1) == 'x' || s.at(1) == 'X'))
+  if (!args.RestoreFile.empty())
   {
-    return GetHex(s.substr(2), out);
+    return RestoreProfiles(args, session);
   }
-  else
+  MonitorList monitors;
+  if (!GetMonitors(args, session, &monitors))
   {
-    std::stringstream ss{ s };
-    ss >> *out;
-    return ss.failbit;
+    return false;
   }
+  return ExecuteOnMonitors(args, monitors, cache);
 }
 
-Arguments ParseArguments(std::vector<std::string> const& args)
+// Simulated monitors get a cache of their own, so a simulated identity never
+// supplies the capabilities of a real monitor with the same EDID.
+std::string CapabilitiesCachePath(Arguments const& args)
 {
-  Arguments arguments{};
-  arguments.Valid = true;
+  const auto path = CapabilitiesCache::DefaultPath();
+  if (args.SimulationFile.empty())
+  {
+    return path;
+  }
+  return (std::filesystem::path{ path }.parent_path() / "simulated.cache").string();
+}
 
-  for (auto i = 0u; i < args.size(); ++i)
+// Each line of the batch holds the arguments for one operation, e.g.
+// "-m 1 --set 0x60 0x11". Blank lines and lines starting with '#' are skipped.
+// Lines without --monitor/-m use the monitor given on the command line.
+int RunBatch(Arguments const& args, std::istream& input)
+{
+  MonitorSession session;
+  CapabilitiesCache cache{ CapabilitiesCachePath(args) };
+  Arguments lineDefaults{};
+  lineDefaults.MonitorIndex = args.MonitorIndex;
+  lineDefaults.MonitorIndices = args.MonitorIndices;
+  lineDefaults.AllMonitors = args.AllMonitors;
+  lineDefaults.Barrier = args.Barrier;
+  lineDefaults.Plan = args.Plan;
+  lineDefaults.Format = args.Format;
+  lineDefaults.VerifyTimeout = args.VerifyTimeout;
+  lineDefaults.MaxAge = args.MaxAge;
+  lineDefaults.RampTime = args.RampTime;
+  lineDefaults.UseCache = args.UseCache;
+
+  auto failures = 0;
+  std::string line;
+  for (auto lineNumber = 1; std::getline(input, line); ++lineNumber)
   {
-    auto arg = args.at(i);
-    
-    if (ICompare("--monitor", arg) || ICompare("-m", arg))
+    std::istringstream words{ line };
+    std::vector<std::string> tokens;
+    for (std::string word; words >> word;)
     {
-      ++i;
-      if (i == args.size())
-      {
-        std::cerr << "--monitor/-m requires a monitor index" << std::endl;
-        arguments.Valid = false;
-        break;
-      }
-      arg = args.at(i);
-      if (!Get(arg, &arguments.MonitorIndex))
-      {
-        std::cerr << "Expected a monitor index, but got: " << arg << std::endl;
-        arguments.Valid = false;
-        break;
-      }
+      tokens.push_back(word);
     }
-    else if (ICompare("--info", arg) || ICompare("-i", arg))
+    if (tokens.empty() || tokens.front().front() == '#')
     {
-      arguments.PrintInfo = true;
+      continue;
     }
-    else if (ICompare("--capabilities", arg) || ICompare("-c", arg))
+
+    TraceSpan span{ "operation", "Batch line", "line", static_cast<uint32_t>(lineNumber) };
+    const auto success = RunOperation(tokens, lineDefaults, session, cache);
+    if (args.Format == OutputFormat::Text)
     {
-      arguments.PrintCapabilities = true;
+      std::cout << std::dec << "Line " << lineNumber << ": " << (success ? "OK" : "FAILED") << '\n';
     }
-    else if (ICompare("--get", arg) || ICompare("-g", arg))
+    else
     {
-      arguments.GetVCPFeature = true;
-      ++i;
-      if (i == args.size())
-      {
-        std::cerr << "--get/-g requires an address" << std::endl;
-        arguments.Valid = false;
-        break;
-      }
-      arg = args.at(i);
-      if (!Get(arg, &arguments.GetVCPFeatureAddress))
-      {
-        std::cerr << "Expected an address, but got: " << arg << std::endl;
-        arguments.Valid = false;
-        break;
-      }
-      arguments.GetVCPFeatureAddress &= 0xFF;
+      std::cout << std::dec << "{\"line\":" << lineNumber << ",\"success\":" << (success ? "true" : "false") << "}\n";
     }
-    else if (ICompare("--set", arg) || ICompare("-s", arg))
+    // Whoever feeds the batch through a pipe may be waiting for this line.
+    std::cout.flush();
+    failures += success ? 0 : 1;
+  }
+  return failures == 0 ? 0 : 1;
+}
+
+// Daemon protocol. A request is the client's arguments, one per line, ended by
+// an empty line. The response carries the operation's standard output and
+// error, then its exit status:
+//   OUT <length>\n<bytes>ERR <length>\n<bytes>STATUS <code>\n
+int Serve(Arguments const& args, ScopedTrace const& trace)
+{
+  IpcServer server{ args.Endpoint };
+  if (!server.Listen())
+  {
+    std::cerr << "Cannot listen on " << args.Endpoint << std::endl;
+    PrintLastError();
+    return 1;
+  }
+  std::cout << "Listening on " << args.Endpoint << std::endl;
+
+  // Monitor handles and the capabilities cache stay open across requests.
+  MonitorSession session;
+  CapabilitiesCache cache{ CapabilitiesCachePath(args) };
+  Arguments requestDefaults{};
+  requestDefaults.MonitorIndex = args.MonitorIndex;
+  requestDefaults.MonitorIndices = args.MonitorIndices;
+  requestDefaults.AllMonitors = args.AllMonitors;
+  requestDefaults.Barrier = args.Barrier;
+  requestDefaults.VerifyTimeout = args.VerifyTimeout;
+  requestDefaults.MaxAge = args.MaxAge;
+  requestDefaults.RampTime = args.RampTime;
+  requestDefaults.UseCache = args.UseCache;
+
+  for (;;)
+  {
+    const auto connection = server.Accept();
+    std::string request;
+    if (!connection || !connection->ReadUntil("\n\n", &request))
     {
-      arguments.SetVCPFeature = true;
-      ++i;
-      if (i == args.size())
-      {
-        std::cerr << "--set/-s requires an address and value" << std::endl;
-        arguments.Valid = false;
-        break;
-      }
-      arg = args.at(i);
-      if (!Get(arg, &arguments.SetVCPFeatureAddress))
-      {
-        std::cerr << "Expected an address, but got: " << arg << std::endl;
-        arguments.Valid = false;
-        break;
-      }
-      arguments.SetVCPFeatureAddress &= 0xFF;
-      ++i;
-      if (i == args.size())
-      {
-        std::cerr << "--set/-s requires an address and value" << std::endl;
-        arguments.Valid = false;
-        break;
-      }
-      arg = args.at(i);
-      if (!Get(arg, &arguments.SetVCPFeatureValue))
-      {
-        std::cerr << "Expected an value, but got: " << arg << std::endl;
-        arguments.Valid = false;
-        break;
-      }
+      continue;
     }
-    else if (ICompare("--verify", arg) || ICompare("-v", arg))
+    std::vector<std::string> tokens;
+    std::istringstream lines{ request };
+    for (std::string token; std::getline(lines, token);)
     {
-      arguments.Verify = true;
+      tokens.push_back(token);
     }
-    else if (ICompare("--toggle", arg))
+
+    std::ostringstream out;
+    std::ostringstream err;
+    const auto coutFlags = std::cout.flags();
+    const auto coutBuffer = std::cout.rdbuf(out.rdbuf());
+    const auto cerrBuffer = std::cerr.rdbuf(err.rdbuf());
+    const auto success = RunOperation(tokens, requestDefaults, session, cache);
+    std::cout.rdbuf(coutBuffer);
+    std::cerr.rdbuf(cerrBuffer);
+    std::cout.flags(coutFlags);
+
+    const auto outText = out.str();
+    const auto errText = err.str();
+    (void)connection->Write(
+      "OUT " + std::to_string(outText.size()) + "\n" + outText +
+      "ERR " + std::to_string(errText.size()) + "\n" + errText +
+      "STATUS " + std::to_string(success ? 0 : 1) + "\n");
+    trace.Flush();
+  }
+}
+
+// Forwards the command line, minus the client options, to a running daemon.
+int RunClient(Arguments const& args, std::vector<std::string> const& argTokens)
+{
+  TraceSpan span{ "operation", "Client request" };
+  const auto connection = IpcConnection::Connect(args.Endpoint);
+  if (!connection)
+  {
+    std::cerr << "Cannot connect to monitor_util daemon at " << args.Endpoint << std::endl;
+    return 1;
+  }
+
+  std::string request;
+  for (auto i = 0u; i < argTokens.size(); ++i)
+  {
+    if (ICompare("--client", argTokens.at(i)))
     {
-      arguments.Toggle = true;
+      continue;
     }
-    else
+    if (ICompare("--endpoint", argTokens.at(i)) || ICompare("--trace", argTokens.at(i)))
     {
-      std::cerr << "Unsupported argument: " << arg << std::endl;
-      arguments.Valid = false;
-      break;
+      ++i;
+      continue;
+    }
+    if (!argTokens.at(i).empty())
+    {
+      request += argTokens.at(i) + "\n";
     }
   }
-
-  // Post validation
-  if (arguments.GetVCPFeature && arguments.SetVCPFeature)
+  request += "\n";
+  if (!connection->Write(request))
   {
-    std::cerr << "You cannot specify both get and set operations in a single command" << std::endl;
-    arguments.Valid = false;
+    std::cerr << "Failed to send request to " << args.Endpoint << std::endl;
+    return 1;
   }
 
-  return arguments;
-}
-
-void PrintUsage()
-{
-  std::cout << "monitor_util [--monitor/-m INDEX] [--info/-i] [--capabilities/-c] [(--get/-g ADDRESS) | (--set/-s ADDRESS VALUE ) | (--toggle)] [--verify/-v]" << std::endl;
+  std::string header;
+  std::string text;
+  size_t length = 0;
+  if (!connection->ReadUntil("\n", &header) || !Get(header.substr(header.find(' ') + 1), &length) ||
+    !connection->ReadExactly(length, &text))
+  {
+    std::cerr << "Malformed response from " << args.Endpoint << std::endl;
+    return 1;
+  }
+  std::cout << text;
+  if (!connection->ReadUntil("\n", &header) || !Get(header.substr(header.find(' ') + 1), &length) ||
+    !connection->ReadExactly(length, &text))
+  {
+    std::cerr << "Malformed response from " << args.Endpoint << std::endl;
+    return 1;
+  }
+  std::cerr << text;
+  int status = 1;
+  if (!connection->ReadUntil("\n", &header) || !Get(header.substr(header.find(' ') + 1), &status))
+  {
+    std::cerr << "Malformed response from " << args.Endpoint << std::endl;
+    return 1;
+  }
+  return status;
 }
 
 int main(int argc, char** argv)
@@ -729,97 +1786,65 @@ int main(int argc, char** argv)
     return 1;
   }
 
-  const auto monitor = MonitorUtils::GetMonitor(args.MonitorIndex);
+  // Spans are collected from here on and written out when main returns.
+  const ScopedTrace trace{ args.TraceFile };
 
-  //while (!IsDebuggerPresent())
-  //{
-  //  std::this_thread::yield();
-  //}
+  if (args.Client)
+  {
+    return RunClient(args, argTokens);
+  }
 
-  if (monitor.GetHandle())
+  if (!args.SimulationFile.empty())
   {
-    const auto currentInputSourceResult = MonitorUtils::GetVCPFeature(monitor, 0x60);
-    if (args.PrintInfo)
-    {
-      PrintInfo(monitor);
-    }
-    if (args.PrintCapabilities)
+    std::string error;
+    auto backend = SimulatedBackend::Load(args.SimulationFile, &error);
+    if (!backend)
     {
-      PrintCapabilities(monitor);
+      std::cerr << error << std::endl;
+      return 1;
     }
+    MonitorUtils::SetBackend(std::move(backend));
+  }
+
+  // Simulated monitors live in this process only, so they share state with
+  // other processes only when asked to.
+  if (!args.StateFile.empty() || args.SimulationFile.empty())
+  {
+    MonitorUtils::SetSharedState(SharedState::Open(args.StateFile.empty() ? SharedState::DefaultPath() : args.StateFile));
+  }
 
-    if (args.GetVCPFeature)
+  if (args.Serve)
+  {
+    return Serve(args, trace);
+  }
+
+  if (!args.BatchFile.empty())
+  {
+    if (args.BatchFile == "-")
     {
-      const auto result = MonitorUtils::GetVCPFeature(monitor, args.GetVCPFeatureAddress);
-      if (result.Success)
-      {
-        std::cout << "VCP feature 0x" << std::hex << args.GetVCPFeatureAddress << " = 0x" << result.CurrentValue << std::endl;
-      }
-      else
-      {
-        std::cerr << "Failed to read VCP feature 0x" << std::hex << args.GetVCPFeatureAddress << std::endl;
-      }
-    }
-    else if (args.SetVCPFeature)
-    {
-      if (MonitorUtils::SetVCPFeature(monitor, args.SetVCPFeatureAddress, args.SetVCPFeatureValue))
-      {
-        std::cout << "Setting VCP feature 0x" << std::hex << args.SetVCPFeatureAddress << " = 0x" << args.SetVCPFeatureValue << std::endl;
-        if (args.Verify)
-        {
-          const auto result = Verify(monitor, args.SetVCPFeatureAddress, args.SetVCPFeatureValue);
-          if (result.Success)
-          {
-            if (result.CurrentValue == args.SetVCPFeatureValue)
-            {
-              std::cout << "Success" << std::endl;
-            }
-            else
-            {
-              std::cerr << "Failed to verify - expected 0x" << std::hex << args.SetVCPFeatureValue << ", but got 0x" << result.CurrentValue << std::endl;
-            }
-          }
-          else
-          {
-            std::cerr << "Failed to verify - read-back failed." << std::endl;
-          }
-        }
-        else
-        {
-          std::cout << "Success" << std::endl;
-        }
-      }
-      else
-      {
-        std::cerr << "Failure - failed to set value" << std::endl;
-      }
+      return RunBatch(args, std::cin);
     }
-    else if (args.Toggle)
+    std::ifstream batch{ args.BatchFile };
+    if (!batch)
     {
-      if (Toggle(monitor, args.Verify))
-      {
-        std::cout << "Successfully toggled input source" << std::endl;
-      }
-      else
-      {
-        std::cerr << "Failed to toggle input source" << std::endl;
-      }
+      std::cerr << "Cannot open batch file " << args.BatchFile << std::endl;
+      return 1;
     }
-    
-    //std::cout << "Current input source: ";
-    //if (currentInputSourceResult.Success)
-    //{
-    //  std::cout << "0x" << std::hex << currentInputSourceResult.CurrentValue << std::endl;
-    //}
-    //else
-    //{
-    //  std::cerr << "Could not obtain VCP setting for 0x" << std::hex << 0x60 << std::endl;
-    //}
-    //MonitorUtils::SetVCPFeature(monitor, 0x60, 0x0f); // 0x0F = DisplayPort, 0x11 = HDMI
+    return RunBatch(args, batch);
   }
-  else
+
+  MonitorSession session;
+  if (!args.RestoreFile.empty())
+  {
+    return RestoreProfiles(args, session) ? 0 : 1;
+  }
+  MonitorList monitors;
+  if (!GetMonitors(args, session, &monitors))
   {
-    std::cerr << "Failed to get monitor handle" << std::endl;
     PrintLastError();
+    return 1;
   }
- }
\ No newline at end of file
+
+  CapabilitiesCache cache{ CapabilitiesCachePath(args) };
+  return ExecuteOnMonitors(args, monitors, cache) ? 0 : 1;
+}
\ No newline at end of file
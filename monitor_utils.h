@@ -0,0 +1,481 @@
+// monitor_utils.h : Monitor access through the platform's DDC/CI backend.
+//
+#pragma once
+
+#ifdef _WIN32
+#include "win32_backend.h"
+#else
+#include "linux_i2c_backend.h"
+#endif
+
+#include "capabilities.h"
+#include "capabilities_cache.h"
+#include "command_scheduler.h"
+#include "edid.h"
+#include "executor.h"
+#include "monitor_backend.h"
+#include "shared_state.h"
+#include "trace.h"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+
+inline std::unique_ptr<MonitorBackend> CreatePlatformBackend()
+{
+#ifdef _WIN32
+  return std::make_unique<Win32Backend>();
+#else
+  return std::make_unique<LinuxI2cBackend>();
+#endif
+}
+
+class MonitorUtils
+{
+public:
+
+  using HighLevelCapabilities = ::HighLevelCapabilities;
+  using VCPFeatureResult = ::VCPFeatureResult;
+  using MonitorInfo = ::MonitorInfo;
+  using VCPCapabilityElementType = ::VCPCapabilityElementType;
+  using VCPCapabilityValueType = ::VCPCapabilityValueType;
+  using VCPCapabilityElement = ::VCPCapabilityElement;
+
+  // Each capabilities fragment is asked for up to this many more times.
+  static constexpr int CapabilitiesFragmentRetries = 3;
+
+  // Shared handle to a backend device; copies refer to the same physical
+  // monitor, which is released when the last copy goes away.
+  class Monitor
+  {
+  public:
+    Monitor() = default;
+
+    explicit Monitor(std::shared_ptr<MonitorDevice> device)
+      : m_device{ std::move(device) }
+    {
+    }
+
+    bool IsValid() const
+    {
+      return m_device != nullptr;
+    }
+
+    MonitorDevice& GetDevice() const
+    {
+      return *m_device;
+    }
+
+  private:
+    std::shared_ptr<MonitorDevice> m_device;
+  };
+
+  static MonitorBackend& GetBackend()
+  {
+    return *BackendInstance();
+  }
+
+  static void SetBackend(std::unique_ptr<MonitorBackend> backend)
+  {
+    BackendInstance() = std::move(backend);
+  }
+
+  // Monitors opened from here on share their bus locks and last-known values
+  // with other processes through state; nullptr stops sharing.
+  static void SetSharedState(std::shared_ptr<SharedState> state)
+  {
+    SharedStateInstance() = std::move(state);
+  }
+
+  // Commands to the monitor go through its bus scheduler.
+  static Monitor GetMonitor(int index)
+  {
+    TraceSpan span{ "open", "Open monitor", "index", static_cast<uint32_t>(index) };
+    auto device = GetBackend().Open(index);
+    if (!device)
+    {
+      return {};
+    }
+    const auto& state = SharedStateInstance();
+    auto shared = state ? state->Attach(device->GetInfo().Name) : nullptr;
+    return Monitor{ std::make_shared<ScheduledMonitorDevice>(std::move(device), std::move(shared)) };
+  }
+
+  // A value read earlier in this session, or by another process sharing the
+  // state, if it is still trustworthy. See
+  // ScheduledMonitorDevice::GetKnownValue().
+  static bool GetKnownVCPFeature(Monitor monitor, uint8_t code, std::chrono::steady_clock::duration maxAge, VCPFeatureResult* value)
+  {
+    const auto device = monitor.IsValid() ? dynamic_cast<ScheduledMonitorDevice*>(&monitor.GetDevice()) : nullptr;
+    return device && device->GetKnownValue(code, maxAge, value);
+  }
+
+  // See ScheduledMonitorDevice::BeginRamp(). Other devices never see a ramp
+  // superseded.
+  static uint32_t BeginRamp(Monitor monitor, uint8_t code)
+  {
+    const auto device = monitor.IsValid() ? dynamic_cast<ScheduledMonitorDevice*>(&monitor.GetDevice()) : nullptr;
+    return device ? device->BeginRamp(code) : 0;
+  }
+
+  static bool IsCurrentRamp(Monitor monitor, uint8_t code, uint32_t ticket)
+  {
+    const auto device = monitor.IsValid() ? dynamic_cast<ScheduledMonitorDevice*>(&monitor.GetDevice()) : nullptr;
+    return !device || device->IsCurrentRamp(code, ticket);
+  }
+
+  static SchedulerStats GetSchedulerStats(Monitor monitor)
+  {
+    const auto device = monitor.IsValid() ? dynamic_cast<ScheduledMonitorDevice*>(&monitor.GetDevice()) : nullptr;
+    return device ? device->GetStats() : SchedulerStats{};
+  }
+
+  static bool SetVCPFeature(Monitor monitor, uint8_t code, uint32_t value)
+  {
+    return monitor.IsValid() && monitor.GetDevice().SetVCPFeature(code, value);
+  }
+
+  static VCPFeatureResult GetVCPFeature(Monitor monitor, uint8_t code)
+  {
+    if (!monitor.IsValid())
+    {
+      return {};
+    }
+    return monitor.GetDevice().GetVCPFeature(code);
+  }
+
+  // Reads several codes in one go. Scheduled devices get all the reads queued
+  // at once; others are read one after the other.
+  static std::vector<TimedVCPFeatureResult> GetVCPFeatures(Monitor monitor, std::vector<uint8_t> const& codes)
+  {
+    if (!monitor.IsValid())
+    {
+      return {};
+    }
+    if (const auto device = dynamic_cast<ScheduledMonitorDevice*>(&monitor.GetDevice()))
+    {
+      return device->GetVCPFeatures(codes);
+    }
+    std::vector<TimedVCPFeatureResult> results;
+    for (const auto code : codes)
+    {
+      const auto startTime = std::chrono::steady_clock::now();
+      const auto result = monitor.GetDevice().GetVCPFeature(code);
+      const auto error = GetLastErrorCode();
+      results.push_back({ code, result, error, std::chrono::steady_clock::now() - startTime });
+    }
+    return results;
+  }
+
+  static bool ReadTableFragment(Monitor monitor, uint8_t code, uint16_t offset, TableFragment* fragment)
+  {
+    return monitor.IsValid() && monitor.GetDevice().ReadTableFragment(code, offset, fragment);
+  }
+
+  // Scheduled devices queue the write and return at once; others write the
+  // fragment before returning.
+  static std::future<TableWriteResult> QueueTableWrite(Monitor monitor, uint8_t code, TableFragment const& fragment)
+  {
+    if (monitor.IsValid())
+    {
+      if (const auto device = dynamic_cast<ScheduledMonitorDevice*>(&monitor.GetDevice()))
+      {
+        return device->QueueTableWrite(code, fragment);
+      }
+    }
+    std::promise<TableWriteResult> result;
+    const auto success = monitor.IsValid() && monitor.GetDevice().WriteTableFragment(code, fragment);
+    result.set_value({ fragment.Offset, success, success ? 0 : GetLastErrorCode() });
+    return result.get_future();
+  }
+
+  static MonitorInfo GetMonitorInfo(Monitor monitor)
+  {
+    if (!monitor.IsValid())
+    {
+      return {};
+    }
+    return monitor.GetDevice().GetInfo();
+  }
+
+  static MonitorIdentity GetMonitorIdentity(Monitor monitor)
+  {
+    if (!monitor.IsValid())
+    {
+      return {};
+    }
+    return monitor.GetDevice().GetIdentity();
+  }
+
+  struct LowLevelCapabilities
+  {
+    bool Valid{ false };
+    bool Cached{ false };
+    bool Complete{ false };  // False when reading stopped after the group asked for
+    CapabilityTree Tree;
+
+    // Root capabilities element, expanded from the flat tree on demand
+    VCPCapabilityElement Capabilities() const
+    {
+      return Tree.Empty() ? VCPCapabilityElement{} : Tree.ToElement(Tree.Root());
+    }
+
+    CapabilityIndex Index() const
+    {
+      return CapabilityIndex{ Tree };
+    }
+  };
+
+  static HighLevelCapabilities GetHighLevelCapabilities(Monitor monitor)
+  {
+    if (!monitor.IsValid())
+    {
+      return {};
+    }
+    return monitor.GetDevice().GetHighLevelCapabilities();
+  }
+
+  // Which codes and values the monitor advertises, if its capabilities are
+  // in the cache. Never asks the monitor, so it is cheap enough to check every
+  // request against.
+  static bool GetCachedCapabilityIndex(Monitor monitor, CapabilitiesCache const& cache, CapabilityIndex* index)
+  {
+    if (!monitor.IsValid())
+    {
+      return false;
+    }
+    CapabilityTree tree{};
+    const auto identity = GetMonitorIdentity(monitor);
+    if (!identity.Valid() || !cache.Find(identity, &tree))
+    {
+      return false;
+    }
+    *index = CapabilityIndex{ tree };
+    return index->Valid();
+  }
+
+  // Reads the capabilities string fragment by fragment where the backend can,
+  // retrying a bad fragment on its own, and in one piece where it cannot. See
+  // ReadCapabilitiesFragments().
+  static bool ReadCapabilities(Monitor monitor, std::function<bool(std::string_view)> const& sink)
+  {
+    if (!monitor.IsValid())
+    {
+      return false;
+    }
+    auto& device = monitor.GetDevice();
+    const auto scheduled = dynamic_cast<ScheduledMonitorDevice*>(&device);
+    if (scheduled ? scheduled->ReadCapabilities(CapabilitiesFragmentRetries, sink) : ReadCapabilitiesFragments(device, CapabilitiesFragmentRetries, sink))
+    {
+      return true;
+    }
+    if (GetLastErrorCode() != NotSupportedErrorCode)
+    {
+      return false;
+    }
+    std::string capabilities;
+    if (!device.GetCapabilitiesString(&capabilities))
+    {
+      return false;
+    }
+    (void)sink(capabilities);
+    return true;
+  }
+
+  // The capabilities are parsed as the fragments come in. With stopAfterGroup,
+  // e.g. "vcp", reading stops as soon as that group is complete, unless there
+  // is a cache to fill: the whole string read once saves every later read.
+  static LowLevelCapabilities GetLowLevelCapabilities(Monitor monitor, CapabilitiesCache* cache = nullptr, std::string_view stopAfterGroup = {})
+  {
+    LowLevelCapabilities capabilities{};
+    if (!monitor.IsValid())
+    {
+      return capabilities;
+    }
+
+    MonitorIdentity identity{};
+    if (cache)
+    {
+      TraceSpan span{ "capabilities", "Capabilities cache lookup" };
+      identity = GetMonitorIdentity(monitor);
+      if (identity.Valid() && cache->Find(identity, &capabilities.Tree))
+      {
+        capabilities.Valid = true;
+        capabilities.Cached = true;
+        capabilities.Complete = true;
+        return capabilities;
+      }
+    }
+
+    CapabilitiesParser parser{};
+    auto stopped = false;
+    if (ReadCapabilities(monitor, [&](std::string_view fragment)
+    {
+      TraceSpan span{ "capabilities", "Parse capabilities fragment" };
+      parser.Append(fragment);
+      stopped = !cache && !stopAfterGroup.empty() && parser.HasGroup(stopAfterGroup);
+      return !stopped;
+    }))
+    {
+      capabilities.Tree = parser.Finish();
+      capabilities.Valid = !capabilities.Tree.Empty();
+      capabilities.Complete = !stopped;
+    }
+
+    if (capabilities.Valid && cache && identity.Valid())
+    {
+      (void)cache->Store(identity, capabilities.Tree);
+    }
+
+    return capabilities;
+  }
+
+  // Asynchronous variants of the calls above. Each returns at once; the
+  // future holds the result together with the error code of the thread that
+  // did the work. Reads and writes of scheduled devices are queued on the
+  // monitor's bus worker, so any number of them can be in flight from one
+  // thread. Opening a monitor and reading capabilities run on a small shared
+  // executor. A cache passed in must outlive the call's future.
+  template<typename T>
+  using AsyncResult = std::shared_future<CommandResult<T>>;
+
+  static AsyncResult<Monitor> GetMonitorAsync(int index)
+  {
+    return AsyncExecutor().Run<Monitor>([index] { return GetMonitor(index); }).share();
+  }
+
+  static AsyncResult<VCPFeatureResult> GetVCPFeatureAsync(Monitor monitor, uint8_t code)
+  {
+    if (const auto device = monitor.IsValid() ? dynamic_cast<ScheduledMonitorDevice*>(&monitor.GetDevice()) : nullptr)
+    {
+      return device->GetVCPFeatureAsync(code);
+    }
+    return AsyncExecutor().Run<VCPFeatureResult>([monitor, code] { return GetVCPFeature(monitor, code); }).share();
+  }
+
+  static AsyncResult<bool> SetVCPFeatureAsync(Monitor monitor, uint8_t code, uint32_t value)
+  {
+    if (const auto device = monitor.IsValid() ? dynamic_cast<ScheduledMonitorDevice*>(&monitor.GetDevice()) : nullptr)
+    {
+      return device->SetVCPFeatureAsync(code, value).share();
+    }
+    return AsyncExecutor().Run<bool>([monitor, code, value] { return SetVCPFeature(monitor, code, value); }).share();
+  }
+
+  static AsyncResult<LowLevelCapabilities> GetLowLevelCapabilitiesAsync(Monitor monitor, CapabilitiesCache* cache = nullptr, std::string stopAfterGroup = {})
+  {
+    return AsyncExecutor().Run<LowLevelCapabilities>([monitor, cache, stopAfterGroup]
+    {
+      return GetLowLevelCapabilities(monitor, cache, stopAfterGroup);
+    }).share();
+  }
+
+  // indent is a number of spaces; nested elements get two more each.
+  static void Print(std::ostream& out, HighLevelCapabilities const& capabilities, int indent = 0)
+  {
+    const auto line = [&](char const* text) -> std::ostream& { return out << std::setw(indent) << "" << text; };
+    if (capabilities.None)
+    {
+      line("None") << '\n';
+    }
+    else
+    {
+      line("Brightness: ") << capabilities.Brightness << '\n';
+      line("Color temperature: ") << capabilities.ColorTemperature << '\n';
+      line("Contrast: ") << capabilities.Contrast << '\n';
+      line("Degauss: ") << capabilities.Degauss << '\n';
+      line("Display area position: ") << capabilities.DisplayAreaPosition << '\n';
+      line("Display area size: ") << capabilities.DisplayAreaSize << '\n';
+      line("Monitor technology type: ") << capabilities.MonitorTechnologyType << '\n';
+      line("RGB drive: ") << capabilities.RedGreenBlueDrive << '\n';
+      line("RGB gain: ") << capabilities.RedGreenBlueGain << '\n';
+      line("Restore factory color defaults: ") << capabilities.RestoreFactoryColorDefaults << '\n';
+      line("Restore factory defaults: ") << capabilities.RestoreFactoryDefaults << '\n';
+      line("Restore factory defaults enables monitor settings: ") << capabilities.RestoreFactoryDefaultsEnablesMonitorSettings << '\n';
+    }
+  }
+
+  static void Print(std::ostream& out, VCPCapabilityElement const& element, int indent = 0)
+  {
+    out << std::setw(indent) << "";
+    if (element.ValueType == VCPCapabilityValueType::VCPCode)
+    {
+      out << std::hex << "0x" << std::get<int>(element.Value);
+    }
+    else
+    {
+      out << std::get<std::string>(element.Value);
+    }
+    if (!element.Children.empty())
+    {
+      out << "(\n";
+      for (const auto& child : element.Children)
+      {
+        Print(out, child, indent + 2);
+      }
+      out << std::setw(indent) << "" << ")";
+    }
+    out << '\n';
+  }
+
+  static void Print(std::ostream& out, CapabilityTree const& tree, uint32_t index, int indent = 0)
+  {
+    out << std::setw(indent) << "";
+    if (tree.IsCode(index))
+    {
+      out << std::hex << "0x" << tree.Code(index);
+    }
+    else
+    {
+      out << tree.Text(index);
+    }
+    if (tree.FirstChild(index) != CapabilityTree::InvalidIndex)
+    {
+      out << "(\n";
+      for (auto child = tree.FirstChild(index); child != CapabilityTree::InvalidIndex; child = tree.NextSibling(child))
+      {
+        Print(out, tree, child, indent + 2);
+      }
+      out << std::setw(indent) << "" << ")";
+    }
+    out << '\n';
+  }
+
+  static std::vector<VCPCapabilityElement> ParseLowLevelCapabilitiesString(std::string_view capabilities)
+  {
+    return ParseCapabilitiesString(capabilities);
+  }
+
+private:
+
+  // Created after the backend, so it is destroyed, and its threads joined,
+  // before the backend goes away.
+  static Executor& AsyncExecutor()
+  {
+    (void)BackendInstance();
+    static Executor executor{ 8 };
+    return executor;
+  }
+
+  static std::shared_ptr<SharedState>& SharedStateInstance()
+  {
+    static std::shared_ptr<SharedState> state;
+    return state;
+  }
+
+  static std::unique_ptr<MonitorBackend>& BackendInstance()
+  {
+    static std::unique_ptr<MonitorBackend> backend{ CreatePlatformBackend() };
+    return backend;
+  }
+};
@@ -0,0 +1,581 @@
+// output.h : Results of monitor operations as text, JSON or NDJSON, buffered and written in one go.
+//
+#pragma once
+
+#include "capabilities.h"
+#include "command_scheduler.h"
+#include "edid.h"
+#include "json.h"
+#include "monitor_backend.h"
+#include "monitor_operations.h"
+#include "monitor_utils.h"
+#include "platform.h"
+#include "vcp_features.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+enum class OutputFormat
+{
+  Text,
+  Json,   // One document for the whole command
+  Ndjson, // One object per result, each tagged with its monitor
+};
+
+inline bool ParseOutputFormat(std::string_view text, OutputFormat* format)
+{
+  if (text == "text")
+  {
+    *format = OutputFormat::Text;
+  }
+  else if (text == "json")
+  {
+    *format = OutputFormat::Json;
+  }
+  else if (text == "ndjson")
+  {
+    *format = OutputFormat::Ndjson;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+// Collects the results of the operations on one monitor. Nothing reaches the
+// real output until WriteResults(), so workers on several monitors can fill
+// writers of their own at the same time, and a command's output is written
+// once instead of being flushed line by line.
+//
+// As text, results go to the output and failures to the error stream. As JSON
+// every result, failures included, is an object with a "type" and a "success"
+// member, and the error stream is left alone.
+class ResultWriter
+{
+public:
+  explicit ResultWriter(OutputFormat format = OutputFormat::Text, int index = 0)
+    : m_format{ format }
+    , m_index{ index }
+  {
+  }
+
+  OutputFormat Format() const
+  {
+    return m_format;
+  }
+
+  int Index() const
+  {
+    return m_index;
+  }
+
+  void Info(MonitorInfo const& info, MonitorIdentity const& identity)
+  {
+    if (m_format == OutputFormat::Text)
+    {
+      m_out << "Monitor Info\n------------\nName: " << info.Name << "\nPrimary: " << (info.Primary ? "true" : "false") << '\n';
+      return;
+    }
+    auto& record = BeginRecord("info", true);
+    record << ",\"name\":";
+    WriteJsonString(record, info.Name);
+    record << ",\"primary\":" << (info.Primary ? "true" : "false");
+    if (identity.Valid())
+    {
+      record << ",\"identity\":";
+      WriteJsonString(record, identity.ToString());
+    }
+    EndRecord();
+  }
+
+  void Capabilities(HighLevelCapabilities const& capabilities)
+  {
+    if (m_format == OutputFormat::Text)
+    {
+      m_out << "High-level capabilities:\n";
+      if (capabilities.Valid)
+      {
+        MonitorUtils::Print(m_out, capabilities, 2);
+      }
+      else
+      {
+        m_err << "Could not obtain high-level capabililties.\n";
+      }
+      return;
+    }
+    auto& record = BeginRecord("high-level-capabilities", capabilities.Valid);
+    if (capabilities.Valid)
+    {
+      record << std::boolalpha <<
+        ",\"none\":" << capabilities.None <<
+        ",\"brightness\":" << capabilities.Brightness <<
+        ",\"colorTemperature\":" << capabilities.ColorTemperature <<
+        ",\"contrast\":" << capabilities.Contrast <<
+        ",\"degauss\":" << capabilities.Degauss <<
+        ",\"displayAreaPosition\":" << capabilities.DisplayAreaPosition <<
+        ",\"displayAreaSize\":" << capabilities.DisplayAreaSize <<
+        ",\"monitorTechnologyType\":" << capabilities.MonitorTechnologyType <<
+        ",\"redGreenBlueDrive\":" << capabilities.RedGreenBlueDrive <<
+        ",\"redGreenBlueGain\":" << capabilities.RedGreenBlueGain <<
+        ",\"restoreFactoryColorDefaults\":" << capabilities.RestoreFactoryColorDefaults <<
+        ",\"restoreFactoryDefaults\":" << capabilities.RestoreFactoryDefaults <<
+        ",\"restoreFactoryDefaultsEnablesMonitorSettings\":" << capabilities.RestoreFactoryDefaultsEnablesMonitorSettings <<
+        std::noboolalpha;
+    }
+    EndRecord();
+  }
+
+  // error is the error code of the failed request when the capabilities are
+  // not valid.
+  void Capabilities(MonitorUtils::LowLevelCapabilities const& capabilities, uint32_t error)
+  {
+    if (m_format == OutputFormat::Text)
+    {
+      m_out << "Low-level capabilities" << (capabilities.Cached ? " (cached)" : "") << ":\n";
+      if (capabilities.Valid)
+      {
+        MonitorUtils::Print(m_out, capabilities.Tree, capabilities.Tree.Root(), 2);
+      }
+      else
+      {
+        m_err << "Could not obtain low-level capabilities.\n";
+        WriteErrorText(m_out, error);
+      }
+      return;
+    }
+    auto& record = BeginRecord("capabilities", capabilities.Valid);
+    if (capabilities.Valid)
+    {
+      record << ",\"cached\":" << (capabilities.Cached ? "true" : "false") << ",\"tree\":";
+      WriteTreeJson(record, capabilities.Tree, capabilities.Tree.Root());
+    }
+    else
+    {
+      WriteErrorJson(record, error);
+    }
+    EndRecord();
+  }
+
+  // error is the error code of the read when it failed.
+  void VCPFeature(uint8_t code, VCPFeatureResult const& result, uint32_t error)
+  {
+    if (m_format == OutputFormat::Text)
+    {
+      if (result.Success)
+      {
+        m_out << "VCP feature " << DescribeVCPCode(code) << " = " << DescribeVCPValue(code, result.CurrentValue) << '\n';
+      }
+      else
+      {
+        m_err << "Failed to read VCP feature " << DescribeVCPCode(code) << '\n';
+      }
+      return;
+    }
+    auto& record = BeginRecord("get", result.Success);
+    WriteCodeJson(record, code);
+    if (result.Success)
+    {
+      WriteValueJson(record, "value", code, result.CurrentValue);
+      record << ",\"max\":" << result.MaxValue;
+    }
+    else
+    {
+      WriteErrorJson(record, error);
+    }
+    EndRecord();
+  }
+
+  // verification is null when the write failed or was not verified.
+  void SetVCPFeature(uint8_t code, uint32_t value, bool written, Verification const* verification)
+  {
+    const auto readBack = verification && verification->Result.Success;
+    const auto matches = readBack && verification->Result.CurrentValue == value;
+    if (m_format == OutputFormat::Text)
+    {
+      if (!written)
+      {
+        m_err << "Failure - failed to set value\n";
+        return;
+      }
+      m_out << "Setting VCP feature " << DescribeVCPCode(code) << " = " << DescribeVCPValue(code, value) << '\n';
+      if (!verification || matches)
+      {
+        m_out << "Success\n";
+      }
+      else if (!readBack)
+      {
+        m_err << "Failed to verify - read-back failed.\n";
+        return;
+      }
+      else
+      {
+        m_err << "Failed to verify - expected " << DescribeVCPValue(code, value) << ", but got " <<
+          DescribeVCPValue(code, verification->Result.CurrentValue) << '\n';
+      }
+      if (verification)
+      {
+        WriteVerificationText(*verification);
+      }
+      return;
+    }
+    auto& record = BeginRecord("set", written && (!verification || matches));
+    WriteCodeJson(record, code);
+    WriteValueJson(record, "value", code, value);
+    if (verification)
+    {
+      WriteVerificationJson(record, code, *verification);
+    }
+    EndRecord();
+  }
+
+  // error is the error code of the read or write that failed. verification is
+  // null unless the ramp ran to its end and was verified.
+  void Ramp(uint8_t code, RampResult const& ramp, Verification const* verification, uint32_t error)
+  {
+    const auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(ramp.Elapsed).count();
+    const auto matches = !verification || (verification->Result.Success && verification->Result.CurrentValue == ramp.To);
+    if (m_format == OutputFormat::Text)
+    {
+      if (!ramp.Success)
+      {
+        m_err << "Failed to ramp VCP feature " << DescribeVCPCode(code) << '\n';
+        WriteErrorText(m_err, error);
+        return;
+      }
+      m_out << (ramp.Superseded ? "Superseded by a later ramp: " : "") << "Ramped VCP feature " << DescribeVCPCode(code) << " from " <<
+        DescribeVCPValue(code, ramp.From) << (ramp.Superseded ? " towards " : " to ") << DescribeVCPValue(code, ramp.To) << std::dec << " in " <<
+        ramp.Steps << (ramp.Steps == 1 ? " step" : " steps") << " (" << milliseconds << " ms)\n";
+      if (verification)
+      {
+        if (!matches)
+        {
+          m_err << "Failed to verify - expected " << DescribeVCPValue(code, ramp.To) << (verification->Result.Success ? "" : ", but the read-back failed") << '\n';
+        }
+        WriteVerificationText(*verification);
+      }
+      return;
+    }
+    auto& record = BeginRecord("ramp", ramp.Success && matches);
+    WriteCodeJson(record, code);
+    if (ramp.Success)
+    {
+      WriteValueJson(record, "from", code, ramp.From);
+      WriteValueJson(record, "to", code, ramp.To);
+      record << ",\"max\":" << ramp.MaxValue << ",\"steps\":" << ramp.Steps << ",\"superseded\":" << (ramp.Superseded ? "true" : "false") <<
+        ",\"ms\":" << milliseconds;
+    }
+    else
+    {
+      WriteErrorJson(record, error);
+    }
+    if (verification)
+    {
+      WriteVerificationJson(record, code, *verification);
+    }
+    EndRecord();
+  }
+
+  void Toggle(bool success, Verification const* verification)
+  {
+    if (m_format == OutputFormat::Text)
+    {
+      if (!success)
+      {
+        m_err << "Failed to toggle input source\n";
+        return;
+      }
+      m_out << "Successfully toggled input source\n";
+      if (verification)
+      {
+        WriteVerificationText(*verification);
+      }
+      return;
+    }
+    auto& record = BeginRecord("toggle", success);
+    if (success && verification)
+    {
+      WriteVerificationJson(record, InputSourceCode, *verification);
+    }
+    EndRecord();
+  }
+
+  void Stats(SchedulerStats const& stats)
+  {
+    const std::chrono::duration<double, std::milli> totalWait{ stats.TotalWait };
+    const std::chrono::duration<double, std::milli> maxWait{ stats.MaxWait };
+    const auto averageWait = stats.Commands > 0 ? totalWait.count() / static_cast<double>(stats.Commands) : 0.0;
+    if (m_format == OutputFormat::Text)
+    {
+      m_out << std::dec << "Bus: " << stats.Commands << " commands, " << stats.MergedReads << " merged reads, " <<
+        "max queue depth " << stats.MaxQueueDepth << ", wait " << averageWait << " ms average, " << maxWait.count() << " ms max\n";
+      return;
+    }
+    auto& record = BeginRecord("stats", true);
+    record << ",\"commands\":" << stats.Commands << ",\"mergedReads\":" << stats.MergedReads << ",\"maxQueueDepth\":" << stats.MaxQueueDepth <<
+      std::fixed << std::setprecision(3) << ",\"averageWaitMs\":" << averageWait << ",\"maxWaitMs\":" << maxWait.count();
+    EndRecord();
+  }
+
+  void BeginPlan()
+  {
+    if (m_format == OutputFormat::Text)
+    {
+      m_out << "Plan:\n";
+    }
+  }
+
+  // One step of a plan; transactions is the text form of the reads, writes and
+  // capabilities requests it takes. Steps that cost nothing have no estimate.
+  void PlanStep(
+    std::string const& description,
+    std::string const& transactions,
+    int reads,
+    bool moreReads,
+    int writes,
+    int capabilitiesRequests,
+    std::chrono::milliseconds cost)
+  {
+    if (m_format == OutputFormat::Text)
+    {
+      m_out << "  ";
+      if (cost.count() > 0)
+      {
+        m_out << std::left << std::setw(56) << description << " " << std::setw(24) << transactions << std::right <<
+          std::dec << "~" << cost.count() << " ms";
+      }
+      else
+      {
+        m_out << description;
+      }
+      m_out << '\n';
+      return;
+    }
+    auto& record = BeginRecord("plan-step", true);
+    record << ",\"description\":";
+    WriteJsonString(record, description);
+    record << ",\"reads\":" << reads << (moreReads ? ",\"moreReads\":true" : "") << ",\"writes\":" << writes <<
+      ",\"capabilitiesRequests\":" << capabilitiesRequests << ",\"estimatedMs\":" << cost.count();
+    EndRecord();
+  }
+
+  // open is set when a step may take more transactions than estimated.
+  void EndPlan(std::chrono::milliseconds cost, bool open)
+  {
+    if (m_format == OutputFormat::Text)
+    {
+      m_out << "Estimated bus time: ~" << std::dec << cost.count() << " ms" << (open ? " or more" : "") << '\n';
+      return;
+    }
+    auto& record = BeginRecord("plan", true);
+    record << ",\"estimatedMs\":" << cost.count() << ",\"open\":" << (open ? "true" : "false");
+    EndRecord();
+  }
+
+  // A failure that is not the result of a read or write, e.g. a refused
+  // operation.
+  void Error(std::string const& message)
+  {
+    if (m_format == OutputFormat::Text)
+    {
+      m_err << message << '\n';
+      return;
+    }
+    auto& record = BeginRecord("error", false);
+    record << ",\"message\":";
+    WriteJsonString(record, message);
+    EndRecord();
+  }
+
+  // The text output and errors as they would be printed.
+  std::string Text() const
+  {
+    return m_out.str();
+  }
+
+  std::string Errors() const
+  {
+    return m_err.str();
+  }
+
+  // The monitor as a member of a JSON document's "monitors" array.
+  void WriteJson(std::ostream& out) const
+  {
+    out << "{\"index\":" << std::dec << m_index << ",\"results\":[";
+    for (size_t i = 0; i < m_records.size(); ++i)
+    {
+      out << (i > 0 ? ",\n" : "\n") << m_records[i];
+    }
+    out << "]}";
+  }
+
+  // One line per result, each with the monitor's index in front.
+  void WriteNdjson(std::ostream& out) const
+  {
+    for (const auto& record : m_records)
+    {
+      out << "{\"monitor\":" << std::dec << m_index << "," << std::string_view{ record }.substr(1) << '\n';
+    }
+  }
+
+private:
+
+  std::ostringstream& BeginRecord(char const* type, bool success)
+  {
+    m_record.str({});
+    m_record.clear();
+    m_record << std::dec << "{\"type\":\"" << type << "\",\"success\":" << (success ? "true" : "false");
+    return m_record;
+  }
+
+  void EndRecord()
+  {
+    m_record << "}";
+    m_records.push_back(m_record.str());
+  }
+
+  static void WriteCodeJson(std::ostream& record, uint8_t code)
+  {
+    record << ",\"code\":\"0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<uint32_t>(code) << std::setfill(' ') << std::dec << "\"";
+    if (const auto feature = FindVCPFeature(code))
+    {
+      record << ",\"name\":";
+      WriteJsonString(record, feature->Name);
+    }
+  }
+
+  // Writes "key":value, followed by "keyName":"name" where the value is named.
+  static void WriteValueJson(std::ostream& record, char const* key, uint8_t code, uint32_t value)
+  {
+    record << ",\"" << key << "\":" << std::dec << value;
+    const auto feature = FindVCPFeature(code);
+    if (const auto named = feature ? FindVCPValue(*feature, value) : nullptr)
+    {
+      record << ",\"" << key << "Name\":";
+      WriteJsonString(record, named->Name);
+    }
+  }
+
+  static void WriteErrorJson(std::ostream& record, uint32_t error)
+  {
+    record << ",\"error\":" << std::dec << error << ",\"message\":";
+    WriteJsonString(record, GetErrorMessage(error));
+  }
+
+  static void WriteErrorText(std::ostream& out, uint32_t error)
+  {
+    if (error != 0)
+    {
+      out << "Error [" << std::dec << error << "] " << GetErrorMessage(error) << '\n';
+    }
+    else
+    {
+      out << "No error\n";
+    }
+  }
+
+  void WriteVerificationText(Verification const& verification)
+  {
+    m_out << std::dec << "Read back after " << std::chrono::duration_cast<std::chrono::milliseconds>(verification.Elapsed).count() << " ms and " <<
+      verification.Reads << (verification.Reads == 1 ? " read" : " reads") << '\n';
+  }
+
+  static void WriteVerificationJson(std::ostream& record, uint8_t code, Verification const& verification)
+  {
+    record << ",\"verification\":{\"readBack\":" << (verification.Result.Success ? "true" : "false");
+    if (verification.Result.Success)
+    {
+      WriteValueJson(record, "value", code, verification.Result.CurrentValue);
+    }
+    record << ",\"reads\":" << verification.Reads << ",\"ms\":" <<
+      std::chrono::duration_cast<std::chrono::milliseconds>(verification.Elapsed).count() << "}";
+  }
+
+  // A code node is {"code":"0x10"}, any other node {"text":"vcp"}, either with
+  // "children" when it has any.
+  static void WriteTreeJson(std::ostream& out, CapabilityTree const& tree, uint32_t index)
+  {
+    if (tree.IsCode(index))
+    {
+      out << "{\"code\":\"0x" << std::hex << std::setw(2) << std::setfill('0') << tree.Code(index) << std::setfill(' ') << std::dec << "\"";
+    }
+    else
+    {
+      out << "{\"text\":";
+      WriteJsonString(out, tree.Text(index));
+    }
+    if (tree.FirstChild(index) != CapabilityTree::InvalidIndex)
+    {
+      out << ",\"children\":[";
+      for (auto child = tree.FirstChild(index); child != CapabilityTree::InvalidIndex; child = tree.NextSibling(child))
+      {
+        out << (child != tree.FirstChild(index) ? "," : "");
+        WriteTreeJson(out, tree, child);
+      }
+      out << "]";
+    }
+    out << "}";
+  }
+
+  OutputFormat m_format;
+  int m_index;
+  std::ostringstream m_out;
+  std::ostringstream m_err;
+  std::ostringstream m_record;
+  std::vector<std::string> m_records;
+};
+
+// Writes the results of one command, a monitor at a time. As text, several
+// monitors each get a heading; as JSON, the monitors form one document.
+inline void WriteResults(std::ostream& out, std::ostream& err, std::vector<ResultWriter const*> const& writers)
+{
+  if (writers.empty())
+  {
+    return;
+  }
+  switch (writers.front()->Format())
+  {
+  case OutputFormat::Text:
+    // Each monitor's errors follow its output.
+    for (const auto writer : writers)
+    {
+      if (writers.size() > 1)
+      {
+        out << "Monitor " << std::dec << writer->Index() << ":\n";
+      }
+      out << writer->Text();
+      err << writer->Errors();
+    }
+    break;
+  case OutputFormat::Json:
+  {
+    std::ostringstream document;
+    document << "{\"monitors\":[";
+    for (size_t i = 0; i < writers.size(); ++i)
+    {
+      document << (i > 0 ? ",\n" : "\n");
+      writers[i]->WriteJson(document);
+    }
+    document << "\n]}\n";
+    out << document.str();
+    break;
+  }
+  case OutputFormat::Ndjson:
+  {
+    std::ostringstream lines;
+    for (const auto writer : writers)
+    {
+      writer->WriteNdjson(lines);
+    }
+    out << lines.str();
+    break;
+  }
+  }
+}
@@ -0,0 +1,98 @@
+// platform.h : Small portability helpers.
+//
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+
+// Returns the value of an environment variable, or an empty string if unset.
+inline std::string GetEnvironmentString(char const* name)
+{
+#ifdef _WIN32
+  char* value = nullptr;
+  size_t length = 0;
+  std::string result;
+  if (_dupenv_s(&value, &length, name) == 0 && value)
+  {
+    result = value;
+  }
+  free(value);
+  return result;
+#else
+  const auto value = std::getenv(name);
+  return value ? value : "";
+#endif
+}
+
+// The operating system's ID for this process.
+inline uint32_t GetCurrentProcessNumber()
+{
+#ifdef _WIN32
+  return GetCurrentProcessId();
+#else
+  return static_cast<uint32_t>(getpid());
+#endif
+}
+
+// The error code of the last failed system call on this thread: GetLastError()
+// on Windows, errno elsewhere. Lets work done on one thread report its error on
+// another.
+inline uint32_t GetLastErrorCode()
+{
+#ifdef _WIN32
+  return GetLastError();
+#else
+  return static_cast<uint32_t>(errno);
+#endif
+}
+
+// The error code for an operation the platform or device cannot do.
+#ifdef _WIN32
+constexpr uint32_t NotSupportedErrorCode = ERROR_NOT_SUPPORTED;
+#else
+constexpr uint32_t NotSupportedErrorCode = ENOTSUP;
+#endif
+
+inline void SetLastErrorCode(uint32_t code)
+{
+#ifdef _WIN32
+  SetLastError(code);
+#else
+  errno = static_cast<int>(code);
+#endif
+}
+
+// The system's description of an error code from GetLastErrorCode().
+inline std::string GetErrorMessage(uint32_t code)
+{
+#ifdef _WIN32
+  LPSTR buffer = nullptr;
+  const auto size = FormatMessageA(
+    FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+    NULL,
+    code,
+    MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+    reinterpret_cast<LPSTR>(&buffer),
+    0,
+    NULL);
+  std::string message{ buffer ? buffer : "", static_cast<size_t>(size) };
+  LocalFree(buffer);
+  while (!message.empty() && (message.back() == '\n' || message.back() == '\r'))
+  {
+    message.pop_back();
+  }
+  return message;
+#else
+  return std::strerror(static_cast<int>(code));
+#endif
+}
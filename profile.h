@@ -0,0 +1,329 @@
+// profile.h : Saved monitor settings, and restoring them with as few writes as possible.
+//
+#pragma once
+
+#include "capabilities_cache.h"
+#include "edid.h"
+#include "monitor_operations.h"
+#include "monitor_utils.h"
+#include "trace.h"
+#include "vcp_features.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+struct ProfileSetting
+{
+  uint8_t Code;
+  uint32_t Value;
+};
+
+struct MonitorProfile
+{
+  int Index{ 0 };
+  MonitorIdentity Identity;
+  std::vector<ProfileSetting> Settings;
+};
+
+// Profiles cover the read-write features of the MCCS table, except those that
+// are not settings: the new-control-value handshake, the controller type, and
+// the power mode, which would switch the monitor off on restore.
+inline bool IsProfileCode(uint8_t code)
+{
+  const auto feature = FindVCPFeature(code);
+  return feature && feature->Access == VCPAccess::ReadWrite &&
+    code != VCPCode("new-control-value") && code != VCPCode("display-controller-type") && code != VCPCode("power-mode");
+}
+
+// Settings are restored in stages, each read just before it is written, so a
+// write that changes other settings is seen by the later stages: display mode
+// and color preset first, since they load color values of their own, then the
+// color values, then everything else, and the input source last because a
+// monitor may stop answering on this bus once it switches away.
+inline int RestoreStage(uint8_t code)
+{
+  if (code == VCPCode("display-mode"))
+  {
+    return 0;
+  }
+  if (code == VCPCode("color-preset"))
+  {
+    return 1;
+  }
+  if (code == VCPCode("color-temperature-request") || code == VCPCode("red-gain") || code == VCPCode("green-gain") || code == VCPCode("blue-gain") ||
+    code == VCPCode("red-black-level") || code == VCPCode("green-black-level") || code == VCPCode("blue-black-level"))
+  {
+    return 2;
+  }
+  if (code == InputSourceCode)
+  {
+    return 4;
+  }
+  return 3;
+}
+
+// Reads the monitor's current settings. Only codes its capabilities list are
+// read when the capabilities can be had.
+inline MonitorProfile CaptureProfile(int index, MonitorUtils::Monitor const& monitor, CapabilitiesCache* cache)
+{
+  TraceSpan span{ "operation", "Capture profile", "index", static_cast<uint32_t>(index) };
+  MonitorProfile profile{};
+  profile.Index = index;
+  profile.Identity = MonitorUtils::GetMonitorIdentity(monitor);
+
+  const auto capabilities = MonitorUtils::GetLowLevelCapabilities(monitor, cache, "vcp");
+  const auto advertised = capabilities.Index();
+  std::vector<uint8_t> codes;
+  for (auto code = 0; code < 256; ++code)
+  {
+    if (IsProfileCode(static_cast<uint8_t>(code)) && (!advertised.Valid() || advertised.Supports(static_cast<uint8_t>(code))))
+    {
+      codes.push_back(static_cast<uint8_t>(code));
+    }
+  }
+  for (const auto& feature : MonitorUtils::GetVCPFeatures(monitor, codes))
+  {
+    if (feature.Result.Success && feature.Result.CodeType == VCPCodeType::SetParameter)
+    {
+      profile.Settings.push_back({ feature.Code, feature.Result.CurrentValue });
+    }
+  }
+  return profile;
+}
+
+// Writes only the settings that differ from the profile, stage by stage (see
+// RestoreStage()). Verifies each write if a policy is given. Progress goes to
+// out, failures to err.
+inline bool RestoreProfile(
+  MonitorUtils::Monitor const& monitor,
+  MonitorProfile const& profile,
+  VerifyPolicy const* verify,
+  std::ostream& out,
+  std::ostream& err)
+{
+  TraceSpan span{ "operation", "Restore profile", "index", static_cast<uint32_t>(profile.Index) };
+  auto settings = profile.Settings;
+  std::stable_sort(settings.begin(), settings.end(), [](ProfileSetting const& a, ProfileSetting const& b)
+  {
+    return RestoreStage(a.Code) < RestoreStage(b.Code);
+  });
+
+  auto success = true;
+  size_t writes = 0;
+  for (auto stageBegin = settings.begin(); stageBegin != settings.end();)
+  {
+    const auto stage = RestoreStage(stageBegin->Code);
+    const auto stageEnd = std::find_if(stageBegin, settings.end(), [&](ProfileSetting const& setting) { return RestoreStage(setting.Code) != stage; });
+    std::vector<uint8_t> codes;
+    for (auto setting = stageBegin; setting != stageEnd; ++setting)
+    {
+      codes.push_back(setting->Code);
+    }
+
+    // A code that cannot be read is written anyway.
+    const auto current = MonitorUtils::GetVCPFeatures(monitor, codes);
+    for (size_t i = 0; i < codes.size(); ++i)
+    {
+      const auto& setting = stageBegin[static_cast<std::ptrdiff_t>(i)];
+      if (current[i].Result.Success && current[i].Result.CurrentValue == setting.Value)
+      {
+        continue;
+      }
+      ++writes;
+      if (!MonitorUtils::SetVCPFeature(monitor, setting.Code, setting.Value))
+      {
+        err << "Failed to set VCP feature " << DescribeVCPCode(setting.Code) << '\n';
+        success = false;
+        continue;
+      }
+      out << "Setting VCP feature " << DescribeVCPCode(setting.Code) << " = " << DescribeVCPValue(setting.Code, setting.Value) << '\n';
+      if (verify)
+      {
+        const auto verification = Verify(monitor, setting.Code, setting.Value, *verify);
+        if (!verification.Converged)
+        {
+          err << "Failed to verify VCP feature " << DescribeVCPCode(setting.Code) << '\n';
+          success = false;
+        }
+      }
+    }
+    stageBegin = stageEnd;
+  }
+  out << std::dec << writes << " of " << settings.size() << " settings differed\n";
+  return success;
+}
+
+// Text file with one "monitor INDEX [IDENTITY]" line per monitor, followed by
+// one "FEATURE VALUE" line per setting, by name where the MCCS table has one:
+//
+//   monitor 0 DEL-40B6-0001E240
+//   brightness 50
+//   input-source hdmi1
+class ProfileFile
+{
+public:
+  static bool Write(std::string const& path, std::vector<MonitorProfile> const& profiles)
+  {
+    std::ofstream file{ path, std::ios::trunc };
+    file << "# monitor_util profile\n";
+    for (const auto& profile : profiles)
+    {
+      file << std::dec << "monitor " << profile.Index;
+      if (profile.Identity.Valid())
+      {
+        file << " " << profile.Identity.ToString();
+      }
+      file << '\n';
+      for (const auto& setting : profile.Settings)
+      {
+        const auto feature = FindVCPFeature(setting.Code);
+        const auto value = feature ? FindVCPValue(*feature, setting.Value) : nullptr;
+        if (feature)
+        {
+          file << feature->Name;
+        }
+        else
+        {
+          file << "0x" << std::hex << static_cast<uint32_t>(setting.Code);
+        }
+        if (value)
+        {
+          file << " " << value->Name << '\n';
+        }
+        else if (feature && feature->Continuous)
+        {
+          file << " " << std::dec << setting.Value << '\n';
+        }
+        else
+        {
+          file << " 0x" << std::hex << setting.Value << '\n';
+        }
+      }
+    }
+    return static_cast<bool>(file);
+  }
+
+  static bool Read(std::string const& path, std::vector<MonitorProfile>* profiles, std::string* error)
+  {
+    std::ifstream file{ path };
+    if (!file)
+    {
+      *error = "Cannot open " + path;
+      return false;
+    }
+
+    std::vector<MonitorProfile> result;
+    std::string line;
+    for (auto lineNumber = 1; std::getline(file, line); ++lineNumber)
+    {
+      const auto comment = line.find('#');
+      if (comment != std::string::npos)
+      {
+        line.erase(comment);
+      }
+      std::istringstream words{ line };
+      std::string key;
+      if (!(words >> key))
+      {
+        continue;
+      }
+
+      auto valid = true;
+      std::string value;
+      if (key == "monitor")
+      {
+        MonitorProfile profile{};
+        std::string identity;
+        valid = (words >> value) && ParseNumber(value, &profile.Index) && (!(words >> identity) || ParseIdentity(identity, &profile.Identity));
+        result.push_back(profile);
+      }
+      else
+      {
+        ProfileSetting setting{};
+        words >> value;
+        const auto feature = FindVCPFeature(key);
+        const auto named = feature ? FindVCPValue(*feature, value) : nullptr;
+        uint32_t code = 0;
+        valid = !result.empty() && !value.empty() && (feature || ParseNumber(key, &code)) && code <= 0xFF &&
+          (named || ParseNumber(value, &setting.Value)) && setting.Value <= 0xFFFF;
+        setting.Code = feature ? feature->Code : static_cast<uint8_t>(code);
+        setting.Value = named ? named->Value : setting.Value;
+        if (valid)
+        {
+          result.back().Settings.push_back(setting);
+        }
+      }
+
+      if (!valid)
+      {
+        *error = path + ":" + std::to_string(lineNumber) + ": cannot parse \"" + line + "\"";
+        return false;
+      }
+    }
+    *profiles = std::move(result);
+    return true;
+  }
+
+private:
+
+  // Decimal, or hex with a 0x prefix. strtoul() would take a sign or leading
+  // space, and wraps "-1" around, so the digits are checked first.
+  template<typename T>
+  static bool ParseNumber(std::string const& text, T* out)
+  {
+    const auto hex = text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X');
+    const auto digits = text.c_str() + (hex ? 2 : 0);
+    if (!(hex ? std::isxdigit(static_cast<unsigned char>(*digits)) : std::isdigit(static_cast<unsigned char>(*digits))))
+    {
+      return false;
+    }
+    char* end = nullptr;
+    errno = 0;
+    const auto value = std::strtoul(digits, &end, hex ? 16 : 10);
+    if (*end != '\0' || errno == ERANGE || value > static_cast<unsigned long>((std::numeric_limits<T>::max)()))
+    {
+      return false;
+    }
+    *out = static_cast<T>(value);
+    return true;
+  }
+
+  // MonitorIdentity::ToString() form, e.g. DEL-40B6-0001E240.
+  static bool ParseIdentity(std::string const& text, MonitorIdentity* identity)
+  {
+    if (text.size() < 5 || text[3] != '-')
+    {
+      return false;
+    }
+    const auto separator = text.find('-', 4);
+    if (separator == std::string::npos)
+    {
+      return false;
+    }
+    char* end = nullptr;
+    identity->Product = static_cast<uint16_t>(std::strtoul(text.substr(4, separator - 4).c_str(), &end, 16));
+    if (*end != '\0')
+    {
+      return false;
+    }
+    identity->Serial = static_cast<uint32_t>(std::strtoul(text.c_str() + separator + 1, &end, 16));
+    if (*end != '\0' || separator + 1 == text.size())
+    {
+      return false;
+    }
+    std::memcpy(identity->Manufacturer, text.c_str(), 3);
+    identity->Manufacturer[3] = '\0';
+    return true;
+  }
+};
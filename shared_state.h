@@ -0,0 +1,421 @@
+// shared_state.h : Last-known VCP values and per-bus locks shared by every monitor_util process.
+//
+#pragma once
+
+#include "lockable_file.h"
+#include "monitor_backend.h"
+#include "platform.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+
+
+class SharedMonitorState;
+
+// A small file that every monitor_util process maps, so that processes
+// started at the same moment (e.g. by several hotkeys) take turns on each
+// DDC/CI bus and can answer reads from each other's results. It holds a slot
+// per monitor, keyed by its bus name (MonitorInfo::Name), with the last value
+// read for each VCP code and when it was read. Every slot has a bus lock, the
+// byte at FileSize + 1 + slot, and an owner lock, the byte after all the bus
+// locks, which every process attached to the slot holds shared for as long as
+// it is attached. The slot table is guarded by the byte at FileSize.
+//
+// Bus names come and go (monitors are replugged, and buses renumbered), so
+// once every slot is taken, one that no process is attached to any more is
+// cleared and given to the new monitor.
+//
+// Values are written only by the holder of their slot's lock, and read
+// without it: each carries a sequence number that is odd during a write, so a
+// reader that races with a write tries again.
+//
+// File layout (native byte order):
+//   FileHeader
+//   Slot[SlotCount]
+class SharedState : public std::enable_shared_from_this<SharedState>
+{
+public:
+  static std::string DefaultPath()
+  {
+#ifdef _WIN32
+    return (std::filesystem::path{ GetEnvironmentString("LOCALAPPDATA") } / "monitor_util" / "state").string();
+#else
+    const auto runtimeDirectory = GetEnvironmentString("XDG_RUNTIME_DIR");
+    if (!runtimeDirectory.empty())
+    {
+      return runtimeDirectory + "/monitor_util.state";
+    }
+    return "/tmp/monitor_util-" + std::to_string(getuid()) + ".state";
+#endif
+  }
+
+  // Returns nullptr if the file cannot be created or mapped, or was written
+  // by an incompatible version; nothing is shared then.
+  static std::shared_ptr<SharedState> Open(std::string const& path)
+  {
+    std::error_code error;
+    const auto directory = std::filesystem::path{ path }.parent_path();
+    if (!directory.empty())
+    {
+      std::filesystem::create_directories(directory, error);
+    }
+    std::shared_ptr<SharedState> state{ new SharedState{ path } };
+    if (!state->m_file.Open(path) || !state->m_file.Lock(TableLockOffset))
+    {
+      return nullptr;
+    }
+    const auto valid = state->Map();
+    state->m_file.Unlock(TableLockOffset);
+    return valid ? state : nullptr;
+  }
+
+  SharedState(SharedState const&) = delete;
+  SharedState& operator=(SharedState const&) = delete;
+
+  ~SharedState()
+  {
+#ifdef _WIN32
+    if (m_data)
+    {
+      UnmapViewOfFile(m_data);
+    }
+    if (m_mapping)
+    {
+      CloseHandle(m_mapping);
+    }
+#else
+    if (m_data)
+    {
+      munmap(m_data, FileSize);
+    }
+#endif
+  }
+
+  // The monitor's slot: the one it had, a free one, or failing that one that
+  // no process is attached to. Returns nullptr, and says so on stderr, if
+  // every slot is in use by other monitors.
+  std::unique_ptr<SharedMonitorState> Attach(std::string const& key);
+
+private:
+  friend class SharedMonitorState;
+
+  static constexpr char Magic[4] = { 'M', 'U', 'S', 'S' };
+  static constexpr uint32_t Version = 3;
+  static constexpr uint32_t SlotCount = 32;
+  static constexpr size_t KeySize = 64;
+
+  struct FileHeader
+  {
+    char Magic[4];
+    uint32_t Version;
+    uint32_t SlotCount;
+    uint32_t Reserved;
+  };
+
+  // Flags
+  static constexpr uint32_t Known = 0x1;
+  static constexpr uint32_t Momentary = 0x2;
+
+  struct Value
+  {
+    std::atomic<uint32_t> Sequence;
+    std::atomic<uint32_t> Flags;
+    std::atomic<uint32_t> CurrentValue;
+    std::atomic<uint32_t> MaxValue;
+    std::atomic<uint32_t> Ramp;       // Counts the ramps of the code begun; only the latest may go on
+    std::atomic<int64_t> ReadAt;      // Milliseconds since the epoch, the same clock in every process
+  };
+
+  struct Slot
+  {
+    char Key[KeySize];                // Empty if unused
+    Value Values[256];
+  };
+
+  static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<int64_t>::is_always_lock_free,
+    "Values are shared between processes, so their atomics must not need a lock of their own");
+
+  static constexpr uint64_t FileSize = sizeof(FileHeader) + SlotCount * sizeof(Slot);
+  static constexpr uint64_t TableLockOffset = FileSize;
+
+  static constexpr uint64_t BusLockOffset(uint32_t slot)
+  {
+    return TableLockOffset + 1 + slot;
+  }
+
+  static constexpr uint64_t OwnerLockOffset(uint32_t slot)
+  {
+    return TableLockOffset + 1 + SlotCount + slot;
+  }
+
+  explicit SharedState(std::string path)
+    : m_path{ std::move(path) }
+  {
+  }
+
+  // Expects the table lock to be held. The slot is free to take over if no
+  // process holds its owner lock.
+  bool IsAbandoned(uint32_t slot)
+  {
+    if (!m_file.TryLock(OwnerLockOffset(slot)))
+    {
+      return false;
+    }
+    m_file.Unlock(OwnerLockOffset(slot));
+    return true;
+  }
+
+  // Expects the table lock to be held. A new file is sized and given a header.
+  bool Map()
+  {
+    const auto size = m_file.Size();
+    if (size == 0 && !m_file.Resize(FileSize))
+    {
+      return false;
+    }
+    if (size != 0 && size != FileSize)
+    {
+      return false;
+    }
+#ifdef _WIN32
+    m_mapping = CreateFileMapping(m_file.Handle(), nullptr, PAGE_READWRITE, 0, 0, nullptr);
+    if (!m_mapping)
+    {
+      return false;
+    }
+    m_data = MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+#else
+    m_data = mmap(nullptr, FileSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_file.Handle(), 0);
+    if (m_data == MAP_FAILED)
+    {
+      m_data = nullptr;
+    }
+#endif
+    if (!m_data)
+    {
+      return false;
+    }
+    const auto header = static_cast<FileHeader*>(m_data);
+    if (size == 0)
+    {
+      std::memcpy(header->Magic, Magic, sizeof Magic);
+      header->Version = Version;
+      header->SlotCount = SlotCount;
+    }
+    return std::memcmp(header->Magic, Magic, sizeof Magic) == 0 && header->Version == Version && header->SlotCount == SlotCount;
+  }
+
+  Slot* Slots() const
+  {
+    return reinterpret_cast<Slot*>(static_cast<uint8_t*>(m_data) + sizeof(FileHeader));
+  }
+
+  std::string m_path;
+  LockableFile m_file;
+#ifdef _WIN32
+  HANDLE m_mapping{ nullptr };
+#endif
+  void* m_data{ nullptr };
+};
+
+// One monitor's slot in the SharedState, with a handle of its own for the
+// slot's lock.
+class SharedMonitorState
+{
+public:
+  SharedMonitorState(std::shared_ptr<SharedState> state, uint32_t slot)
+    : m_state{ std::move(state) }
+    , m_slot{ &m_state->Slots()[slot] }
+    , m_lockOffset{ SharedState::BusLockOffset(slot) }
+    , m_ownerLockOffset{ SharedState::OwnerLockOffset(slot) }
+  {
+  }
+
+  // Holds the slot's owner lock until destroyed, so that the slot is not
+  // taken over meanwhile.
+  bool Open()
+  {
+    return m_lock.Open(m_state->m_path) && m_lock.LockShared(m_ownerLockOffset);
+  }
+
+  // Blocks while another process, or another handle on the same bus in this
+  // one, talks to the monitor.
+  bool Lock()
+  {
+    return m_lock.Lock(m_lockOffset);
+  }
+
+  void Unlock()
+  {
+    m_lock.Unlock(m_lockOffset);
+  }
+
+  // Store() and Forget() expect the lock to be held.
+  void Store(uint8_t code, VCPFeatureResult const& result)
+  {
+    Write(code, SharedState::Known | (result.CodeType == VCPCodeType::Momentary ? SharedState::Momentary : 0), result.CurrentValue, result.MaxValue);
+  }
+
+  void Forget(uint8_t code)
+  {
+    Write(code, 0, 0, 0);
+  }
+
+  // Returns the last value read for the code by any process, unless the code
+  // has been written since or the read is older than maxAge.
+  bool Find(uint8_t code, std::chrono::steady_clock::duration maxAge, VCPFeatureResult* result) const
+  {
+    auto& value = m_slot->Values[code];
+    for (auto attempt = 0; attempt < MaxReadAttempts; ++attempt)
+    {
+      const auto sequence = value.Sequence.load();
+      if (sequence % 2 != 0)
+      {
+        continue;
+      }
+      const auto flags = value.Flags.load();
+      const auto currentValue = value.CurrentValue.load();
+      const auto maxValue = value.MaxValue.load();
+      const auto readAt = value.ReadAt.load();
+      if (value.Sequence.load() != sequence)
+      {
+        continue;
+      }
+      // A read from the future means the clock was set back; it is not trusted.
+      const auto age = std::chrono::milliseconds{ Now() - readAt };
+      if ((flags & SharedState::Known) == 0 || age.count() < 0 || age > maxAge)
+      {
+        return false;
+      }
+      result->Success = true;
+      result->CodeType = (flags & SharedState::Momentary) != 0 ? VCPCodeType::Momentary : VCPCodeType::SetParameter;
+      result->CurrentValue = currentValue;
+      result->MaxValue = maxValue;
+      return true;
+    }
+    // Still being written, or a writer died halfway through: not known.
+    return false;
+  }
+
+  // Ramps of a code supersede each other, across processes: the ticket
+  // BeginRamp() returns stops being current once a later ramp has begun.
+  uint32_t BeginRamp(uint8_t code)
+  {
+    return m_slot->Values[code].Ramp.fetch_add(1) + 1;
+  }
+
+  bool IsCurrentRamp(uint8_t code, uint32_t ticket) const
+  {
+    return m_slot->Values[code].Ramp.load() == ticket;
+  }
+
+private:
+  // Writes take a few stores under the bus lock, so a reader that keeps
+  // seeing one in progress is looking at a writer that will not finish.
+  static constexpr int MaxReadAttempts = 100;
+
+  static int64_t Now()
+  {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  void Write(uint8_t code, uint32_t flags, uint32_t currentValue, uint32_t maxValue)
+  {
+    auto& value = m_slot->Values[code];
+    // A writer that died halfway through left the sequence odd; carry on from there.
+    const auto sequence = value.Sequence.load() | 1u;
+    value.Sequence.store(sequence);
+    value.Flags.store(flags);
+    value.CurrentValue.store(currentValue);
+    value.MaxValue.store(maxValue);
+    value.ReadAt.store(Now());
+    value.Sequence.store(sequence + 1);
+  }
+
+  std::shared_ptr<SharedState> m_state;
+  SharedState::Slot* m_slot;
+  uint64_t m_lockOffset;
+  uint64_t m_ownerLockOffset;
+  LockableFile m_lock;
+};
+
+inline std::unique_ptr<SharedMonitorState> SharedState::Attach(std::string const& key)
+{
+  if (key.empty() || key.size() >= KeySize || !m_file.Lock(TableLockOffset))
+  {
+    return nullptr;
+  }
+  // The monitor's own slot first, so its values survive, then a free one,
+  // then one left behind by a monitor that no process uses now.
+  auto found = SlotCount;
+  for (uint32_t i = 0; i < SlotCount && found == SlotCount; ++i)
+  {
+    if (std::strncmp(Slots()[i].Key, key.c_str(), KeySize) == 0)
+    {
+      found = i;
+    }
+  }
+  for (uint32_t i = 0; i < SlotCount && found == SlotCount; ++i)
+  {
+    if (Slots()[i].Key[0] == '\0')
+    {
+      found = i;
+    }
+  }
+  for (uint32_t i = 0; i < SlotCount && found == SlotCount; ++i)
+  {
+    if (IsAbandoned(i))
+    {
+      found = i;
+    }
+  }
+
+  std::unique_ptr<SharedMonitorState> state;
+  if (found != SlotCount)
+  {
+    auto& slot = Slots()[found];
+    if (std::strncmp(slot.Key, key.c_str(), KeySize) != 0)
+    {
+      for (auto& value : slot.Values)
+      {
+        value.Sequence.store(0);
+        value.Flags.store(0);
+        value.CurrentValue.store(0);
+        value.MaxValue.store(0);
+        value.Ramp.store(0);
+        value.ReadAt.store(0);
+      }
+      std::memset(slot.Key, 0, KeySize);
+      std::memcpy(slot.Key, key.c_str(), key.size());
+    }
+    // Taken before the table is unlocked, so no other process can take the
+    // slot over in between.
+    state = std::make_unique<SharedMonitorState>(shared_from_this(), found);
+    if (!state->Open())
+    {
+      state.reset();
+    }
+  }
+  m_file.Unlock(TableLockOffset);
+  if (found == SlotCount)
+  {
+    std::cerr << "All " << SlotCount << " slots of " << m_path << " are in use, so " << key << " does not share its state with other processes" << std::endl;
+  }
+  return state;
+}
@@ -0,0 +1,514 @@
+// simulated_backend.h : In-process virtual monitors for benchmarking and testing without hardware.
+//
+#pragma once
+
+#include "ddc_ci.h"
+#include "edid.h"
+#include "monitor_backend.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+
+struct SimulatedMonitorConfig
+{
+  struct Feature
+  {
+    uint8_t Code;
+    uint32_t Value;
+    uint32_t MaxValue;
+    VCPCodeType CodeType;
+  };
+
+  struct Table
+  {
+    uint8_t Code;
+    size_t Size;
+  };
+
+  std::string Name{ "Simulated" };
+  MonitorIdentity Identity{ { 'S', 'I', 'M', '\0' }, 0x0001, 0 };
+  std::string Capabilities;
+  std::vector<Feature> Features;
+  std::vector<Table> Tables;             // Zero-filled at start
+  std::chrono::microseconds Latency{ 0 };  // Per DDC/CI transaction
+  std::chrono::microseconds Settle{ 0 };   // Before a written value reads back
+  std::chrono::microseconds CommandGap{ 0 };  // Commands sent sooner after the previous one are NAKed
+  double NakRate{ 0.0 };
+  double ChecksumErrorRate{ 0.0 };
+  uint32_t Seed{ 1 };
+};
+
+// State of one virtual monitor, which answers DDC/CI messages as a display
+// would. Transactions are serialized as they would be on a real bus and each
+// one costs the configured latency.
+class SimulatedMonitor
+{
+public:
+  explicit SimulatedMonitor(SimulatedMonitorConfig config)
+    : m_config{ std::move(config) }
+    , m_random{ m_config.Seed }
+  {
+    for (const auto& feature : m_config.Features)
+    {
+      FeatureState state{};
+      state.Value = feature.Value;
+      state.MaxValue = feature.MaxValue;
+      state.CodeType = feature.CodeType;
+      m_features[feature.Code] = state;
+    }
+    for (const auto& table : m_config.Tables)
+    {
+      m_tables[table.Code].assign(table.Size, 0);
+    }
+  }
+
+  SimulatedMonitorConfig const& Config() const
+  {
+    return m_config;
+  }
+
+  // One request and, for commands that have one, its reply (Size 0 if not).
+  // Returns false, with errno set, if the request is NAKed: it came too soon
+  // after the previous one, did not decode, or drew an injected NAK. An
+  // injected checksum error corrupts the reply instead, or NAKs a command
+  // without one.
+  bool Transfer(DdcCiMessage const& request, DdcCiMessage* reply)
+  {
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    reply->Size = 0;
+    DdcCiBytes payload{};
+    const auto decoded = DecodeDdcCiRequest(request.Bytes, request.Size, &payload) == DdcCiStatus::Ok;
+
+    // The next fragment of a capabilities string follows the reply delay of
+    // the previous one, which the latency already covers.
+    const auto continuation = decoded && payload.Size == 3 && payload.Data[0] == DdcCiCapabilitiesRequest &&
+      m_capabilitiesOffset > 0 && static_cast<size_t>((payload.Data[1] << 8) | payload.Data[2]) == m_capabilitiesOffset;
+    const auto tooSoon = !continuation && std::chrono::steady_clock::now() < m_readyAt;
+    auto corrupt = false;
+    const auto success = !tooSoon && Exchange(&corrupt) && decoded && Respond(payload, reply) && !(corrupt && reply->Size == 0);
+    m_readyAt = std::chrono::steady_clock::now() + m_config.CommandGap;
+    if (!success)
+    {
+      reply->Size = 0;
+      errno = EIO;
+      return false;
+    }
+    if (corrupt)
+    {
+      reply->Bytes[reply->Size - 1] ^= 0xFF;
+    }
+    return true;
+  }
+
+private:
+
+  struct FeatureState
+  {
+    uint32_t Value;
+    uint32_t MaxValue;
+    VCPCodeType CodeType;
+    bool Pending;
+    uint32_t PendingValue;
+    std::chrono::steady_clock::time_point PendingReadyAt;
+  };
+
+  // Spends the bus time of one transaction and rolls for injected faults.
+  bool Exchange(bool* corrupt)
+  {
+    std::uniform_real_distribution<double> distribution{ 0.0, 1.0 };
+    if (m_config.Latency.count() > 0)
+    {
+      std::this_thread::sleep_for(m_config.Latency);
+    }
+    if (m_config.NakRate > 0.0 && distribution(m_random) < m_config.NakRate)
+    {
+      return false;
+    }
+    *corrupt = m_config.ChecksumErrorRate > 0.0 && distribution(m_random) < m_config.ChecksumErrorRate;
+    return true;
+  }
+
+  // Carries out a decoded request. Writes to unknown codes, table reads and
+  // writes of unknown tables, table writes past the end, and unknown commands
+  // are NAKed; reads of unknown codes get an unsupported reply.
+  bool Respond(DdcCiBytes const& request, DdcCiMessage* reply)
+  {
+    const auto opcode = request.Data[0];
+    if (opcode == DdcCiGetVCPRequest && request.Size == 2)
+    {
+      VCPFeatureResult result{};
+      const auto feature = m_features.find(request.Data[1]);
+      if (feature != m_features.end())
+      {
+        auto& state = feature->second;
+        if (state.Pending && std::chrono::steady_clock::now() >= state.PendingReadyAt)
+        {
+          state.Value = state.PendingValue;
+          state.Pending = false;
+        }
+        result.Success = true;
+        result.CodeType = state.CodeType;
+        result.CurrentValue = state.Value;
+        result.MaxValue = state.MaxValue;
+      }
+      *reply = EncodeGetVCPReply(request.Data[1], result);
+      return true;
+    }
+    if (opcode == DdcCiSetVCPRequest && request.Size == 4)
+    {
+      const auto feature = m_features.find(request.Data[1]);
+      if (feature == m_features.end())
+      {
+        return false;
+      }
+      auto& state = feature->second;
+      state.Pending = true;
+      state.PendingValue = static_cast<uint32_t>((request.Data[2] << 8) | request.Data[3]);
+      state.PendingReadyAt = std::chrono::steady_clock::now() + m_config.Settle;
+      return true;
+    }
+    if (opcode == DdcCiCapabilitiesRequest && request.Size == 3)
+    {
+      const size_t offset = static_cast<size_t>((request.Data[1] << 8) | request.Data[2]);
+      const auto& capabilities = m_config.Capabilities;
+      const auto size = offset < capabilities.size() ? (std::min)(capabilities.size() - offset, DdcCiMaxFragmentSize) : 0;
+      *reply = EncodeCapabilitiesReply(static_cast<uint16_t>(offset), reinterpret_cast<uint8_t const*>(capabilities.data()) + offset, size);
+      m_capabilitiesOffset = size > 0 ? offset + size : 0;
+      return true;
+    }
+    if ((opcode == DdcCiTableReadRequest && request.Size == 4) || (opcode == DdcCiTableWriteRequest && request.Size >= 4))
+    {
+      const auto table = m_tables.find(request.Data[1]);
+      if (table == m_tables.end())
+      {
+        return false;
+      }
+      auto& data = table->second;
+      const size_t offset = static_cast<size_t>((request.Data[2] << 8) | request.Data[3]);
+      if (opcode == DdcCiTableReadRequest)
+      {
+        const auto size = offset < data.size() ? (std::min)(data.size() - offset, DdcCiMaxFragmentSize) : 0;
+        *reply = EncodeTableReadReply(static_cast<uint16_t>(offset), data.data() + offset, size);
+        return true;
+      }
+      const auto size = request.Size - 4;
+      if (offset + size > data.size())
+      {
+        return false;
+      }
+      std::copy(request.Data + 4, request.Data + request.Size, data.begin() + static_cast<std::ptrdiff_t>(offset));
+      return true;
+    }
+    return false;
+  }
+
+  SimulatedMonitorConfig m_config;
+  std::mutex m_mutex;
+  std::mt19937 m_random;
+  std::map<uint8_t, FeatureState> m_features;
+  std::map<uint8_t, std::vector<uint8_t>> m_tables;
+  std::chrono::steady_clock::time_point m_readyAt{};
+  size_t m_capabilitiesOffset{ 0 };  // Where the next fragment of a capabilities read starts
+};
+
+// The host side of the simulated bus: encodes each request, has the monitor
+// answer it, and decodes the reply, the same as the i2c backend does.
+class SimulatedMonitorDevice : public MonitorDevice
+{
+public:
+  SimulatedMonitorDevice(std::shared_ptr<SimulatedMonitor> monitor, bool primary)
+    : m_monitor{ std::move(monitor) }
+    , m_primary{ primary }
+  {
+  }
+
+  MonitorInfo GetInfo() override
+  {
+    MonitorInfo monitorInfo{};
+    monitorInfo.Name = m_monitor->Config().Name;
+    monitorInfo.Primary = m_primary;
+    return monitorInfo;
+  }
+
+  MonitorIdentity GetIdentity() override
+  {
+    return m_monitor->Config().Identity;
+  }
+
+  VCPFeatureResult GetVCPFeature(uint8_t code) override
+  {
+    VCPFeatureResult value{};
+    DdcCiMessage reply{};
+    if (m_monitor->Transfer(EncodeGetVCPRequest(code), &reply) &&
+      DecodeGetVCPReply(reply.Bytes, reply.Size, code, &value) != DdcCiStatus::Ok)
+    {
+      errno = EIO;
+    }
+    return value;
+  }
+
+  bool SetVCPFeature(uint8_t code, uint32_t value) override
+  {
+    DdcCiMessage reply{};
+    return m_monitor->Transfer(EncodeSetVCPRequest(code, value), &reply);
+  }
+
+  bool GetCapabilitiesString(std::string* capabilities) override
+  {
+    capabilities->clear();
+    return ReadCapabilitiesFragments(*this, 0, [capabilities](std::string_view text)
+    {
+      capabilities->append(text.data(), text.size());
+      return true;
+    }) && !capabilities->empty();
+  }
+
+  bool ReadCapabilitiesFragment(uint16_t offset, CapabilitiesFragment* fragment) override
+  {
+    DdcCiMessage reply{};
+    DdcCiBytes data{};
+    if (!m_monitor->Transfer(EncodeCapabilitiesRequest(offset), &reply))
+    {
+      return false;
+    }
+    if (DecodeCapabilitiesReply(reply.Bytes, reply.Size, offset, &data) != DdcCiStatus::Ok)
+    {
+      errno = EIO;
+      return false;
+    }
+    const auto size = (std::min)(data.Size, sizeof fragment->Data);
+    fragment->Offset = offset;
+    fragment->Size = static_cast<uint8_t>(size);
+    std::copy(data.Data, data.Data + size, fragment->Data);
+    return true;
+  }
+
+  bool ReadTableFragment(uint8_t code, uint16_t offset, TableFragment* fragment) override
+  {
+    DdcCiMessage reply{};
+    DdcCiBytes data{};
+    if (!m_monitor->Transfer(EncodeTableReadRequest(code, offset), &reply))
+    {
+      return false;
+    }
+    if (DecodeTableReadReply(reply.Bytes, reply.Size, offset, &data) != DdcCiStatus::Ok)
+    {
+      errno = EIO;
+      return false;
+    }
+    const auto size = (std::min)(data.Size, sizeof fragment->Data);
+    fragment->Offset = offset;
+    fragment->Size = static_cast<uint8_t>(size);
+    std::copy(data.Data, data.Data + size, fragment->Data);
+    return true;
+  }
+
+  bool WriteTableFragment(uint8_t code, TableFragment const& fragment) override
+  {
+    DdcCiMessage reply{};
+    return m_monitor->Transfer(EncodeTableWriteRequest(code, fragment.Offset, fragment.Data, fragment.Size), &reply);
+  }
+
+  CommandGaps GetCommandGaps() override
+  {
+    const auto gap = std::chrono::ceil<std::chrono::milliseconds>(m_monitor->Config().CommandGap);
+    return { gap, gap, gap };
+  }
+
+private:
+  std::shared_ptr<SimulatedMonitor> m_monitor;
+  bool m_primary;
+};
+
+// Monitors keep their state for the lifetime of the backend, so devices
+// opened again later see earlier writes.
+class SimulatedBackend : public MonitorBackend
+{
+public:
+  explicit SimulatedBackend(std::vector<SimulatedMonitorConfig> const& configs)
+  {
+    for (const auto& config : configs)
+    {
+      m_monitors.push_back(std::make_shared<SimulatedMonitor>(config));
+    }
+  }
+
+  std::unique_ptr<MonitorDevice> Open(int index) override
+  {
+    if (index < 0 || index >= static_cast<int>(m_monitors.size()))
+    {
+      return nullptr;
+    }
+    return std::make_unique<SimulatedMonitorDevice>(m_monitors[index], index == 0);
+  }
+
+  // Reads a simulation file. Settings before the first "monitor" line are
+  // defaults for every monitor:
+  //
+  //   latency 40                  # ms per DDC/CI transaction
+  //   settle 300                  # ms before a written value reads back
+  //   command-gap 50              # ms a command must follow the previous one by
+  //   nak-rate 0.01               # fraction of transactions that are NAKed
+  //   checksum-error-rate 0.01    # fraction of replies with a bad checksum
+  //   seed 1
+  //   monitor
+  //   name SIM1
+  //   identity DEL 40B6 0001E240  # manufacturer, product and serial (hex)
+  //   capabilities (prot(monitor)type(LCD)vcp(10 60(0F 11)))
+  //   vcp 10 32 64                # code, value and maximum (hex)
+  //   vcp 60 0F 12
+  //   vcp 01 00 0 momentary       # momentary codes are marked as such
+  //   table 73 300                # table code and size in bytes (hex), zero-filled
+  static std::unique_ptr<SimulatedBackend> Load(std::string const& path, std::string* error)
+  {
+    std::ifstream file{ path };
+    if (!file)
+    {
+      *error = "Cannot open " + path;
+      return nullptr;
+    }
+
+    SimulatedMonitorConfig defaults{};
+    std::vector<SimulatedMonitorConfig> configs;
+    std::string line;
+    for (auto lineNumber = 1; std::getline(file, line); ++lineNumber)
+    {
+      const auto comment = line.find('#');
+      if (comment != std::string::npos)
+      {
+        line.erase(comment);
+      }
+      std::istringstream words{ line };
+      std::string key;
+      if (!(words >> key))
+      {
+        continue;
+      }
+
+      auto& config = configs.empty() ? defaults : configs.back();
+      auto valid = true;
+      if (key == "monitor")
+      {
+        configs.push_back(defaults);
+        configs.back().Name = "SIM" + std::to_string(configs.size());
+        configs.back().Identity.Serial += static_cast<uint32_t>(configs.size());
+      }
+      else if (key == "name")
+      {
+        valid = static_cast<bool>(words >> config.Name);
+      }
+      else if (key == "identity")
+      {
+        std::string manufacturer;
+        std::string product;
+        std::string serial;
+        valid = (words >> manufacturer >> product >> serial) && manufacturer.size() == 3 &&
+          ParseNumber(product, 16, &config.Identity.Product) && ParseNumber(serial, 16, &config.Identity.Serial);
+        if (valid)
+        {
+          std::memcpy(config.Identity.Manufacturer, manufacturer.c_str(), 4);
+        }
+      }
+      else if (key == "capabilities")
+      {
+        std::getline(words >> std::ws, config.Capabilities);
+        while (!config.Capabilities.empty() && config.Capabilities.back() == ' ')
+        {
+          config.Capabilities.pop_back();
+        }
+      }
+      else if (key == "vcp")
+      {
+        std::string code;
+        std::string value;
+        std::string maxValue{ "0" };
+        std::string codeType;
+        SimulatedMonitorConfig::Feature feature{};
+        valid = (words >> code >> value) && ParseNumber(code, 16, &feature.Code) && ParseNumber(value, 16, &feature.Value);
+        words >> maxValue >> codeType;
+        valid = valid && ParseNumber(maxValue, 16, &feature.MaxValue);
+        feature.CodeType = (codeType == "momentary") ? VCPCodeType::Momentary : VCPCodeType::SetParameter;
+        config.Features.push_back(feature);
+      }
+      else if (key == "table")
+      {
+        std::string code;
+        std::string size;
+        SimulatedMonitorConfig::Table table{};
+        valid = (words >> code >> size) && ParseNumber(code, 16, &table.Code) && ParseNumber(size, 16, &table.Size) && table.Size <= 0x10000;
+        config.Tables.push_back(table);
+      }
+      else if (key == "latency" || key == "settle" || key == "command-gap")
+      {
+        std::string text;
+        double milliseconds = 0.0;
+        valid = (words >> text) && ParseNumber(text, &milliseconds);
+        const auto duration = std::chrono::microseconds{ static_cast<int64_t>(milliseconds * 1000.0) };
+        (key == "latency" ? config.Latency : key == "settle" ? config.Settle : config.CommandGap) = duration;
+      }
+      else if (key == "nak-rate" || key == "checksum-error-rate")
+      {
+        std::string text;
+        valid = (words >> text) && ParseNumber(text, key == "nak-rate" ? &config.NakRate : &config.ChecksumErrorRate);
+      }
+      else if (key == "seed")
+      {
+        std::string text;
+        valid = (words >> text) && ParseNumber(text, 10, &config.Seed);
+      }
+      else
+      {
+        valid = false;
+      }
+
+      if (!valid)
+      {
+        *error = path + ":" + std::to_string(lineNumber) + ": cannot parse \"" + line + "\"";
+        return nullptr;
+      }
+    }
+
+    if (configs.empty())
+    {
+      *error = path + ": no monitors defined";
+      return nullptr;
+    }
+    return std::make_unique<SimulatedBackend>(configs);
+  }
+
+private:
+
+  template<typename T>
+  static bool ParseNumber(std::string const& text, int base, T* out)
+  {
+    char* end = nullptr;
+    const auto value = std::strtoul(text.c_str(), &end, base);
+    *out = static_cast<T>(value);
+    return !text.empty() && *end == '\0';
+  }
+
+  static bool ParseNumber(std::string const& text, double* out)
+  {
+    char* end = nullptr;
+    *out = std::strtod(text.c_str(), &end);
+    return !text.empty() && *end == '\0';
+  }
+
+  std::vector<std::shared_ptr<SimulatedMonitor>> m_monitors;
+};
@@ -0,0 +1,234 @@
+// snapshot.h : Every VCP value a monitor advertises, read in one go and written as JSON or a binary file.
+//
+#pragma once
+
+#include "capabilities.h"
+#include "capabilities_cache.h"
+#include "edid.h"
+#include "json.h"
+#include "monitor_utils.h"
+#include "trace.h"
+#include "vcp_features.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+struct MonitorSnapshot
+{
+  int Index{ 0 };
+  std::string Name;
+  MonitorIdentity Identity;
+  bool CapabilitiesValid{ false };
+  bool CapabilitiesCached{ false };
+  std::vector<TimedVCPFeatureResult> Features;
+  std::chrono::steady_clock::duration Elapsed{};
+};
+
+// The codes the capabilities list, leaving out those MCCS defines as
+// write-only (the factory resets): reading them is pointless at best.
+inline std::vector<uint8_t> SnapshotCodes(CapabilityIndex const& capabilities)
+{
+  std::vector<uint8_t> codes;
+  for (auto code = 0; code < 256; ++code)
+  {
+    const auto feature = FindVCPFeature(static_cast<uint8_t>(code));
+    if (capabilities.Supports(static_cast<uint8_t>(code)) && !(feature && feature->Access == VCPAccess::WriteOnly))
+    {
+      codes.push_back(static_cast<uint8_t>(code));
+    }
+  }
+  return codes;
+}
+
+// Reads the capabilities (from the cache if possible), then every listed code.
+// The reads are queued together, so the bus never waits on this thread.
+inline MonitorSnapshot TakeSnapshot(int index, MonitorUtils::Monitor const& monitor, CapabilitiesCache* cache)
+{
+  TraceSpan span{ "operation", "Snapshot", "index", static_cast<uint32_t>(index) };
+  const auto startTime = std::chrono::steady_clock::now();
+  MonitorSnapshot snapshot{};
+  snapshot.Index = index;
+  snapshot.Name = MonitorUtils::GetMonitorInfo(monitor).Name;
+  snapshot.Identity = MonitorUtils::GetMonitorIdentity(monitor);
+
+  const auto capabilities = MonitorUtils::GetLowLevelCapabilities(monitor, cache, "vcp");
+  snapshot.CapabilitiesValid = capabilities.Valid;
+  snapshot.CapabilitiesCached = capabilities.Cached;
+  if (capabilities.Valid)
+  {
+    snapshot.Features = MonitorUtils::GetVCPFeatures(monitor, SnapshotCodes(capabilities.Index()));
+  }
+  snapshot.Elapsed = std::chrono::steady_clock::now() - startTime;
+  return snapshot;
+}
+
+// One object per monitor, one line per feature. Failed reads carry the error
+// code instead of a value.
+inline void WriteSnapshotJson(std::ostream& out, std::vector<MonitorSnapshot> const& snapshots)
+{
+  const auto milliseconds = [](std::chrono::steady_clock::duration duration)
+  {
+    return std::chrono::duration<double, std::milli>{ duration }.count();
+  };
+
+  out << std::fixed << std::setprecision(3) << "{\"monitors\":[";
+  for (size_t i = 0; i < snapshots.size(); ++i)
+  {
+    const auto& snapshot = snapshots[i];
+    out << (i > 0 ? ",\n" : "\n") << "{\"index\":" << std::dec << snapshot.Index << ",\"name\":";
+    WriteJsonString(out, snapshot.Name);
+    if (snapshot.Identity.Valid())
+    {
+      out << ",\"identity\":";
+      WriteJsonString(out, snapshot.Identity.ToString());
+    }
+    out << ",\"capabilities\":\"" << (!snapshot.CapabilitiesValid ? "unavailable" : snapshot.CapabilitiesCached ? "cached" : "read") << "\"" <<
+      ",\"ms\":" << milliseconds(snapshot.Elapsed) << ",\"features\":[";
+    for (size_t j = 0; j < snapshot.Features.size(); ++j)
+    {
+      const auto& feature = snapshot.Features[j];
+      const auto description = FindVCPFeature(feature.Code);
+      out << (j > 0 ? ",\n" : "\n") << "{\"code\":\"0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<uint32_t>(feature.Code) <<
+        std::setfill(' ') << std::dec << "\"";
+      if (description)
+      {
+        out << ",\"name\":";
+        WriteJsonString(out, description->Name);
+      }
+      if (feature.Result.Success)
+      {
+        out << ",\"value\":" << feature.Result.CurrentValue;
+        const auto valueName = description ? FindVCPValue(*description, feature.Result.CurrentValue) : nullptr;
+        if (valueName)
+        {
+          out << ",\"valueName\":";
+          WriteJsonString(out, valueName->Name);
+        }
+        out << ",\"max\":" << feature.Result.MaxValue;
+        if (feature.Result.CodeType == VCPCodeType::Momentary)
+        {
+          out << ",\"momentary\":true";
+        }
+      }
+      else
+      {
+        out << ",\"error\":" << feature.Error;
+      }
+      out << ",\"ms\":" << milliseconds(feature.Elapsed) << "}";
+    }
+    out << "]}";
+  }
+  out << "\n]}\n";
+}
+
+// Compact binary form of a list of snapshots, for other tools to read; this one
+// only writes it.
+//
+// File layout (native byte order, every record 4-byte aligned):
+//   FileHeader
+//   per monitor: MonitorRecord, the name padded to 4 bytes, FeatureRecord[FeatureCount]
+class SnapshotFile
+{
+public:
+  static bool Write(std::string const& path, std::vector<MonitorSnapshot> const& snapshots)
+  {
+    std::vector<uint8_t> buffer;
+    FileHeader header{};
+    std::memcpy(header.Magic, Magic, sizeof Magic);
+    header.Version = Version;
+    header.MonitorCount = static_cast<uint32_t>(snapshots.size());
+    Append(&buffer, &header, sizeof header);
+
+    for (const auto& snapshot : snapshots)
+    {
+      MonitorRecord monitor{};
+      monitor.Index = snapshot.Index;
+      std::memcpy(monitor.Manufacturer, snapshot.Identity.Manufacturer, sizeof monitor.Manufacturer);
+      monitor.Product = snapshot.Identity.Product;
+      monitor.Flags = static_cast<uint16_t>((snapshot.CapabilitiesValid ? CapabilitiesValidFlag : 0) | (snapshot.CapabilitiesCached ? CapabilitiesCachedFlag : 0));
+      monitor.Serial = snapshot.Identity.Serial;
+      monitor.NameLength = static_cast<uint32_t>(snapshot.Name.size());
+      monitor.FeatureCount = static_cast<uint32_t>(snapshot.Features.size());
+      monitor.Microseconds = Microseconds(snapshot.Elapsed);
+      Append(&buffer, &monitor, sizeof monitor);
+      Append(&buffer, snapshot.Name.data(), snapshot.Name.size());
+      buffer.resize((buffer.size() + 3) & ~size_t{ 3 });
+
+      for (const auto& feature : snapshot.Features)
+      {
+        FeatureRecord record{};
+        record.Code = feature.Code;
+        record.Flags = static_cast<uint8_t>((feature.Result.Success ? SuccessFlag : 0) | (feature.Result.CodeType == VCPCodeType::Momentary ? MomentaryFlag : 0));
+        record.CurrentValue = feature.Result.CurrentValue;
+        record.MaxValue = feature.Result.MaxValue;
+        record.Error = feature.Error;
+        record.Microseconds = Microseconds(feature.Elapsed);
+        Append(&buffer, &record, sizeof record);
+      }
+    }
+
+    std::ofstream file{ path, std::ios::binary | std::ios::trunc };
+    file.write(reinterpret_cast<char const*>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+    return static_cast<bool>(file);
+  }
+
+private:
+
+  static constexpr char Magic[4] = { 'M', 'U', 'S', 'N' };
+  static constexpr uint32_t Version = 1;
+
+  static constexpr uint16_t CapabilitiesValidFlag = 1;
+  static constexpr uint16_t CapabilitiesCachedFlag = 2;
+  static constexpr uint8_t SuccessFlag = 1;
+  static constexpr uint8_t MomentaryFlag = 2;
+
+  struct FileHeader
+  {
+    char Magic[4];
+    uint32_t Version;
+    uint32_t MonitorCount;
+    uint32_t Reserved;
+  };
+
+  struct MonitorRecord
+  {
+    int32_t Index;
+    char Manufacturer[4];
+    uint16_t Product;
+    uint16_t Flags;
+    uint32_t Serial;
+    uint32_t NameLength;
+    uint32_t FeatureCount;
+    uint32_t Microseconds;
+  };
+
+  struct FeatureRecord
+  {
+    uint8_t Code;
+    uint8_t Flags;
+    uint16_t Reserved;
+    uint32_t CurrentValue;
+    uint32_t MaxValue;
+    uint32_t Error;
+    uint32_t Microseconds;
+  };
+  static_assert(sizeof(FeatureRecord) == 20, "Unexpected feature record size");
+
+  static uint32_t Microseconds(std::chrono::steady_clock::duration duration)
+  {
+    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+  }
+
+  static void Append(std::vector<uint8_t>* buffer, void const* data, size_t size)
+  {
+    const auto bytes = static_cast<uint8_t const*>(data);
+    buffer->insert(buffer->end(), bytes, bytes + size);
+  }
+};
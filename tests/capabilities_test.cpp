@@ -0,0 +1,156 @@
+// capabilities_test.cpp : Capabilities trees that must not get past validation into the cache.
+//
+#include "../capabilities.h"
+#include "../capabilities_cache.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+int failures = 0;
+
+#define CHECK(condition) Check((condition), #condition, __LINE__)
+
+void Check(bool condition, char const* text, int line)
+{
+  if (!condition)
+  {
+    std::cerr << "capabilities_test.cpp:" << line << ": CHECK(" << text << ") failed" << std::endl;
+    ++failures;
+  }
+}
+
+const std::string Capabilities = "(prot(monitor)type(LCD)vcp(10 12 60(0F 11)))";
+
+bool Validates(std::vector<CapabilityTree::Node> const& nodes)
+{
+  return CapabilityTree::Validate(Capabilities, nodes.data(), nodes.size());
+}
+
+void TestValidate()
+{
+  const CapabilityTree tree{ Capabilities };
+  CHECK(!tree.Empty());
+  CHECK(Validates(tree.Nodes()));
+
+  // Codes outside 0-255, and codes that do not match the token text.
+  for (const auto code : { 256, 300, 0x7FFF, -2, -0x8000 })
+  {
+    auto nodes = tree.Nodes();
+    for (auto& node : nodes)
+    {
+      if (node.Code >= 0)
+      {
+        node.Code = static_cast<int16_t>(code);
+        break;
+      }
+    }
+    CHECK(!Validates(nodes));
+  }
+  auto nodes = tree.Nodes();
+  nodes[0].Code = 0x10;
+  CHECK(!Validates(nodes));
+  nodes = tree.Nodes();
+  for (auto& node : nodes)
+  {
+    if (node.Code >= 0)
+    {
+      node.Code = -1;
+      break;
+    }
+  }
+  CHECK(!Validates(nodes));
+
+  // Text out of bounds and backward links.
+  nodes = tree.Nodes();
+  nodes.back().TextOffset = static_cast<uint32_t>(Capabilities.size());
+  CHECK(!Validates(nodes));
+  nodes = tree.Nodes();
+  nodes.back().NextSibling = 0;
+  CHECK(!Validates(nodes));
+}
+
+// A token that does not fit Node::TextLength fails the parse instead of
+// pointing at part of the token.
+void TestLongToken()
+{
+  const auto longToken = "(prot(monitor)model(" + std::string(CapabilityTree::MaxTokenLength + 1, 'x') + ")vcp(10))";
+  CHECK(CapabilityTree{ longToken }.Empty());
+
+  CapabilitiesParser parser;
+  for (size_t offset = 0; offset < longToken.size(); offset += 32)
+  {
+    parser.Append(std::string_view{ longToken }.substr(offset, 32));
+  }
+  CHECK(parser.Finish().Empty());
+
+  const auto longest = "(model(" + std::string(CapabilityTree::MaxTokenLength, 'x') + "))";
+  const CapabilityTree tree{ longest };
+  CHECK(!tree.Empty());
+  CHECK(CapabilityTree::Validate(longest, tree.Nodes().data(), tree.Nodes().size()));
+}
+
+// A cache file whose node carries an impossible code is ignored rather than
+// handed to CapabilityIndex.
+void TestCorruptedCache()
+{
+  const auto directory = std::filesystem::temp_directory_path() / ("capabilities_test." + std::to_string(GetCurrentProcessNumber()));
+  std::filesystem::create_directories(directory);
+  const auto path = (directory / "capabilities.cache").string();
+
+  MonitorIdentity identity{};
+  identity.Manufacturer[0] = 'D';
+  identity.Manufacturer[1] = 'E';
+  identity.Manufacturer[2] = 'L';
+  identity.Product = 0x40B6;
+  identity.Serial = 1;
+  {
+    CapabilitiesCache cache{ path };
+    CHECK(cache.Store(identity, CapabilityTree{ Capabilities }));
+  }
+  {
+    CapabilitiesCache cache{ path };
+    CapabilityTree tree;
+    CHECK(cache.Find(identity, &tree) && tree.String() == Capabilities);
+  }
+
+  // The entry's NodeOffset follows the 16 byte header and 12 bytes of
+  // identity; a node's code is at offset 6.
+  {
+    std::fstream file{ path, std::ios::binary | std::ios::in | std::ios::out };
+    uint32_t nodeOffset = 0;
+    file.seekg(16 + 12);
+    file.read(reinterpret_cast<char*>(&nodeOffset), sizeof nodeOffset);
+    const int16_t code = 300;
+    file.seekp(nodeOffset + 6);
+    file.write(reinterpret_cast<char const*>(&code), sizeof code);
+    CHECK(static_cast<bool>(file));
+  }
+  {
+    CapabilitiesCache cache{ path };
+    CapabilityTree tree;
+    CHECK(!cache.Find(identity, &tree));
+    CHECK(!cache.Contains(identity));
+  }
+
+  std::error_code error;
+  std::filesystem::remove_all(directory, error);
+}
+
+int main()
+{
+  TestValidate();
+  TestLongToken();
+  TestCorruptedCache();
+  if (failures > 0)
+  {
+    std::cerr << failures << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << "All checks passed" << std::endl;
+  return 0;
+}
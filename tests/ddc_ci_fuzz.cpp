@@ -0,0 +1,101 @@
+// ddc_ci_fuzz.cpp : Feeds arbitrary bytes to every DDC/CI decoder.
+//
+// Built as a libFuzzer target with -DMONITOR_UTIL_BUILD_FUZZERS=ON (Clang
+// only). Otherwise main() runs the same checks over seeded random messages,
+// half of them with a valid header and checksum so they get past the framing.
+//
+// ddc_ci_fuzz [ITERATIONS [SEED]]
+//
+#include "../ddc_ci.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+
+// Decoded bytes must lie inside the input, and fragments must fit the
+// backends' fragment buffers.
+static void CheckBytes(uint8_t const* data, size_t size, DdcCiStatus status, DdcCiBytes const& bytes, size_t maxSize)
+{
+  if (status != DdcCiStatus::Ok && status != DdcCiStatus::NullMessage)
+  {
+    return;
+  }
+  if (bytes.Size > maxSize || bytes.Data < data || bytes.Data + bytes.Size > data + size)
+  {
+    std::abort();
+  }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const* data, size_t size)
+{
+  DdcCiBytes payload{};
+  auto status = DecodeDdcCiReply(data, size, &payload);
+  CheckBytes(data, size, status, payload, DdcCiMaxPayloadSize);
+
+  payload = {};
+  status = DecodeDdcCiRequest(data, size, &payload);
+  CheckBytes(data, size, status, payload, DdcCiMaxPayloadSize);
+
+  const auto code = size > 0 ? data[0] : uint8_t{ 0 };
+  const auto offset = static_cast<uint16_t>(size > 1 ? (data[0] << 8) | data[1] : 0);
+  VCPFeatureResult result{};
+  status = DecodeGetVCPReply(data, size, code, &result);
+  if (status == DdcCiStatus::Ok ? (!result.Success || result.MaxValue > 0xFFFF || result.CurrentValue > 0xFFFF) : result.Success)
+  {
+    std::abort();
+  }
+
+  DdcCiBytes fragment{};
+  status = DecodeCapabilitiesReply(data, size, offset, &fragment);
+  CheckBytes(data, size, status, fragment, DdcCiMaxFragmentSize);
+
+  fragment = {};
+  status = DecodeTableReadReply(data, size, offset, &fragment);
+  CheckBytes(data, size, status, fragment, DdcCiMaxFragmentSize);
+  return 0;
+}
+
+#ifndef MONITOR_UTIL_LIBFUZZER
+int main(int argc, char** argv)
+{
+  const auto iterations = argc > 1 ? std::atoi(argv[1]) : 200000;
+  std::mt19937 random{ argc > 2 ? static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10)) : 0x6E51u };
+  std::uniform_int_distribution<int> byte{ 0, 255 };
+  std::uniform_int_distribution<size_t> length{ 0, DdcCiMaxMessageSize + 4 };
+  const uint8_t opcodes[] = { DdcCiGetVCPReply, DdcCiCapabilitiesReply, DdcCiTableReadReply, DdcCiGetVCPRequest };
+
+  std::vector<uint8_t> message;
+  for (auto i = 0; i < iterations; ++i)
+  {
+    message.resize(length(random));
+    for (auto& value : message)
+    {
+      value = static_cast<uint8_t>(byte(random));
+    }
+    if (i % 2 == 1 && message.size() >= 4)
+    {
+      // A well-formed frame around random contents, often with a known opcode.
+      const auto payloadSize = (std::min)(message.size() - 3, size_t{ 0x7F });
+      message[0] = i % 4 == 1 ? DdcCiDisplayAddress : DdcCiHostAddress;
+      message[1] = static_cast<uint8_t>(0x80 | payloadSize);
+      if (i % 8 < 4)
+      {
+        message[2] = opcodes[static_cast<size_t>(i / 8) % sizeof opcodes];
+      }
+      const auto destination = message[0] == DdcCiDisplayAddress ? DdcCiHostChecksumAddress : DdcCiDisplayAddress;
+      message[payloadSize + 2] = DdcCiChecksum(destination, message.data(), payloadSize + 2);
+    }
+    // A copy of exactly the generated size, so reads past it are caught by
+    // sanitizers.
+    std::vector<uint8_t> input{ message };
+    LLVMFuzzerTestOneInput(input.data(), input.size());
+  }
+  std::cout << "Decoded " << iterations << " random messages" << std::endl;
+  return 0;
+}
+#endif
@@ -0,0 +1,189 @@
+// ddc_ci_test.cpp : Round trips through the DDC/CI codec and every reason it rejects a message.
+//
+#include "../ddc_ci.h"
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+
+int failures = 0;
+
+#define CHECK(condition) Check((condition), #condition, __LINE__)
+
+void Check(bool condition, char const* text, int line)
+{
+  if (!condition)
+  {
+    std::cerr << "ddc_ci_test.cpp:" << line << ": CHECK(" << text << ") failed" << std::endl;
+    ++failures;
+  }
+}
+
+// A display reply with any payload and a correct checksum.
+DdcCiMessage Reply(std::initializer_list<uint8_t> payload)
+{
+  uint8_t bytes[DdcCiMaxPayloadSize]{};
+  size_t size = 0;
+  for (const auto byte : payload)
+  {
+    bytes[size++] = byte;
+  }
+  return EncodeDdcCiReply(bytes, size);
+}
+
+void TestFraming()
+{
+  // Get VCP brightness, as in the DDC/CI standard's example.
+  const auto request = EncodeGetVCPRequest(0x10);
+  const uint8_t expected[] = { 0x51, 0x82, 0x01, 0x10, 0xAC };
+  CHECK(request.Size == sizeof expected && std::memcmp(request.Bytes, expected, sizeof expected) == 0);
+
+  DdcCiBytes payload{};
+  CHECK(DecodeDdcCiRequest(request.Bytes, request.Size, &payload) == DdcCiStatus::Ok);
+  CHECK(payload.Size == 2 && payload.Data == request.Bytes + 2 && payload.Data[0] == DdcCiGetVCPRequest && payload.Data[1] == 0x10);
+
+  // Bytes after the message are ignored.
+  uint8_t padded[DdcCiMaxMessageSize]{};
+  std::memcpy(padded, request.Bytes, request.Size);
+  CHECK(DecodeDdcCiRequest(padded, sizeof padded, &payload) == DdcCiStatus::Ok && payload.Size == 2);
+
+  // Requests and replies checksum against different addresses.
+  CHECK(DecodeDdcCiReply(request.Bytes, request.Size, &payload) == DdcCiStatus::BadAddress);
+
+  const uint8_t tooLong[DdcCiMaxPayloadSize + 1]{};
+  CHECK(EncodeDdcCiRequest(tooLong, sizeof tooLong).Size == 0);
+  CHECK(EncodeDdcCiRequest(tooLong, DdcCiMaxPayloadSize).Size == DdcCiMaxMessageSize);
+}
+
+void TestRoundTrips()
+{
+  DdcCiBytes payload{};
+  const auto set = EncodeSetVCPRequest(0x60, 0x1234F);
+  CHECK(DecodeDdcCiRequest(set.Bytes, set.Size, &payload) == DdcCiStatus::Ok);
+  CHECK(payload.Size == 4 && payload.Data[0] == DdcCiSetVCPRequest && payload.Data[1] == 0x60 && payload.Data[2] == 0x23 && payload.Data[3] == 0x4F);
+
+  const auto capabilities = EncodeCapabilitiesRequest(0x0120);
+  CHECK(DecodeDdcCiRequest(capabilities.Bytes, capabilities.Size, &payload) == DdcCiStatus::Ok);
+  CHECK(payload.Size == 3 && payload.Data[0] == DdcCiCapabilitiesRequest && payload.Data[1] == 0x01 && payload.Data[2] == 0x20);
+
+  const auto tableRead = EncodeTableReadRequest(0x73, 0x0040);
+  CHECK(DecodeDdcCiRequest(tableRead.Bytes, tableRead.Size, &payload) == DdcCiStatus::Ok);
+  CHECK(payload.Size == 4 && payload.Data[0] == DdcCiTableReadRequest && payload.Data[1] == 0x73 && payload.Data[3] == 0x40);
+
+  uint8_t data[DdcCiMaxFragmentSize + 8];
+  for (size_t i = 0; i < sizeof data; ++i)
+  {
+    data[i] = static_cast<uint8_t>(i * 7);
+  }
+  const auto tableWrite = EncodeTableWriteRequest(0x73, 0x0020, data, sizeof data);
+  CHECK(DecodeDdcCiRequest(tableWrite.Bytes, tableWrite.Size, &payload) == DdcCiStatus::Ok);
+  CHECK(payload.Size == 4 + DdcCiMaxFragmentSize && std::memcmp(payload.Data + 4, data, DdcCiMaxFragmentSize) == 0);
+
+  for (const auto type : { VCPCodeType::SetParameter, VCPCodeType::Momentary })
+  {
+    VCPFeatureResult sent{};
+    sent.Success = true;
+    sent.CodeType = type;
+    sent.MaxValue = 0xFF00;
+    sent.CurrentValue = 0x00FF;
+    const auto reply = EncodeGetVCPReply(0x10, sent);
+    CHECK(reply.Size == DdcCiGetVCPReplySize);
+    VCPFeatureResult received{};
+    CHECK(DecodeGetVCPReply(reply.Bytes, reply.Size, 0x10, &received) == DdcCiStatus::Ok);
+    CHECK(received.Success && received.CodeType == type && received.MaxValue == 0xFF00 && received.CurrentValue == 0x00FF);
+  }
+
+  // Fragments: full, cut off at the fragment size, and the empty one that ends a string.
+  for (const auto size : { size_t{ 0 }, size_t{ 5 }, DdcCiMaxFragmentSize, sizeof data })
+  {
+    DdcCiBytes fragment{};
+    const auto reply = EncodeCapabilitiesReply(0x0040, data, size);
+    CHECK(DecodeCapabilitiesReply(reply.Bytes, reply.Size, 0x0040, &fragment) == DdcCiStatus::Ok);
+    const auto expected = size < DdcCiMaxFragmentSize ? size : DdcCiMaxFragmentSize;
+    CHECK(fragment.Size == expected && std::memcmp(fragment.Data, data, expected) == 0);
+
+    const auto table = EncodeTableReadReply(0x0100, data, size);
+    CHECK(DecodeTableReadReply(table.Bytes, table.Size, 0x0100, &fragment) == DdcCiStatus::Ok && fragment.Size == expected);
+  }
+}
+
+void TestRejects()
+{
+  DdcCiBytes payload{};
+  const auto good = Reply({ DdcCiGetVCPReply, 0x00, 0x10, 0x00, 0x00, 0x64, 0x00, 0x32 });
+
+  // Truncated: shorter than the smallest message, than the length byte says,
+  // or than the command needs.
+  CHECK(DecodeDdcCiReply(good.Bytes, 2, &payload) == DdcCiStatus::Truncated);
+  CHECK(DecodeDdcCiReply(good.Bytes, good.Size - 1, &payload) == DdcCiStatus::Truncated);
+  const auto shortGet = Reply({ DdcCiGetVCPReply, 0x00, 0x10, 0x00, 0x00, 0x64, 0x00 });
+  VCPFeatureResult result{};
+  CHECK(DecodeGetVCPReply(shortGet.Bytes, shortGet.Size, 0x10, &result) == DdcCiStatus::Truncated);
+  const auto shortFragment = Reply({ DdcCiCapabilitiesReply, 0x00 });
+  CHECK(DecodeCapabilitiesReply(shortFragment.Bytes, shortFragment.Size, 0, &payload) == DdcCiStatus::Truncated);
+
+  // BadAddress
+  auto message = good;
+  message.Bytes[0] = DdcCiHostAddress;
+  CHECK(DecodeDdcCiReply(message.Bytes, message.Size, &payload) == DdcCiStatus::BadAddress);
+
+  // BadLength: no 0x80 flag, a payload longer than any command, or a fragment
+  // longer than a fragment buffer.
+  message = good;
+  message.Bytes[1] &= 0x7F;
+  CHECK(DecodeDdcCiReply(message.Bytes, message.Size, &payload) == DdcCiStatus::BadLength);
+  uint8_t oversized[DdcCiMaxMessageSize + 8]{ DdcCiDisplayAddress, static_cast<uint8_t>(0x80 | (DdcCiMaxPayloadSize + 1)) };
+  CHECK(DecodeDdcCiReply(oversized, sizeof oversized, &payload) == DdcCiStatus::BadLength);
+  uint8_t longFragment[DdcCiMaxPayloadSize]{ DdcCiCapabilitiesReply, 0x00, 0x00 };
+  const auto tooMuchData = EncodeDdcCiReply(longFragment, 3 + DdcCiMaxFragmentSize + 1);
+  CHECK(tooMuchData.Size != 0);
+  CHECK(DecodeCapabilitiesReply(tooMuchData.Bytes, tooMuchData.Size, 0, &payload) == DdcCiStatus::BadLength);
+  longFragment[0] = DdcCiTableReadReply;
+  const auto tooMuchTable = EncodeDdcCiReply(longFragment, 3 + DdcCiMaxFragmentSize + 1);
+  CHECK(DecodeTableReadReply(tooMuchTable.Bytes, tooMuchTable.Size, 0, &payload) == DdcCiStatus::BadLength);
+
+  // BadChecksum
+  message = good;
+  message.Bytes[message.Size - 1] ^= 0x01;
+  CHECK(DecodeDdcCiReply(message.Bytes, message.Size, &payload) == DdcCiStatus::BadChecksum);
+  message = good;
+  message.Bytes[4] ^= 0x01;
+  CHECK(DecodeDdcCiReply(message.Bytes, message.Size, &payload) == DdcCiStatus::BadChecksum);
+
+  // NullMessage
+  const auto null = EncodeDdcCiReply(nullptr, 0);
+  CHECK(DecodeDdcCiReply(null.Bytes, null.Size, &payload) == DdcCiStatus::NullMessage);
+  CHECK(DecodeGetVCPReply(null.Bytes, null.Size, 0x10, &result) == DdcCiStatus::NullMessage);
+
+  // UnexpectedOpcode
+  CHECK(DecodeCapabilitiesReply(good.Bytes, good.Size, 0, &payload) == DdcCiStatus::UnexpectedOpcode);
+  const auto capabilities = EncodeCapabilitiesReply(0, reinterpret_cast<uint8_t const*>("(vcp(10))"), 9);
+  CHECK(DecodeGetVCPReply(capabilities.Bytes, capabilities.Size, 0x10, &result) == DdcCiStatus::UnexpectedOpcode);
+  CHECK(DecodeTableReadReply(capabilities.Bytes, capabilities.Size, 0, &payload) == DdcCiStatus::UnexpectedOpcode);
+
+  // Mismatch: another code or offset.
+  CHECK(DecodeGetVCPReply(good.Bytes, good.Size, 0x12, &result) == DdcCiStatus::Mismatch);
+  CHECK(DecodeCapabilitiesReply(capabilities.Bytes, capabilities.Size, 0x20, &payload) == DdcCiStatus::Mismatch);
+
+  // Unsupported
+  const auto unsupported = EncodeGetVCPReply(0x10, VCPFeatureResult{});
+  CHECK(DecodeGetVCPReply(unsupported.Bytes, unsupported.Size, 0x10, &result) == DdcCiStatus::Unsupported);
+
+  // None of these touched the result.
+  CHECK(!result.Success && result.MaxValue == 0 && result.CurrentValue == 0);
+}
+
+int main()
+{
+  TestFraming();
+  TestRoundTrips();
+  TestRejects();
+  if (failures > 0)
+  {
+    std::cerr << failures << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << "All checks passed" << std::endl;
+  return 0;
+}
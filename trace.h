@@ -0,0 +1,257 @@
+// trace.h : Timestamped spans written as a Chrome trace (chrome://tracing, Perfetto).
+//
+#pragma once
+
+#include "json.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// Collects spans from every thread while it is the active tracer. With no
+// active tracer a TraceSpan costs one atomic load.
+class Tracer
+{
+public:
+  struct Argument
+  {
+    char const* Name;
+    uint32_t Value;
+  };
+
+  static Tracer* Active()
+  {
+    return ActiveInstance().load(std::memory_order_acquire);
+  }
+
+  static void SetActive(Tracer* tracer)
+  {
+    ActiveInstance().store(tracer, std::memory_order_release);
+  }
+
+  Tracer()
+    : m_start{ std::chrono::steady_clock::now() }
+  {
+  }
+
+  Tracer(Tracer const&) = delete;
+  Tracer& operator=(Tracer const&) = delete;
+
+  // Names and arguments must be string literals; they are kept as pointers.
+  void AddSpan(
+    char const* category,
+    char const* name,
+    std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point end,
+    Argument const* arguments,
+    size_t argumentCount)
+  {
+    Event event{};
+    event.Category = category;
+    event.Name = name;
+    event.Start = start;
+    event.End = end;
+    for (size_t i = 0; i < argumentCount && i < MaxArguments; ++i)
+    {
+      event.Arguments[i] = arguments[i];
+    }
+    event.ArgumentCount = argumentCount < MaxArguments ? argumentCount : MaxArguments;
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    event.Thread = ThreadIndex();
+    m_events.push_back(event);
+  }
+
+  // Labels the calling thread's track in the trace viewer.
+  void NameThread(std::string name)
+  {
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    m_threadNames[ThreadIndex()] = std::move(name);
+  }
+
+  bool Write(std::string const& path) const
+  {
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    std::ofstream file{ path, std::ios::trunc };
+    file << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    auto first = true;
+    for (const auto& threadName : m_threadNames)
+    {
+      file << (first ? "\n" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << threadName.first <<
+        ",\"args\":{\"name\":";
+      WriteJsonString(file, threadName.second);
+      file << "}}";
+      first = false;
+    }
+    for (const auto& event : m_events)
+    {
+      file << (first ? "\n" : ",\n") << "{\"ph\":\"X\",\"cat\":\"" << event.Category << "\",\"name\":\"" << event.Name <<
+        "\",\"pid\":1,\"tid\":" << event.Thread << ",\"ts\":" << Microseconds(event.Start - m_start) <<
+        ",\"dur\":" << Microseconds(event.End - event.Start);
+      if (event.ArgumentCount > 0)
+      {
+        file << ",\"args\":{";
+        for (size_t i = 0; i < event.ArgumentCount; ++i)
+        {
+          file << (i > 0 ? "," : "") << "\"" << event.Arguments[i].Name << "\":\"0x" << std::hex << event.Arguments[i].Value << std::dec << "\"";
+        }
+        file << "}";
+      }
+      file << "}";
+      first = false;
+    }
+    file << "\n]}\n";
+    return static_cast<bool>(file);
+  }
+
+private:
+
+  static constexpr size_t MaxArguments = 2;
+
+  struct Event
+  {
+    char const* Category;
+    char const* Name;
+    std::chrono::steady_clock::time_point Start;
+    std::chrono::steady_clock::time_point End;
+    Argument Arguments[MaxArguments];
+    size_t ArgumentCount;
+    int Thread;
+  };
+
+  static std::atomic<Tracer*>& ActiveInstance()
+  {
+    static std::atomic<Tracer*> active{ nullptr };
+    return active;
+  }
+
+  // Expects m_mutex to be held. Numbers threads in order of first appearance.
+  int ThreadIndex()
+  {
+    const auto thread = m_threads.emplace(std::this_thread::get_id(), static_cast<int>(m_threads.size()) + 1);
+    return thread.first->second;
+  }
+
+  static double Microseconds(std::chrono::steady_clock::duration duration)
+  {
+    return std::chrono::duration<double, std::micro>{ duration }.count();
+  }
+
+  std::chrono::steady_clock::time_point m_start;
+  mutable std::mutex m_mutex;
+  std::vector<Event> m_events;
+  std::map<std::thread::id, int> m_threads;
+  std::map<int, std::string> m_threadNames;
+};
+
+// Records the time between construction and destruction as a span, if a
+// tracer was active at construction.
+class TraceSpan
+{
+public:
+  TraceSpan(char const* category, char const* name)
+    : m_tracer{ Tracer::Active() }
+    , m_category{ category }
+    , m_name{ name }
+  {
+    if (m_tracer)
+    {
+      m_start = std::chrono::steady_clock::now();
+    }
+  }
+
+  TraceSpan(char const* category, char const* name, char const* argumentName, uint32_t argumentValue)
+    : TraceSpan{ category, name }
+  {
+    m_arguments[0] = { argumentName, argumentValue };
+    m_argumentCount = 1;
+  }
+
+  TraceSpan(char const* category, char const* name, char const* argumentName, uint32_t argumentValue,
+    char const* secondArgumentName, uint32_t secondArgumentValue)
+    : TraceSpan{ category, name, argumentName, argumentValue }
+  {
+    m_arguments[1] = { secondArgumentName, secondArgumentValue };
+    m_argumentCount = 2;
+  }
+
+  TraceSpan(TraceSpan const&) = delete;
+  TraceSpan& operator=(TraceSpan const&) = delete;
+
+  void AddArgument(char const* name, uint32_t value)
+  {
+    if (m_argumentCount < MaxArguments)
+    {
+      m_arguments[m_argumentCount++] = { name, value };
+    }
+  }
+
+  ~TraceSpan()
+  {
+    if (m_tracer)
+    {
+      m_tracer->AddSpan(m_category, m_name, m_start, std::chrono::steady_clock::now(), m_arguments, m_argumentCount);
+    }
+  }
+
+private:
+  static constexpr size_t MaxArguments = 2;
+
+  Tracer* m_tracer;
+  char const* m_category;
+  char const* m_name;
+  std::chrono::steady_clock::time_point m_start{};
+  Tracer::Argument m_arguments[MaxArguments]{};
+  size_t m_argumentCount{ 0 };
+};
+
+// Makes a tracer active for its lifetime if a trace file is given, and writes
+// the trace when it goes away.
+class ScopedTrace
+{
+public:
+  explicit ScopedTrace(std::string path)
+    : m_path{ std::move(path) }
+  {
+    if (!m_path.empty())
+    {
+      m_tracer = std::make_unique<Tracer>();
+      m_tracer->NameThread("main");
+      Tracer::SetActive(m_tracer.get());
+    }
+  }
+
+  ScopedTrace(ScopedTrace const&) = delete;
+  ScopedTrace& operator=(ScopedTrace const&) = delete;
+
+  ~ScopedTrace()
+  {
+    if (m_tracer)
+    {
+      Tracer::SetActive(nullptr);
+      Flush();
+    }
+  }
+
+  // Writes what has been collected so far.
+  void Flush() const
+  {
+    if (m_tracer && !m_tracer->Write(m_path))
+    {
+      std::cerr << "Failed to write trace " << m_path << std::endl;
+    }
+  }
+
+private:
+  std::string m_path;
+  std::unique_ptr<Tracer> m_tracer;
+};
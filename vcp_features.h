@@ -0,0 +1,370 @@
+// vcp_features.h : MCCS 2.2a VCP feature names, types and named values, looked up at compile time.
+//
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+
+enum class VCPAccess : uint8_t
+{
+  ReadOnly,
+  WriteOnly,
+  ReadWrite
+};
+
+struct VCPValueName
+{
+  uint32_t Value;
+  std::string_view Name;
+};
+
+struct VCPFeatureDescription
+{
+  uint8_t Code;
+  std::string_view Name;
+  bool Continuous;
+  VCPAccess Access;
+  VCPValueName const* Values;
+  size_t ValueCount;
+  bool OnlyNamedValues;  // Monitors do not define values of their own, so others are rejected
+};
+
+inline constexpr VCPValueName VCPRestoreValues[] = {
+  { 0x01, "restore" },
+};
+
+inline constexpr VCPValueName VCPColorPresetValues[] = {
+  { 0x01, "srgb" },
+  { 0x02, "native" },
+  { 0x03, "4000k" },
+  { 0x04, "5000k" },
+  { 0x05, "6500k" },
+  { 0x06, "7500k" },
+  { 0x07, "8200k" },
+  { 0x08, "9300k" },
+  { 0x09, "10000k" },
+  { 0x0A, "11500k" },
+  { 0x0B, "user1" },
+  { 0x0C, "user2" },
+  { 0x0D, "user3" },
+};
+
+// Vendors add inputs of their own (USB-C in particular), so the list is not
+// exhaustive.
+inline constexpr VCPValueName VCPInputSourceValues[] = {
+  { 0x01, "vga1" },
+  { 0x02, "vga2" },
+  { 0x03, "dvi1" },
+  { 0x04, "dvi2" },
+  { 0x05, "composite1" },
+  { 0x06, "composite2" },
+  { 0x07, "svideo1" },
+  { 0x08, "svideo2" },
+  { 0x09, "tuner1" },
+  { 0x0A, "tuner2" },
+  { 0x0B, "tuner3" },
+  { 0x0C, "component1" },
+  { 0x0D, "component2" },
+  { 0x0E, "component3" },
+  { 0x0F, "displayport1" },
+  { 0x10, "displayport2" },
+  { 0x11, "hdmi1" },
+  { 0x12, "hdmi2" },
+};
+
+inline constexpr VCPValueName VCPAudioMuteValues[] = {
+  { 0x01, "mute" },
+  { 0x02, "unmute" },
+};
+
+inline constexpr VCPValueName VCPOsdValues[] = {
+  { 0x01, "disabled" },
+  { 0x02, "enabled" },
+};
+
+inline constexpr VCPValueName VCPPowerModeValues[] = {
+  { 0x01, "on" },
+  { 0x02, "standby" },
+  { 0x03, "suspend" },
+  { 0x04, "off" },
+  { 0x05, "off-button" },
+};
+
+inline constexpr VCPValueName VCPDisplayModeValues[] = {
+  { 0x00, "standard" },
+  { 0x01, "productivity" },
+  { 0x02, "mixed" },
+  { 0x03, "movie" },
+  { 0x04, "user" },
+  { 0x05, "games" },
+  { 0x06, "sports" },
+  { 0x07, "professional" },
+  { 0x08, "standard-intermediate" },
+  { 0x09, "standard-high" },
+  { 0x0A, "demo" },
+  { 0xF0, "dynamic-contrast" },
+};
+
+// Sorted by code. Names are lower case with dashes, as accepted on the command
+// line.
+inline constexpr VCPFeatureDescription VCPFeatureTable[] = {
+  { 0x02, "new-control-value", false, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0x04, "restore-factory-defaults", false, VCPAccess::WriteOnly, VCPRestoreValues, std::size(VCPRestoreValues), false },
+  { 0x05, "restore-factory-brightness-contrast", false, VCPAccess::WriteOnly, VCPRestoreValues, std::size(VCPRestoreValues), false },
+  { 0x06, "restore-factory-geometry", false, VCPAccess::WriteOnly, VCPRestoreValues, std::size(VCPRestoreValues), false },
+  { 0x08, "restore-factory-color", false, VCPAccess::WriteOnly, VCPRestoreValues, std::size(VCPRestoreValues), false },
+  { 0x0B, "color-temperature-increment", false, VCPAccess::ReadOnly, nullptr, 0, false },
+  { 0x0C, "color-temperature-request", true, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0x10, "brightness", true, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0x12, "contrast", true, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0x14, "color-preset", false, VCPAccess::ReadWrite, VCPColorPresetValues, std::size(VCPColorPresetValues), false },
+  { 0x16, "red-gain", true, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0x18, "green-gain", true, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0x1A, "blue-gain", true, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0x52, "active-control", false, VCPAccess::ReadOnly, nullptr, 0, false },
+  { 0x60, "input-source", false, VCPAccess::ReadWrite, VCPInputSourceValues, std::size(VCPInputSourceValues), false },
+  { 0x62, "audio-volume", true, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0x6C, "red-black-level", true, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0x6E, "green-black-level", true, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0x70, "blue-black-level", true, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0x87, "sharpness", true, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0x8D, "audio-mute", false, VCPAccess::ReadWrite, VCPAudioMuteValues, std::size(VCPAudioMuteValues), true },
+  { 0xAC, "horizontal-frequency", true, VCPAccess::ReadOnly, nullptr, 0, false },
+  { 0xAE, "vertical-frequency", true, VCPAccess::ReadOnly, nullptr, 0, false },
+  { 0xB2, "subpixel-layout", false, VCPAccess::ReadOnly, nullptr, 0, false },
+  { 0xB6, "display-technology", false, VCPAccess::ReadOnly, nullptr, 0, false },
+  { 0xC0, "display-usage-time", true, VCPAccess::ReadOnly, nullptr, 0, false },
+  { 0xC6, "application-enable-key", false, VCPAccess::ReadOnly, nullptr, 0, false },
+  { 0xC8, "display-controller-type", false, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0xC9, "firmware-level", true, VCPAccess::ReadOnly, nullptr, 0, false },
+  { 0xCA, "osd", false, VCPAccess::ReadWrite, VCPOsdValues, std::size(VCPOsdValues), true },
+  { 0xCC, "osd-language", false, VCPAccess::ReadWrite, nullptr, 0, false },
+  { 0xD6, "power-mode", false, VCPAccess::ReadWrite, VCPPowerModeValues, std::size(VCPPowerModeValues), true },
+  { 0xDC, "display-mode", false, VCPAccess::ReadWrite, VCPDisplayModeValues, std::size(VCPDisplayModeValues), false },
+  { 0xDF, "vcp-version", false, VCPAccess::ReadOnly, nullptr, 0, false },
+};
+
+constexpr size_t VCPFeatureCount = std::size(VCPFeatureTable);
+constexpr uint8_t NoVCPFeature = 0xFF;
+static_assert(VCPFeatureCount < NoVCPFeature, "Feature indices must fit in a byte");
+
+constexpr char ToLowerAscii(char c)
+{
+  return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+constexpr bool EqualsIgnoringCase(std::string_view a, std::string_view b)
+{
+  if (a.size() != b.size())
+  {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i)
+  {
+    if (ToLowerAscii(a[i]) != ToLowerAscii(b[i]))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// FNV-1a over the lower-cased name, started from the seed.
+constexpr uint32_t HashVCPFeatureName(std::string_view name, uint32_t seed)
+{
+  auto hash = 2166136261u ^ seed;
+  for (const auto c : name)
+  {
+    hash = (hash ^ static_cast<uint8_t>(ToLowerAscii(c))) * 16777619u;
+  }
+  return hash;
+}
+
+constexpr size_t VCPFeatureNameSlots = 256;
+
+// The first seed for which every feature name hashes to a slot of its own.
+constexpr uint32_t FindVCPFeatureNameSeed()
+{
+  for (uint32_t seed = 0; seed < 10000; ++seed)
+  {
+    bool used[VCPFeatureNameSlots]{};
+    auto collision = false;
+    for (size_t i = 0; i < VCPFeatureCount && !collision; ++i)
+    {
+      const auto slot = HashVCPFeatureName(VCPFeatureTable[i].Name, seed) % VCPFeatureNameSlots;
+      collision = used[slot];
+      used[slot] = true;
+    }
+    if (!collision)
+    {
+      return seed;
+    }
+  }
+  return UINT32_MAX;
+}
+
+constexpr uint32_t VCPFeatureNameSeed = FindVCPFeatureNameSeed();
+static_assert(VCPFeatureNameSeed != UINT32_MAX, "No perfect hash seed for the VCP feature names");
+
+constexpr std::array<uint8_t, VCPFeatureNameSlots> BuildVCPFeatureNameSlots()
+{
+  std::array<uint8_t, VCPFeatureNameSlots> slots{};
+  for (auto& slot : slots)
+  {
+    slot = NoVCPFeature;
+  }
+  for (size_t i = 0; i < VCPFeatureCount; ++i)
+  {
+    slots[HashVCPFeatureName(VCPFeatureTable[i].Name, VCPFeatureNameSeed) % VCPFeatureNameSlots] = static_cast<uint8_t>(i);
+  }
+  return slots;
+}
+
+constexpr std::array<uint8_t, 256> BuildVCPFeatureCodeSlots()
+{
+  std::array<uint8_t, 256> slots{};
+  for (auto& slot : slots)
+  {
+    slot = NoVCPFeature;
+  }
+  for (size_t i = 0; i < VCPFeatureCount; ++i)
+  {
+    slots[VCPFeatureTable[i].Code] = static_cast<uint8_t>(i);
+  }
+  return slots;
+}
+
+inline constexpr auto VCPFeatureNameSlotTable = BuildVCPFeatureNameSlots();
+inline constexpr auto VCPFeatureCodeSlotTable = BuildVCPFeatureCodeSlots();
+
+// Both lookups are one table access. A name is compared once, against the
+// only feature it can be.
+constexpr VCPFeatureDescription const* FindVCPFeature(uint8_t code)
+{
+  const auto index = VCPFeatureCodeSlotTable[code];
+  return index == NoVCPFeature ? nullptr : &VCPFeatureTable[index];
+}
+
+constexpr VCPFeatureDescription const* FindVCPFeature(std::string_view name)
+{
+  const auto index = VCPFeatureNameSlotTable[HashVCPFeatureName(name, VCPFeatureNameSeed) % VCPFeatureNameSlots];
+  if (index == NoVCPFeature || !EqualsIgnoringCase(VCPFeatureTable[index].Name, name))
+  {
+    return nullptr;
+  }
+  return &VCPFeatureTable[index];
+}
+
+// Value lists are short enough to search.
+constexpr VCPValueName const* FindVCPValue(VCPFeatureDescription const& feature, std::string_view name)
+{
+  for (size_t i = 0; i < feature.ValueCount; ++i)
+  {
+    if (EqualsIgnoringCase(feature.Values[i].Name, name))
+    {
+      return &feature.Values[i];
+    }
+  }
+  return nullptr;
+}
+
+constexpr VCPValueName const* FindVCPValue(VCPFeatureDescription const& feature, uint32_t value)
+{
+  for (size_t i = 0; i < feature.ValueCount; ++i)
+  {
+    if (feature.Values[i].Value == value)
+    {
+      return &feature.Values[i];
+    }
+  }
+  return nullptr;
+}
+
+enum class VCPWriteCheck
+{
+  Allowed,
+  ReadOnly,
+  ValueTooLarge,   // VCP values are 16 bits on the wire
+  UnknownValue
+};
+
+// Checks a write against the table before it goes to the monitor. Codes that
+// are not in the table are only checked for size.
+constexpr VCPWriteCheck CheckVCPWrite(uint8_t code, uint32_t value)
+{
+  if (value > 0xFFFF)
+  {
+    return VCPWriteCheck::ValueTooLarge;
+  }
+  const auto feature = FindVCPFeature(code);
+  if (!feature)
+  {
+    return VCPWriteCheck::Allowed;
+  }
+  if (feature->Access == VCPAccess::ReadOnly)
+  {
+    return VCPWriteCheck::ReadOnly;
+  }
+  if (feature->OnlyNamedValues && !FindVCPValue(*feature, value))
+  {
+    return VCPWriteCheck::UnknownValue;
+  }
+  return VCPWriteCheck::Allowed;
+}
+
+// For constants in code: the lookups fail to compile if the name is missing.
+constexpr uint8_t VCPCode(std::string_view name)
+{
+  return FindVCPFeature(name)->Code;
+}
+
+constexpr uint32_t VCPValue(std::string_view feature, std::string_view name)
+{
+  return FindVCPValue(*FindVCPFeature(feature), name)->Value;
+}
+
+// "0x60 (input-source)" for codes in the MCCS table, "0xe0" otherwise.
+inline std::string DescribeVCPCode(uint32_t code)
+{
+  std::ostringstream description;
+  description << "0x" << std::hex << code;
+  if (const auto feature = FindVCPFeature(static_cast<uint8_t>(code)))
+  {
+    description << " (" << feature->Name << ")";
+  }
+  return description.str();
+}
+
+// "0x11 (hdmi1)" for named values, "0x32" otherwise.
+inline std::string DescribeVCPValue(uint32_t code, uint32_t value)
+{
+  std::ostringstream description;
+  description << "0x" << std::hex << value;
+  const auto feature = FindVCPFeature(static_cast<uint8_t>(code));
+  if (const auto name = feature ? FindVCPValue(*feature, value) : nullptr)
+  {
+    description << " (" << name->Name << ")";
+  }
+  return description.str();
+}
+
+// "0xf (displayport1), 0x11 (hdmi1)"
+inline std::string DescribeVCPValues(uint32_t code, std::bitset<256> const& values)
+{
+  std::string description;
+  for (uint32_t value = 0; value < values.size(); ++value)
+  {
+    if (values.test(value))
+    {
+      description += (description.empty() ? "" : ", ") + DescribeVCPValue(code, value);
+    }
+  }
+  return description;
+}
@@ -0,0 +1,139 @@
+// vcp_table.h : Streaming reads and writes of MCCS table features (e.g. a LUT), fragment by fragment.
+//
+#pragma once
+
+#include "monitor_utils.h"
+#include "platform.h"
+#include "trace.h"
+
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+
+// A fragment that fails is tried again up to FragmentRetries more times
+// before the transfer gives up; the fragments that went through are kept.
+struct TablePolicy
+{
+  int FragmentRetries{ 3 };
+};
+
+struct TableTransfer
+{
+  bool Success{ false };
+  size_t Bytes{ 0 };
+  size_t Fragments{ 0 };
+  size_t Retries{ 0 };      // Fragments sent again after a failure
+  uint32_t Error{ 0 };      // Of the last failure
+  std::chrono::steady_clock::duration Elapsed{};
+};
+
+// Table offsets are 16 bits, so no table is longer than this.
+constexpr size_t MaxTableSize = 0x10000;
+
+// Reads the table until the monitor returns an empty fragment, writing each
+// fragment to out as soon as it arrives.
+inline TableTransfer ReadTable(MonitorUtils::Monitor const& monitor, uint8_t code, std::ostream& out, TablePolicy const& policy = {})
+{
+  TraceSpan span{ "operation", "Read table", "code", code };
+  const auto startTime = std::chrono::steady_clock::now();
+  TableTransfer transfer{};
+  auto success = true;
+  while (transfer.Bytes < MaxTableSize)
+  {
+    const auto offset = static_cast<uint16_t>(transfer.Bytes);
+    TableFragment fragment{};
+    success = false;
+    for (auto attempt = 0; !success && attempt <= policy.FragmentRetries; ++attempt)
+    {
+      transfer.Retries += attempt > 0 ? 1 : 0;
+      success = MonitorUtils::ReadTableFragment(monitor, code, offset, &fragment);
+      transfer.Error = success ? 0 : GetLastErrorCode();
+    }
+    if (!success || fragment.Size == 0)
+    {
+      break;
+    }
+    out.write(reinterpret_cast<char const*>(fragment.Data), fragment.Size);
+    transfer.Bytes += fragment.Size;
+    ++transfer.Fragments;
+  }
+  transfer.Success = success;
+  transfer.Elapsed = std::chrono::steady_clock::now() - startTime;
+  return transfer;
+}
+
+// Writes everything in in to the table from offset 0. Each fragment is queued
+// on the bus as soon as it is read from in, so preparing the next fragment
+// overlaps with sending the ones before it. Fragments that fail are queued
+// again, all together, once the previous pass is through; fragments carry
+// their offset, so the order they land in does not matter.
+inline TableTransfer WriteTable(MonitorUtils::Monitor const& monitor, uint8_t code, std::istream& in, TablePolicy const& policy = {})
+{
+  TraceSpan span{ "operation", "Write table", "code", code };
+  const auto startTime = std::chrono::steady_clock::now();
+  TableTransfer transfer{};
+  std::vector<TableFragment> fragments;
+  std::vector<std::future<TableWriteResult>> pending;
+  while (in && transfer.Bytes < MaxTableSize)
+  {
+    TableFragment fragment{};
+    fragment.Offset = static_cast<uint16_t>(transfer.Bytes);
+    in.read(reinterpret_cast<char*>(fragment.Data), TableFragmentSize);
+    fragment.Size = static_cast<uint8_t>(in.gcount());
+    if (fragment.Size == 0)
+    {
+      break;
+    }
+    pending.push_back(MonitorUtils::QueueTableWrite(monitor, code, fragment));
+    fragments.push_back(fragment);
+    transfer.Bytes += fragment.Size;
+  }
+  transfer.Fragments = fragments.size();
+  if (in && in.peek() != std::istream::traits_type::eof())
+  {
+    // Drain what was queued before giving up on a table that cannot fit.
+    for (auto& write : pending)
+    {
+      (void)write.get();
+    }
+    transfer.Error = NotSupportedErrorCode;
+    transfer.Elapsed = std::chrono::steady_clock::now() - startTime;
+    return transfer;
+  }
+
+  for (auto attempt = 0;; ++attempt)
+  {
+    std::vector<TableFragment> failed;
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+      const auto result = pending[i].get();
+      if (!result.Success)
+      {
+        failed.push_back(fragments[i]);
+        transfer.Error = result.Error;
+      }
+    }
+    if (failed.empty() || attempt == policy.FragmentRetries)
+    {
+      transfer.Success = failed.empty();
+      break;
+    }
+    pending.clear();
+    for (const auto& fragment : failed)
+    {
+      pending.push_back(MonitorUtils::QueueTableWrite(monitor, code, fragment));
+    }
+    transfer.Retries += failed.size();
+    fragments = std::move(failed);
+  }
+  if (transfer.Success)
+  {
+    transfer.Error = 0;
+  }
+  transfer.Elapsed = std::chrono::steady_clock::now() - startTime;
+  return transfer;
+}
@@ -0,0 +1,156 @@
+// watch.h : Polling VCP codes for changes made elsewhere (e.g. the OSD buttons) and reporting them as NDJSON.
+//
+#pragma once
+
+#include "json.h"
+#include "monitor_utils.h"
+#include "trace.h"
+#include "vcp_features.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+
+// The poll interval drops to MinInterval after a change, since OSD changes
+// come in bursts (a brightness slider sends a value per step), and doubles
+// after every poll that sees nothing new, up to MaxInterval.
+struct WatchPolicy
+{
+  std::chrono::milliseconds MinInterval{ 100 };
+  std::chrono::milliseconds MaxInterval{ 2000 };
+};
+
+// Writes one JSON object per line. Lines from several watchers never mix, and
+// each is flushed as soon as it is complete so a reader sees events live.
+class WatchEventWriter
+{
+public:
+  explicit WatchEventWriter(std::ostream& out)
+    : m_out{ out }
+    , m_start{ std::chrono::steady_clock::now() }
+  {
+  }
+
+  WatchEventWriter(WatchEventWriter const&) = delete;
+  WatchEventWriter& operator=(WatchEventWriter const&) = delete;
+
+  // previous is null for the first value read.
+  void Value(int index, uint8_t code, uint32_t value, uint32_t const* previous)
+  {
+    std::ostringstream line;
+    const auto feature = Begin(line, index, code);
+    line << ",\"value\":" << value;
+    WriteValueName(line, feature, "valueName", value);
+    if (previous)
+    {
+      line << ",\"previous\":" << *previous;
+      WriteValueName(line, feature, "previousName", *previous);
+    }
+    End(line);
+  }
+
+  void Error(int index, uint8_t code, uint32_t error)
+  {
+    std::ostringstream line;
+    Begin(line, index, code);
+    line << ",\"error\":" << error;
+    End(line);
+  }
+
+private:
+
+  VCPFeatureDescription const* Begin(std::ostream& line, int index, uint8_t code) const
+  {
+    const auto feature = FindVCPFeature(code);
+    line << std::fixed << std::setprecision(3) << "{\"ms\":" << std::chrono::duration<double, std::milli>{ std::chrono::steady_clock::now() - m_start }.count() <<
+      ",\"monitor\":" << index << ",\"code\":\"0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<uint32_t>(code) <<
+      std::setfill(' ') << std::dec << "\"";
+    if (feature)
+    {
+      line << ",\"name\":";
+      WriteJsonString(line, feature->Name);
+    }
+    return feature;
+  }
+
+  static void WriteValueName(std::ostream& line, VCPFeatureDescription const* feature, char const* key, uint32_t value)
+  {
+    if (const auto name = feature ? FindVCPValue(*feature, value) : nullptr)
+    {
+      line << ",\"" << key << "\":";
+      WriteJsonString(line, name->Name);
+    }
+  }
+
+  void End(std::ostringstream& line)
+  {
+    line << "}\n";
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    m_out << line.str() << std::flush;
+  }
+
+  std::ostream& m_out;
+  std::chrono::steady_clock::time_point m_start;
+  std::mutex m_mutex;
+};
+
+// Polls the codes until the process ends. The first successful read of each
+// code is reported, then every change and every read that starts failing.
+// All codes are read in one batch per poll, so they go out back to back and
+// share the bus with any other caller's reads of the same codes.
+inline void WatchMonitor(
+  int index,
+  MonitorUtils::Monitor const& monitor,
+  std::vector<uint8_t> const& codes,
+  WatchPolicy const& policy,
+  WatchEventWriter& events)
+{
+  struct State
+  {
+    bool Known{ false };
+    bool Failing{ false };
+    uint32_t Value{ 0 };
+  };
+  std::vector<State> states(codes.size());
+  auto interval = policy.MinInterval;
+  for (;;)
+  {
+    auto changed = false;
+    {
+      TraceSpan span{ "operation", "Watch poll", "index", static_cast<uint32_t>(index) };
+      const auto results = MonitorUtils::GetVCPFeatures(monitor, codes);
+      for (size_t i = 0; i < results.size(); ++i)
+      {
+        auto& state = states[i];
+        const auto& result = results[i];
+        if (!result.Result.Success)
+        {
+          if (!state.Failing)
+          {
+            events.Error(index, result.Code, result.Error);
+          }
+          state.Failing = true;
+          continue;
+        }
+        state.Failing = false;
+        if (!state.Known || result.Result.CurrentValue != state.Value)
+        {
+          const auto previous = state.Value;
+          events.Value(index, result.Code, result.Result.CurrentValue, state.Known ? &previous : nullptr);
+          changed = changed || state.Known;
+          state.Known = true;
+          state.Value = result.Result.CurrentValue;
+        }
+      }
+    }
+    interval = changed ? policy.MinInterval : (std::min)(interval * 2, policy.MaxInterval);
+    std::this_thread::sleep_for(interval);
+  }
+}
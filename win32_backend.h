@@ -0,0 +1,245 @@
+// win32_backend.h : DDC/CI through the Windows monitor configuration API (Dxva2).
+//
+#pragma once
+
+#include <windows.h>
+#include <highlevelmonitorconfigurationapi.h>
+#include <lowlevelmonitorconfigurationapi.h>
+#include <physicalmonitorenumerationapi.h>
+#include <WinUser.h>
+
+#include "edid.h"
+#include "monitor_backend.h"
+#include "trace.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+
+class Win32MonitorDevice : public MonitorDevice
+{
+public:
+  explicit Win32MonitorDevice(HMONITOR handle)
+    : m_handle{ handle }
+  {
+    TraceSpan span{ "open", "GetPhysicalMonitorsFromHMONITOR" };
+    DWORD numPhysicalMonitors = 0;
+    if (GetNumberOfPhysicalMonitorsFromHMONITOR(m_handle, &numPhysicalMonitors) && numPhysicalMonitors == 1)
+    {
+      PHYSICAL_MONITOR physicalMonitor;
+      if (GetPhysicalMonitorsFromHMONITOR(m_handle, 1, &physicalMonitor))
+      {
+        m_physicalHandle = physicalMonitor;
+      }
+    }
+  }
+
+  Win32MonitorDevice(Win32MonitorDevice const&) = delete;
+  Win32MonitorDevice& operator=(Win32MonitorDevice const&) = delete;
+
+  ~Win32MonitorDevice() override
+  {
+    if (m_physicalHandle.hPhysicalMonitor)
+    {
+      DestroyPhysicalMonitors(1, &m_physicalHandle);
+    }
+  }
+
+  MonitorInfo GetInfo() override
+  {
+    MonitorInfo monitorInfo{};
+    MONITORINFOEX winMonitorInfo{};
+    winMonitorInfo.cbSize = sizeof winMonitorInfo;
+    if (::GetMonitorInfo(m_handle, &winMonitorInfo) != 0)
+    {
+      monitorInfo.Primary = winMonitorInfo.dwFlags & MONITORINFOF_PRIMARY;
+      monitorInfo.Name = winMonitorInfo.szDevice;
+    }
+    return monitorInfo;
+  }
+
+  // Reads the EDID that Windows stores under the monitor's device instance key.
+  MonitorIdentity GetIdentity() override
+  {
+    TraceSpan span{ "open", "Read EDID from registry" };
+    MonitorIdentity identity{};
+    MONITORINFOEX winMonitorInfo{};
+    winMonitorInfo.cbSize = sizeof winMonitorInfo;
+    if (::GetMonitorInfo(m_handle, &winMonitorInfo) == 0)
+    {
+      return identity;
+    }
+
+    DISPLAY_DEVICE displayDevice{};
+    displayDevice.cb = sizeof displayDevice;
+    if (!EnumDisplayDevices(winMonitorInfo.szDevice, 0, &displayDevice, EDD_GET_DEVICE_INTERFACE_NAME))
+    {
+      return identity;
+    }
+
+    // The device interface path looks like
+    // \\?\DISPLAY#DEL40B6#5&2a5bd9f6&0&UID4353#{e6f07b5f-ee97-4a90-b076-33f57bf4eaa7}
+    // and the instance key is DISPLAY\DEL40B6\5&2a5bd9f6&0&UID4353.
+    std::string instance{ displayDevice.DeviceID };
+    const std::string interfacePrefix{ "\\\\?\\" };
+    if (instance.compare(0, interfacePrefix.size(), interfacePrefix) == 0)
+    {
+      instance.erase(0, interfacePrefix.size());
+    }
+    const auto classGuid = instance.rfind('#');
+    if (classGuid == std::string::npos)
+    {
+      return identity;
+    }
+    instance.erase(classGuid);
+    for (auto& c : instance)
+    {
+      if (c == '#')
+      {
+        c = '\\';
+      }
+    }
+
+    const auto keyPath = "SYSTEM\\CurrentControlSet\\Enum\\" + instance + "\\Device Parameters";
+    HKEY key{};
+    if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, keyPath.c_str(), 0, KEY_READ, &key) == ERROR_SUCCESS)
+    {
+      BYTE edid[256];
+      DWORD size = sizeof edid;
+      if (RegQueryValueEx(key, "EDID", nullptr, nullptr, edid, &size) == ERROR_SUCCESS)
+      {
+        identity = ParseEdidIdentity(edid, size);
+      }
+      RegCloseKey(key);
+    }
+    return identity;
+  }
+
+  VCPFeatureResult GetVCPFeature(uint8_t code) override
+  {
+    VCPFeatureResult value{};
+    MC_VCP_CODE_TYPE codeType{};
+    DWORD currentValue = 0;
+    DWORD maxValue = 0;
+    value.Success = ::GetVCPFeatureAndVCPFeatureReply(
+      m_physicalHandle.hPhysicalMonitor,
+      code,
+      &codeType,
+      &currentValue,
+      &maxValue);
+    value.CodeType = (codeType == MC_MOMENTARY) ? VCPCodeType::Momentary : VCPCodeType::SetParameter;
+    value.CurrentValue = currentValue;
+    value.MaxValue = maxValue;
+    return value;
+  }
+
+  bool SetVCPFeature(uint8_t code, uint32_t value) override
+  {
+    return ::SetVCPFeature(
+      m_physicalHandle.hPhysicalMonitor,
+      code,
+      value);
+  }
+
+  bool GetCapabilitiesString(std::string* capabilities) override
+  {
+    DWORD lowLevelCapabilitiesStringLength = 0;
+    if (GetCapabilitiesStringLength(
+      m_physicalHandle.hPhysicalMonitor,
+      &lowLevelCapabilitiesStringLength))
+    {
+      std::vector<char> buffer;
+      buffer.resize(lowLevelCapabilitiesStringLength);
+      if (CapabilitiesRequestAndCapabilitiesReply(
+        m_physicalHandle.hPhysicalMonitor,
+        buffer.data(),
+        lowLevelCapabilitiesStringLength))
+      {
+        *capabilities = buffer.data();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  HighLevelCapabilities GetHighLevelCapabilities() override
+  {
+    DWORD cap = 0;
+    DWORD supportedColorTemperatures = 0;
+    HighLevelCapabilities highLevelCapabilities{};
+    if (GetMonitorCapabilities(m_physicalHandle.hPhysicalMonitor, &cap, &supportedColorTemperatures))
+    {
+      highLevelCapabilities.Valid = true;
+      highLevelCapabilities.None = cap & MC_CAPS_NONE;
+      highLevelCapabilities.Brightness = cap & MC_CAPS_BRIGHTNESS;
+      highLevelCapabilities.ColorTemperature = cap & MC_CAPS_COLOR_TEMPERATURE;
+      highLevelCapabilities.Contrast = cap & MC_CAPS_CONTRAST;
+      highLevelCapabilities.Degauss = cap & MC_CAPS_DEGAUSS;
+      highLevelCapabilities.DisplayAreaPosition = cap & MC_CAPS_DISPLAY_AREA_POSITION;
+      highLevelCapabilities.DisplayAreaSize = cap & MC_CAPS_DISPLAY_AREA_SIZE;
+      highLevelCapabilities.MonitorTechnologyType = cap & MC_CAPS_MONITOR_TECHNOLOGY_TYPE;
+      highLevelCapabilities.RedGreenBlueDrive = cap & MC_CAPS_RED_GREEN_BLUE_DRIVE;
+      highLevelCapabilities.RedGreenBlueGain = cap & MC_CAPS_RED_GREEN_BLUE_GAIN;
+      highLevelCapabilities.RestoreFactoryColorDefaults = cap & MC_CAPS_RESTORE_FACTORY_COLOR_DEFAULTS;
+      highLevelCapabilities.RestoreFactoryDefaults = cap & MC_CAPS_RESTORE_FACTORY_DEFAULTS;
+      highLevelCapabilities.RestoreFactoryDefaultsEnablesMonitorSettings = cap & MC_RESTORE_FACTORY_DEFAULTS_ENABLES_MONITOR_SETTINGS;
+    }
+    return highLevelCapabilities;
+  }
+
+  // Dxva2 waits out the DDC/CI delays inside each call.
+  CommandGaps GetCommandGaps() override
+  {
+    return { std::chrono::milliseconds{ 0 }, std::chrono::milliseconds{ 0 }, std::chrono::milliseconds{ 0 } };
+  }
+
+private:
+  HMONITOR m_handle{ nullptr };
+  PHYSICAL_MONITOR m_physicalHandle{ nullptr };
+};
+
+class Win32Backend : public MonitorBackend
+{
+public:
+  std::unique_ptr<MonitorDevice> Open(int index) override
+  {
+    MonitorParam monitorParam{};
+    monitorParam.Index = index;
+    {
+      TraceSpan span{ "open", "EnumDisplayMonitors" };
+      auto hdc = GetDC(NULL);
+      (void)EnumDisplayMonitors(hdc, NULL, GetMonitorByIndex, reinterpret_cast<LPARAM>(&monitorParam));
+      ReleaseDC(NULL, hdc);
+    }
+    if (!monitorParam.Monitor)
+    {
+      return nullptr;
+    }
+    return std::make_unique<Win32MonitorDevice>(monitorParam.Monitor);
+  }
+
+private:
+
+  struct MonitorParam
+  {
+    HMONITOR Monitor{ nullptr };
+    int Index{ 0 };
+  };
+
+  static BOOL CALLBACK GetMonitorByIndex(
+    HMONITOR monitor,
+    HDC deviceContext,
+    LPRECT rect,
+    LPARAM applicationDefinedData
+  )
+  {
+    auto monitorParam = reinterpret_cast<MonitorParam*>(applicationDefinedData);
+    if (--monitorParam->Index < 0)
+    {
+      monitorParam->Monitor = monitor;
+      return FALSE; // Stop enumeration
+    }
+    return TRUE; // Continue enumeration
+  }
+};